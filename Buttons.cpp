@@ -0,0 +1,121 @@
+//
+// Debounced button input, driven by pin change interrupts and Timer0
+//
+
+#include "Buttons.h"
+#include "Metronome.h"
+#include "pindefs.h"
+#include "byte_ops.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+static_assert(DEBOUNCE_TICKS == 4, "the vertical counters count to 4");
+
+static constexpr uint16_t REPEAT_DELAY_TICKS = timerTicks(INCREMENT_REPEAT_DELAY);
+static constexpr uint16_t LONG_PRESS_TICKS = timerTicks(LONG_PRESS_TIME);
+static_assert(REPEAT_DELAY_TICKS <= 255, "the repeat delay is too long to count in a byte");
+
+Buttons::Buttons(uint8_t pin_mask) noexcept
+    : pin_mask(pin_mask)
+    , debounced(0)
+    , count0(0xFF)
+    , count1(0xFF)
+    , settling(0)
+    , since_change(NO_CHANGE)
+    , max_latency(0)
+    , edge_time(0)
+    , held(0)
+    , held_ticks(0)
+    , repeat_left(0)
+    , repeat_period(1)
+    , events()
+{ }
+
+void Buttons::setup() {
+    auto sreg = SREG;
+    cli();
+    // PCINT8-13 are PC0-5
+    PCMSK1 |= pin_mask;
+    // (writing a one clears the flag)
+    PCIFR = _BV(PCIF1);
+    bitSet(PCICR, PCIE1);
+    // in case a button is already held down
+    pinChange();
+    SREG = sreg;
+}
+
+void Buttons::tick() {
+    if (held != 0) {
+        time_hold();
+    }
+    if (settling != 0) {
+        if (since_change != NO_CHANGE) {
+            since_change++;
+        }
+        debounce();
+        if (--settling == 0) {
+            // it was just noise
+            since_change = NO_CHANGE;
+        }
+    }
+}
+
+/*
+ * The counters count down from 3 (both bits set) on each tick that a pin
+ * doesn't match the debounced state, and reset to 3 when it does, so when
+ * they get back round to 3 the pin has been different for 4 ticks.
+ */
+void Buttons::debounce() {
+    // the pins read low when the buttons are pressed
+    uint8_t pressed = static_cast<uint8_t>(~INPUT_REGISTER & pin_mask);
+    uint8_t different = pressed ^ debounced;
+    count0 = static_cast<uint8_t>(~(count0 & different));
+    count1 = static_cast<uint8_t>(count0 ^ (count1 & different));
+    uint8_t changed = different & count0 & count1;
+    if (changed != 0) {
+        debounced ^= changed;
+        queue_changes(changed);
+    }
+}
+
+void Buttons::queue_changes(uint8_t changed) {
+    for (uint8_t pin = 0; pin < 8; ++pin) {
+        uint8_t bit = _BV(pin);
+        if (!(changed & bit)) {
+            continue;
+        }
+        if (debounced & bit) {
+            events.push({ButtonEvent::PRESS, pin, edge_time});
+            held = bit;
+            held_ticks = 0;
+            repeat_left = REPEAT_DELAY_TICKS;
+        } else {
+            events.push({ButtonEvent::RELEASE, pin, edge_time});
+            if (held == bit) {
+                held = 0;
+            }
+        }
+    }
+
+    if (since_change != NO_CHANGE) {
+        if (since_change > max_latency) {
+            max_latency = since_change;
+        }
+        since_change = NO_CHANGE;
+    }
+}
+
+void Buttons::time_hold() {
+    uint8_t pin = 0;
+    while (!(held & _BV(pin))) {
+        ++pin;
+    }
+    if (held_ticks < LONG_PRESS_TICKS && ++held_ticks == LONG_PRESS_TICKS) {
+        events.push({ButtonEvent::LONG_PRESS, pin, 0});
+    }
+    if (--repeat_left == 0) {
+        events.push({ButtonEvent::REPEAT, pin, 0});
+        repeat_left = repeat_period;
+    }
+}
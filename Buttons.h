@@ -0,0 +1,124 @@
+//
+// Debounced button input, driven by pin change interrupts and Timer0
+//
+
+#ifndef METRONOME_BUTTONS_H
+#define METRONOME_BUTTONS_H
+
+#include "EventQueue.h"
+#include "TimerWheel.h"
+#include "millis.h"
+
+#include <stdint.h>
+
+// how many Timer0 overflows in a row a button has to read the same for it to change
+// (fixed by the debouncing, see Buttons)
+#define DEBOUNCE_TICKS 4
+
+struct ButtonEvent {
+    enum Type : uint8_t {
+        PRESS,
+        RELEASE,
+        // the button has been held down for a while, and is still held
+        REPEAT,
+        // once per press, after LONG_PRESS_TIME
+        LONG_PRESS,
+    };
+    Type type;
+    // the pin number, e.g. SWITCHU
+    uint8_t button;
+    /* For presses and releases, the micros() of the first edge which led to
+     * the event, i.e. when the button was actually pressed or released.
+     */
+    uint32_t time;
+};
+
+/*
+ * Reads buttons which pull the given pins of the input port low, so that the
+ * main loop gets one press and one release for each real press, however much
+ * the contacts bounce.
+ *
+ * Each pin is debounced with a two bit vertical counter (all pins are counted
+ * at once, one bit of each counter per byte), which has to see the new state
+ * DEBOUNCE_TICKS times in a row before it's accepted. This only runs for a
+ * few ticks after each pin change interrupt, and while a button is held,
+ * which is timed for the repeat and long press events. So a press or release
+ * is queued DEBOUNCE_TICKS ticks (up to about 8ms) after the last bounce.
+ */
+class Buttons {
+public:
+    explicit Buttons(uint8_t pin_mask) noexcept;
+
+    // enables the pin change interrupt for the buttons' pins
+    void setup();
+
+    // needs to be called from the PCINT1 ISR
+    void pinChange() {
+        settling = DEBOUNCE_TICKS + 1u;
+        if (since_change == NO_CHANGE) {
+            since_change = 0;
+            edge_time = micros();
+        }
+    }
+
+    // needs to be called from the Timer0 overflow ISR
+    void tick();
+
+    /* How long to wait between REPEAT events while the button is held, in
+     * ticks (see timerTicks()). Takes effect from the next one, so it can be
+     * changed while the button is held, to speed up. The first one is always
+     * after INCREMENT_REPEAT_DELAY.
+     */
+    void setRepeatPeriod(uint8_t ticks) {
+        repeat_period = ticks != 0 ? ticks : 1u;
+    }
+
+    // Main loop side. Returns false if there are no events waiting.
+    bool pop(ButtonEvent& e) {
+        return events.pop(e);
+    }
+
+    // which buttons are down, after debouncing (as a mask of pins)
+    uint8_t state() const {
+        return debounced;
+    }
+
+    /* The most ticks between a pin change and the event it caused being
+     * queued so far. (The pin change was sometime during the first tick.)
+     */
+    uint8_t maxLatency() const {
+        return max_latency;
+    }
+
+private:
+    // (not waiting for an event)
+    static constexpr uint8_t NO_CHANGE = 0xFF;
+
+    const uint8_t pin_mask;
+    // pressed buttons are ones
+    volatile uint8_t debounced;
+    // the vertical counters
+    uint8_t count0;
+    uint8_t count1;
+    // ticks left before the pins are assumed to have stopped bouncing
+    volatile uint8_t settling;
+    // ticks since the first pin change which hasn't resulted in an event yet
+    volatile uint8_t since_change;
+    volatile uint8_t max_latency;
+    // when the first of those pin changes happened
+    uint32_t edge_time;
+
+    // only the button pressed last repeats
+    uint8_t held;
+    uint16_t held_ticks;
+    uint8_t repeat_left;
+    volatile uint8_t repeat_period;
+
+    EventQueue<ButtonEvent, 8> events;
+
+    void debounce();
+    void queue_changes(uint8_t changed);
+    void time_hold();
+};
+
+#endif //METRONOME_BUTTONS_H
@@ -0,0 +1,114 @@
+//
+// Locking on to an external clock
+//
+
+#include "ClockPll.h"
+#include "Metronome.h"
+
+/* How many pulses in a row have to be close to the predictions to be locked,
+ * at most. Slower clocks only need a beat's worth.
+ */
+#define PLL_LOCK_PULSES 32
+
+// the longest and shortest beats the pulses can make, for the BPM range
+static constexpr uint32_t PLL_MAX_BEAT_US = 60000000ul / HARD_MIN_BPM;
+static constexpr uint32_t PLL_MIN_BEAT_US = 60000000ul / SOFT_MAX_BPM;
+// (so that the period times the pulses per beat fits in 32 bits)
+static_assert(PLL_MAX_BEAT_US < UINT32_MAX >> 8u, "the beat is too long to keep to 1/256 us");
+
+ClockPll::ClockPll(uint8_t pulses_per_beat, uint8_t phase_shift, uint8_t period_shift) noexcept
+    : pulses_per_beat(pulses_per_beat)
+    , phase_shift(phase_shift)
+    // (the period's steps are 1/256 us, so it can't take smaller ones)
+    , period_shift(period_shift < 8u ? period_shift : 8u)
+    , lock_pulses(pulses_per_beat < PLL_LOCK_PULSES ? pulses_per_beat + 1u : PLL_LOCK_PULSES)
+    , pulses(0)
+    // (see restart())
+    , index(static_cast<uint8_t>(pulses_per_beat - 1u))
+    , locked(false)
+    , predicted(0)
+    , fraction(0)
+    , period(0)
+{ }
+
+void ClockPll::restart() {
+    // (so that the next one is 0)
+    index = static_cast<uint8_t>(pulses_per_beat - 1u);
+}
+
+void ClockPll::reset() {
+    pulses = 0;
+    locked = false;
+    restart();
+}
+
+bool ClockPll::pulse(uint32_t time) {
+    index = static_cast<uint8_t>(index + 1u == pulses_per_beat ? 0 : index + 1u);
+    if (pulses == 0) {
+        // nothing to go on yet
+        predicted = time;
+        fraction = 0;
+        pulses = 1;
+        return false;
+    }
+
+    uint32_t interval = time - predicted;
+    if (period == 0) {
+        // the second pulse gives the first guess at the period
+        uint32_t beat = interval * pulses_per_beat;
+        if (beat > PLL_MAX_BEAT_US || beat < PLL_MIN_BEAT_US) {
+            predicted = time;
+            return false;
+        }
+        period = interval << 8u;
+        predicted = time;
+        fraction = 0;
+    } else {
+        uint32_t step = period + fraction;
+        predicted += step >> 8u;
+        fraction = static_cast<uint8_t>(step);
+        auto error = static_cast<int32_t>(time - predicted);
+
+        // a missed or extra pulse, or the tempo jumping: start again from here
+        auto half_period = static_cast<int32_t>(period >> 9u);
+        if (error > half_period || error < -half_period) {
+            pulses = 1;
+            locked = false;
+            period = 0;
+            predicted = time;
+            fraction = 0;
+            return false;
+        }
+
+        predicted += static_cast<uint32_t>(error >> phase_shift);
+        period += static_cast<uint32_t>(error * (1l << (8u - period_shift)));
+    }
+
+    if (pulses < lock_pulses) {
+        pulses++;
+    }
+    locked = pulses >= lock_pulses;
+    return locked && index == pulses_per_beat / 2u;
+}
+
+uint16_t ClockPll::tempo() const {
+    if (period == 0) {
+        return 0;
+    }
+    // (the same as in TapTempo)
+    uint32_t half_beat = (period * pulses_per_beat) >> 9u;
+    uint32_t t = (30000000ul * TEMPO_SCALE + half_beat / 2u) / half_beat;
+    constexpr uint32_t min_tempo = HARD_MIN_BPM * TEMPO_SCALE;
+    constexpr uint32_t max_tempo = SOFT_MAX_BPM * TEMPO_SCALE;
+    // (the period can wander a little outside the range it started in)
+    if (t < min_tempo) {
+        t = min_tempo;
+    } else if (t > max_tempo) {
+        t = max_tempo;
+    }
+    return static_cast<uint16_t>(t);
+}
+
+uint32_t ClockPll::beatStart() const {
+    return predicted - ((period * index) >> 8u);
+}
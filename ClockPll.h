@@ -0,0 +1,76 @@
+//
+// Locking on to an external clock
+//
+
+#ifndef METRONOME_CLOCKPLL_H
+#define METRONOME_CLOCKPLL_H
+
+#include <stdint.h>
+
+/*
+ * Follows a clock which pulses a fixed number of times per beat, e.g. MIDI
+ * clock, with a second order delay locked loop: it predicts when each pulse
+ * should come from the last prediction and the period, and then nudges both
+ * by a fraction of how far out the prediction was. So the predictions make a
+ * smooth, evenly spaced grid which follows the real pulses, without their
+ * jitter, and which the metronome can be lined up with (see beatStart()).
+ *
+ * How hard the loop pulls towards each pulse is given as shifts: the phase
+ * moves by 1/2^phase_shift of each pulse's error, and the period by
+ * 1/2^period_shift of it. Smaller steps smooth out more of the jitter, but
+ * take longer to follow a tempo change. The loop is close to critically
+ * damped when the period gain is about half the square of the phase gain.
+ *
+ * Times are micros(), and the period is kept to 1/256 us, so the predictions
+ * don't drift. All the maths is 32 bit integer.
+ */
+class ClockPll {
+public:
+    ClockPll(uint8_t pulses_per_beat, uint8_t phase_shift, uint8_t period_shift) noexcept;
+
+    /* The next pulse starts a beat (e.g. after MIDI Start). The period that
+     * has been measured so far is kept.
+     */
+    void restart();
+    /* Starts again from the next pulse, e.g. when the clock stops coming. The
+     * period is kept as the first guess (see tempo()), so a clock which comes
+     * back at the same tempo is locked on to straight away.
+     */
+    void reset();
+
+    /* Adds a pulse which came at the given time. Returns true if the
+     * metronome should be lined up with the beat now, which is once a beat,
+     * while it's locked. That's half way through the beat, well away from
+     * where small changes would make the start of the beat come twice, or not
+     * at all, except with one pulse a beat, when the caller has to wait half
+     * a beat itself.
+     */
+    bool pulse(uint32_t time);
+
+    bool isLocked() const {
+        return locked;
+    }
+    // in hundredths of a BPM, or 0 if it isn't known (even roughly) yet
+    uint16_t tempo() const;
+    // when the current beat started, on the smoothed grid (a micros() time)
+    uint32_t beatStart() const;
+
+private:
+    const uint8_t pulses_per_beat;
+    const uint8_t phase_shift;
+    const uint8_t period_shift;
+    // how many pulses in a row have to be close to the predictions to be locked
+    const uint8_t lock_pulses;
+    // how many pulses it's had since reset(), up to lock_pulses
+    uint8_t pulses;
+    // which pulse of the beat the last one was
+    uint8_t index;
+    bool locked;
+    // when the last pulse should have come, and the fraction of a us beyond that
+    uint32_t predicted;
+    uint8_t fraction;
+    // in 1/256 us
+    uint32_t period;
+};
+
+#endif //METRONOME_CLOCKPLL_H
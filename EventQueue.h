@@ -0,0 +1,67 @@
+#ifndef METRONOME_EVENTQUEUE_H
+#define METRONOME_EVENTQUEUE_H
+
+#include "byte_ops.h"
+#include <avr/cpufunc.h>
+
+/*
+ * Fixed size, lock free ring buffer, for passing events from exactly one
+ * producer to exactly one consumer, e.g. from an ISR to the main loop.
+ *
+ * The producer only ever writes head and the consumer only ever writes tail,
+ * and both are single bytes (so reading and writing them is atomic), so
+ * neither side needs to disable interrupts. Each side copies the slot before
+ * publishing its new index, so the other side never sees a half written event.
+ *
+ * One slot is always left empty to tell a full queue from an empty one, so
+ * SIZE - 1 events can be queued. SIZE must be a power of two (at most 128).
+ */
+template <typename T, uint8_t SIZE>
+class EventQueue {
+    static_assert(SIZE >= 2 && SIZE <= 128 && (SIZE & (SIZE - 1)) == 0, "SIZE must be a power of two");
+    static constexpr uint8_t MASK = SIZE - 1;
+
+public:
+    EventQueue() noexcept : head(0), tail(0), data{} {}
+
+    // Producer side. Returns false (and drops the event) if the queue is full
+    bool push(const T& item) {
+        uint8_t h = head;
+        uint8_t next = static_cast<uint8_t>((h + 1u) & MASK);
+        if (next == tail) {
+            return false;
+        }
+        data[h] = item;
+        _MemoryBarrier();
+        head = next;
+        return true;
+    }
+
+    // Consumer side. Returns false if there was nothing to remove.
+    bool pop(T& item) {
+        uint8_t t = tail;
+        if (t == head) {
+            return false;
+        }
+        item = data[t];
+        _MemoryBarrier();
+        tail = static_cast<uint8_t>((t + 1u) & MASK);
+        return true;
+    }
+
+    bool isEmpty() const {
+        return head == tail;
+    }
+
+    // Consumer side; discards everything currently in the queue
+    void clear() {
+        tail = head;
+    }
+
+private:
+    volatile uint8_t head;
+    volatile uint8_t tail;
+    T data[SIZE];
+};
+
+#endif //METRONOME_EVENTQUEUE_H
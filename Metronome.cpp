@@ -4,6 +4,43 @@
 
 #include <avr/interrupt.h>
 #include <avr/io.h>
+#include <avr/pgmspace.h>
+
+/*
+ * Timer periods for every whole BPM from SOFT_MIN_BPM to SOFT_MAX_BPM,
+ * worked out at compile time and stored in flash, so that changing the BPM
+ * using the buttons doesn't need any divisions.
+ */
+struct TempoTable {
+    static constexpr uint8_t size = SOFT_MAX_BPM - SOFT_MIN_BPM + 1;
+    TimerPeriods periods[size];
+
+    constexpr TempoTable() noexcept : periods() {
+        for (uint8_t i = 0; i < size; ++i) {
+            periods[i] = TimerPeriods::forTempo((SOFT_MIN_BPM + i) * static_cast<uint16_t>(TEMPO_SCALE));
+        }
+    }
+};
+
+static constexpr TempoTable tempo_table PROGMEM = TempoTable();
+
+static TimerPeriods periods_for_bpm(uint8_t bpm) {
+    if (bpm < SOFT_MIN_BPM || bpm > SOFT_MAX_BPM) {
+        // not in the table
+        return TimerPeriods::forTempo(bpm * static_cast<uint16_t>(TEMPO_SCALE));
+    }
+    TimerPeriods p;
+    memcpy_P(&p, &tempo_table.periods[bpm - SOFT_MIN_BPM], sizeof(p));
+    return p;
+}
+
+// same as periods_for_bpm(), for tempos in hundredths of a BPM
+static TimerPeriods periods_for_tempo(uint16_t tempo) {
+    if (tempo % TEMPO_SCALE == 0) {
+        return periods_for_bpm(static_cast<uint8_t>(tempo / TEMPO_SCALE));
+    }
+    return TimerPeriods::forTempo(tempo);
+}
 
 /*
  * Adds the given increment to the specified counter, ensuring that the count
@@ -11,7 +48,7 @@
  * Have to ensure that the counter does not overflow due to the increment
  * before applying the [low, high] limits, and that howMuch
  */
-static inline uint8_t change(uint8_t what, uint8_t howMuch, uint8_t low, uint8_t high) {
+uint8_t MetronomeBase::change(uint8_t what, uint8_t howMuch, uint8_t low, uint8_t high) {
     uint8_t range = high - low + 1_u8;
     uint8_t changed = what + howMuch;
     // put back into range
@@ -24,45 +61,257 @@ static inline uint8_t change(uint8_t what, uint8_t howMuch, uint8_t low, uint8_t
     return changed;
 }
 
-/* increases or decreases the stored value for bpm by 1, keeping it within range,
- * displays it on the 7 segment displays, and also adjusts the Timer1 compare register
- * to trigger the TIM1_COMPA interrupt at the corresponding frequency.
- */
-void Metronome::incrementBpm(uint8_t increment) {
-    auto newValue = change(bpm, increment, SOFT_MIN_BPM, SOFT_MAX_BPM);
-    setBpm(newValue);
+void MetronomeBase::set_bpm(uint8_t newValue) {
+    stopSong();
+    stopRamp();
+    if (newValue < HARD_MIN_BPM) {
+        newValue = HARD_MIN_BPM;
+    }
+    update_timer(newValue * static_cast<uint16_t>(TEMPO_SCALE), periods_for_bpm(newValue));
 }
 
-void Metronome::setBpm(uint8_t newValue) {
-    bpm = newValue;
-    update_timer();
-    onBpmChanged(newValue);
+void MetronomeBase::set_tempo(uint16_t newValue) {
+    stopSong();
+    stopRamp();
+    constexpr uint16_t min_tempo = HARD_MIN_BPM * TEMPO_SCALE;
+    if (newValue < min_tempo) {
+        newValue = min_tempo;
+    }
+    update_timer(newValue, periods_for_tempo(newValue));
 }
 
-void Metronome::setMeasureLength(uint8_t newValue) {
+void MetronomeBase::set_measure_length(uint8_t newValue) {
     beats_per_measure = newValue;
-    onBeatsChanged(newValue);
+    // the old grouping doesn't fit any more
+    grouping = 0;
+    update_beat_levels();
 }
 
-void Metronome::setBeatDivision(uint8_t newValue) {
-    beat_divisor = newValue;
-    // this corrects the subbeat timing for the current beat
-    tock_num_modulo_subbeat = tock_num_modulo_beat % tocks_per_subbeat[beat_divisor];
-    onTicksChanged(newValue);
+bool MetronomeBase::set_grouping(MeterGrouping newValue) {
+    uint8_t beats = 0;
+    MeterGrouping g = newValue;
+    while (g & GROUPING_MASK) {
+        beats += g & GROUPING_MASK;
+        g >>= GROUPING_BITS;
+    }
+    // (anything after the first 0 is a mistake)
+    if (g != 0 || (newValue != 0 && beats != beats_per_measure)) {
+        return false;
+    }
+    grouping = newValue;
+    update_beat_levels();
+    return true;
+}
 
+/*
+ * Builds the schedule with the new swing in the spare buffer, for the ISR to
+ * switch to at the start of the next beat, so that the ticks of the beat that
+ * is playing don't move about.
+ */
+bool MetronomeBase::setSwing(uint16_t newValue) {
+    if (newValue < SWING_STRAIGHT || newValue > MAX_SWING) {
+        return false;
+    }
+    swing = newValue;
+
+    auto sreg = SREG;
+    cli();
+    bool song_waiting = pending & PENDING_AT_BAR;
+    if (!song_waiting) {
+        // the spare buffer is about to be overwritten
+        pending &= byteInverse(PENDING_SCHEDULE);
+    }
+    SREG = sreg;
+    if (song_waiting) {
+        // the next section gets a new schedule when it starts anyway
+        return true;
+    }
+
+    Schedule& next = schedule == &schedules[0] ? schedules[1] : schedules[0];
+    build_schedule(next, layers);
+
+    sreg = SREG;
+    cli();
+    next_schedule = &next;
+    pending |= PENDING_SCHEDULE;
+    SREG = sreg;
+    return true;
+}
+
+// Accents the first beat of each group, and no others
+void MetronomeBase::update_beat_levels() {
+    LevelPattern levels = levelPattern(LEVEL_NORMAL);
+    MeterGrouping g = grouping;
+    uint8_t beat = 0;
+    for (;;) {
+        levels = withLevel(levels, beat, LEVEL_ACCENT);
+        uint8_t size = g & GROUPING_MASK;
+        g >>= GROUPING_BITS;
+        if (size == 0 || g == 0) {
+            break;
+        }
+        beat += size;
+    }
+    setBeatLevels(levels);
+}
+
+/*
+ * Goes through the groupings in order of the sizes of the groups, e.g.
+ * 2+2+3, 2+3+2, 3+2+2 for 7 beats. A single group is the same as none, so
+ * it's left out. Only used for the buttons, so it doesn't have to be quick.
+ */
+MeterGrouping MetronomeBase::next_grouping(MeterGrouping g, uint8_t beats) {
+    if (beats < 4) {
+        return 0;
+    }
+    uint8_t sizes[MAX_GROUPS];
+    uint8_t count = 0;
+    int8_t rest = static_cast<int8_t>(beats);
+    if (g != 0) {
+        for (; count < MAX_GROUPS && (g & GROUPING_MASK); ++count) {
+            sizes[count] = g & GROUPING_MASK;
+            g >>= GROUPING_BITS;
+        }
+        // make the last 2 that can be a 3, if what comes after it still can
+        // be made of 2s and 3s
+        for (;;) {
+            if (count == 0) {
+                // that was the last one
+                return 0;
+            }
+            uint8_t before = 0;
+            for (uint8_t i = 0; i + 1 < count; ++i) {
+                before += sizes[i];
+            }
+            rest = static_cast<int8_t>(beats - before - 3);
+            if (sizes[count - 1] == 2 && rest >= 0 && rest != 1) {
+                sizes[count - 1] = 3;
+                break;
+            }
+            count--;
+        }
+    }
+    // then fill up the rest with as many 2s as possible
+    while (rest > 0) {
+        sizes[count++] = rest == 3 ? 3 : 2;
+        rest = static_cast<int8_t>(rest - sizes[count - 1]);
+    }
+
+    MeterGrouping next = 0;
+    while (count > 0) {
+        next = next << GROUPING_BITS | sizes[--count];
+    }
+    return next;
 }
-void Metronome::incrementBeats(uint8_t increment) {
-    auto new_value = change(beats_per_measure, increment, MIN_BEATS_PER_MEASURE, MAX_BEATS_PER_MEASURE);
-    setMeasureLength(new_value);
+
+MeterGrouping MetronomeBase::previous_grouping(MeterGrouping g, uint8_t beats) {
+    MeterGrouping previous = 0;
+    for (MeterGrouping h = next_grouping(0, beats); h != g && h != 0; h = next_grouping(h, beats)) {
+        previous = h;
+    }
+    return previous;
 }
 
-void Metronome::incrementTicks(uint8_t increment) {
-    auto new_value = change(beat_divisor, increment, MIN_TICKS_PER_BEAT, MAX_TICKS_PER_BEAT);
-    setBeatDivision(new_value);
+bool MetronomeBase::set_beat_division(uint8_t newValue) {
+    return setLayer(0, newValue, layers[0].levels);
 }
 
+bool MetronomeBase::setLayer(uint8_t layer, uint8_t divisor, LevelPattern levels) {
+    if (layer >= MAX_LAYERS) {
+        return false;
+    }
+    if (!tocks_per_subbeat.canPlay(divisor) && !(divisor == 0 && layer != 0)) {
+        return false;
+    }
+    layers[layer].divisor = divisor;
+    layers[layer].levels = levels;
+    update_schedule();
+    return true;
+}
 
-void Metronome::timerSetup() {
+/*
+ * Merges the ticks of all the layers into the schedule which the ISR isn't
+ * using, then switches the ISR over to it. The event which Timer1 is already
+ * counting to still happens at the same time, but from then on, the ISR
+ * follows the new schedule (so the new layers take effect straight away).
+ */
+void MetronomeBase::update_schedule() {
+    auto sreg = SREG;
+    cli();
+    // the schedule that's waiting for the next bar is about to be overwritten
+    pending &= byteInverse(PENDING_SCHEDULE);
+    SREG = sreg;
+
+    Schedule& next = schedule == &schedules[0] ? schedules[1] : schedules[0];
+    build_schedule(next, layers);
+    uint8_t length = next.length;
+
+    sreg = SREG;
+    cli();
+    // find where the ISR is up to in the new schedule
+    uint16_t pending_tock = tock_num_modulo_beat;
+    uint8_t pos = 0;
+    uint8_t subbeat = 0;
+    while (pos < length && next.entries[pos].tock < pending_tock) {
+        if (next.entries[pos].layers & 1u) {
+            subbeat++;
+        }
+        pos++;
+    }
+    schedule = &next;
+    schedule_pos = pos;
+    // this corrects the subbeat numbering for the current beat
+    // (at tock 0 the ISR starts again from 0 anyway)
+    subbeat_num = subbeat;
+    SREG = sreg;
+}
+
+// Merges the ticks of all the given layers into the given schedule
+void MetronomeBase::build_schedule(Schedule& next, const Layer (&layers)[MAX_LAYERS]) const {
+    // which tick each layer is up to
+    uint8_t tick_num[MAX_LAYERS] {};
+    uint8_t length = 0;
+
+    // how many tocks late the second tick of each pair of the main layer is
+    uint16_t swing_tocks = 0;
+    uint8_t main_divisor = layers[0].divisor;
+    if ((main_divisor & 1u) == 0) {
+        uint32_t pair_tocks = 2u * tocks_per_subbeat[main_divisor];
+        swing_tocks = static_cast<uint16_t>((pair_tocks * (swing - SWING_STRAIGHT) + 50u * SWING_SCALE)
+                / (100u * SWING_SCALE));
+    }
+    auto tick_tock = [&](uint8_t l) -> uint16_t {
+        uint16_t tock = tick_num[l] * tocks_per_subbeat[layers[l].divisor];
+        return l == 0 && (tick_num[l] & 1u) ? tock + swing_tocks : tock;
+    };
+
+    for (;;) {
+        // find the next tock at which any layer ticks
+        uint16_t tock = TOCKS_PER_BEAT;
+        for (uint8_t l = 0; l < MAX_LAYERS; ++l) {
+            if (tick_num[l] < layers[l].divisor) {
+                uint16_t t = tick_tock(l);
+                tock = t < tock ? t : tock;
+            }
+        }
+        if (tock >= TOCKS_PER_BEAT) {
+            break;
+        }
+
+        Schedule::Entry entry {tock, 0, 0};
+        for (uint8_t l = 0; l < MAX_LAYERS; ++l) {
+            if (tick_num[l] < layers[l].divisor && tick_tock(l) == tock) {
+                entry.layers |= _BV(l);
+                entry.levels |= levelOf(layers[l].levels, tick_num[l]) << (l * LEVEL_BITS);
+                tick_num[l]++;
+            }
+        }
+        next.entries[length++] = entry;
+    }
+    next.length = length;
+}
+
+void MetronomeBase::timerSetup() {
 // call timer0_1_hold_reset() before this and timer_0_1_start() after
     auto sreg = SREG;
     cli();
@@ -80,28 +329,35 @@ void Metronome::timerSetup() {
     SREG = sreg;
 }
 
-void Metronome::setup() {
+void MetronomeBase::setup() {
     // don't use the set functions since they do callbacks
     timerSetup();
 
     beats_per_measure = 4;
-    beat_divisor = 1;
-    bpm = 105;
-    update_timer();
+    layers[0].divisor = 1;
+    update_schedule();
+    update_timer(105 * TEMPO_SCALE, periods_for_bpm(105));
 
 }
 
-void Metronome::reset() {
+void MetronomeBase::reset() {
     // trigger new measure on next beat
     beat_num = 0;
     subbeat_num = 0;
     tock_num_modulo_beat = 0;
-    tock_num_modulo_bpm = 0;
-    tock_num_modulo_subbeat = 0;
+    schedule_pos = 0;
+    next_clock_tock = clock_output ? 0 : TOCKS_PER_BEAT;
+    // start halfway, so that beats are rounded to the nearest count
+    beat_error = tempo / 2;
+    beat_elapsed = 0;
+    counts_to_event = 0;
     TCNT1 = 0;
+    // first beat happens one tock after starting
+    OCR1A = static_cast<uint16_t>((tock_period >> TOCK_PERIOD_FRACTION_BITS) - 1);
+    arm_sync();
 }
 
-void Metronome::start() {
+void MetronomeBase::start() {
     auto sreg = SREG;
     cli();
 
@@ -109,165 +365,564 @@ void Metronome::start() {
     // trigger initial tock
     //tock();
 
-    // enable 8x I/O clock prescaler for timer1
-    bitSet(TCCR1B, CS11);
+    // enable I/O clock prescaler for timer1
+    TCCR1B = byteOr(TCCR1B, TIMER1_CLOCK_SELECT);
     SREG = sreg;
 
     running = true;
 }
 
-void Metronome::stop() {
+void MetronomeBase::stop() {
     // disconnect prescaler
-    bitClear(TCCR1B, CS11);
+    TCCR1B &= byteInverse(TIMER1_CLOCK_SELECT);
     running = false;
+    if (sync_output) {
+        // (in case it's stopped part way through a pulse)
+        bitClear(TCCR1A, COM1A0);
+        TCCR1C = _BV(FOC1A);
+    }
+}
 
+void MetronomeBase::setClockOutput(bool on) {
+    auto sreg = SREG;
+    cli();
+    clock_output = on;
+    if (!on) {
+        next_clock_tock = TOCKS_PER_BEAT;
+    } else if (!running) {
+        next_clock_tock = 0;
+    }
+    SREG = sreg;
 }
 
-void Metronome::beat() {
-    onBeat(beat_num, beats_per_measure);
-    beat_num++;
-    // need >= check (not just ==) in case beats_per_measure = 0
-    if (beat_num >= beats_per_measure) {
-        beat_num = 0;
+void MetronomeBase::setSyncOutput(bool on) {
+    setClockOutput(on);
+    auto sreg = SREG;
+    cli();
+    // (low to start with)
+    bitClear(TCCR1A, COM1A0);
+    bitSet(TCCR1A, COM1A1);
+    TCCR1C = _BV(FOC1A);
+    sync_output = on;
+    if (on) {
+        arm_sync();
+    } else {
+        bitClear(TCCR1A, COM1A1);
     }
+    SREG = sreg;
 }
 
-void Metronome::subBeat() {
-    onSubBeat(subbeat_num, beat_divisor);
+bool MetronomeBase::cancel_click() {
+    auto sreg = SREG;
+    cli();
+    bool playing = click_left != 0;
+    end_click();
+    SREG = sreg;
+    return playing;
 }
 
+uint8_t MetronomeBase::getBpm() const {
+    return static_cast<uint8_t>(tempo / TEMPO_SCALE);
+}
 
-uint8_t Metronome::getBpm() const {
-    return bpm;
+uint16_t MetronomeBase::getTempo() const {
+    return tempo;
 }
 
-uint8_t Metronome::getMeasureLength() const {
+uint8_t MetronomeBase::getMeasureLength() const {
     return beats_per_measure;
 }
 
-uint8_t Metronome::getBeatSubdivisions() const {
-    return beat_divisor;
+// (the ISR reads beat_levels, and it's more than one byte)
+LevelPattern MetronomeBase::getBeatLevels() const {
+    auto sreg = SREG;
+    cli();
+    LevelPattern levels = beat_levels;
+    SREG = sreg;
+    return levels;
 }
 
-/*
- * OCR1A should normally be 1 less than the desired count period,
- * since it resets to 0.
- */
+void MetronomeBase::setBeatLevels(LevelPattern levels) {
+    auto sreg = SREG;
+    cli();
+    beat_levels = levels;
+    SREG = sreg;
+}
+
+void MetronomeBase::setBeatLevel(uint8_t beat, AccentLevel level) {
+    if (beat >= MAX_BEATS_PER_MEASURE) {
+        return;
+    }
+    setBeatLevels(withLevel(getBeatLevels(), beat, level));
+}
 
-/* Normally for a given tock_period, we set OCR1A to 1 less than tock_period_floor
- * to give the desired reset frequency. However, if tock_period remainder
- * is nonzero, it means we would be (ever so) slightly too fast if we
- * always reset the counter every tock_period counts.
- * We can correct for this error by setting the timer to go for 1 extra
- * count on the first 'tock_period_remainder' times in every 'bpm' tocks.
+uint8_t MetronomeBase::getBeatSubdivisions() const {
+    return layers[0].divisor;
+}
+
+/* sets the tempo, along with the timer periods (which must be calculated
+ * for it) so that timer 1 resets with frequency approximately equal to it.
+ * The change takes effect straight away, without jumping forwards or
+ * backwards within the beat (see rescale_wait()).
  */
+void MetronomeBase::update_timer(uint16_t new_tempo, const TimerPeriods& p) {
+    uint8_t old_SREG = SREG;
+    cli();
 
-uint16_t Metronome::calc_timer_count() {
-    if (tock_num_modulo_bpm < tock_period_remainder) {
-        // if there is a rounding down error in tock_period, we should
-        // initially count by 1 extra, then go back to tock_period_floor - 1.
-        return tock_period_floor; // - 1 + 1;
-    } else {
-        // Have 'overcounted' enough / tock_period had no remainder
-        return tock_period_floor - 1_u16;
+    uint16_t old_tempo = tempo;
+    tempo = new_tempo;
+    beat_period_floor = p.beat_period_floor;
+    beat_period_remainder = p.beat_period_remainder;
+    tock_period = p.tock_period;
+    // keep the accumulated error in range (starting halfway again, as reset() does)
+    if (beat_error >= tempo) {
+        beat_error = tempo / 2u;
     }
-}
+    /*
+     * The tock counts stay the same, so that the position in the measure/beat
+     * is maintained. The event that's already scheduled is now counted as
+     * happening at the time the same tock would happen at the new tempo.
+     */
+    beat_elapsed = calc_tock_time(tock_num_modulo_beat);
 
-void Metronome::timer_count_dynamic_adjust() {
-    // Check if we reached the switch-over threshold, otherwise it's the same
-    // TODO have instance variable to record which side of the threshold we were on
-    if (tock_num_modulo_bpm == 0 || tock_num_modulo_bpm == tock_period_remainder) {
-        auto new_ocr1A = calc_timer_count();
+    /*
+     * If Timer1 has just reached the scheduled event, the ISR is about to
+     * run, and it will use the new periods from there on anyway. If it has
+     * only reached the end of a chunk of a longer wait, the rest of the wait
+     * still needs rescaling.
+     */
+    if (running && old_tempo != 0 && (counts_to_event > 0 || !bitRead(TIFR1, OCF1A))) {
+        rescale_wait(old_tempo);
+    }
+    SREG = old_SREG;
+}
 
-        auto sreg = SREG;
-        cli();
-        OCR1A = new_ocr1A;
-        SREG = sreg;
+/*
+ * Returns how many Timer1 counts are left until the scheduled event, for
+ * restart_wait() to carry on from. If Timer1 has finished a chunk of the wait,
+ * and is counting the rest from 0, all the ISR would do is load the next chunk,
+ * which restart_wait() does instead, so the compare match is dealt with here,
+ * including counting the click's end on from it. (If it's the event itself
+ * that the timer has reached, that's 0 counts away.)
+ * Must be called with interrupts disabled.
+ */
+uint32_t MetronomeBase::wait_left() {
+    if (bitRead(TIFR1, OCF1A)) {
+        uint32_t remaining = counts_to_event;
+        uint16_t count = TCNT1;
+        TIFR1 = _BV(OCF1A);
+        time_click(0);
+        return remaining > count ? remaining - count : 0u;
     }
+    return counts_to_event + OCR1A + 1u - TCNT1;
+}
+
+/*
+ * Stretches or shrinks what's left of the wait for the scheduled event, to
+ * match the new tempo. Then the fraction of the beat that has already gone
+ * by stays the same as it was, so the new tempo carries on from exactly
+ * the same point of the beat, rather than the next event coming early or late.
+ * Must be called with interrupts disabled, and not while the compare match for
+ * the event itself is pending.
+ */
+void MetronomeBase::rescale_wait(uint16_t old_tempo) {
+    // Timer1 counts until the scheduled event, at the old tempo.
+    // This is at most a beat, so it can be multiplied by the tempo in 32 bits.
+    uint32_t remaining = wait_left();
+    // periods are inversely proportional to the tempo
+    uint32_t rescaled = (remaining * old_tempo + tempo/2u) / tempo;
+
+    restart_wait(rescaled);
 }
 
+/*
+ * Starts Timer1 counting again from now, to the scheduled event, which is
+ * the given number of counts away. Must be called with interrupts disabled.
+ */
+void MetronomeBase::restart_wait(uint32_t counts) {
+    // leave the ISR time to set up the following event (see MIN_EVENT_CYCLES)
+    constexpr uint32_t min_wait = (MIN_EVENT_CYCLES + TIMER1_PRESCALE - 1) / TIMER1_PRESCALE;
+    if (counts < min_wait) {
+        counts = min_wait;
+    }
 
-/* writes the appropriate value to OCR1A so that timer 1 resets with frequency
- * approximately equal to the given bpm.
+    // start counting again from here
+    uint16_t elapsed = TCNT1;
+    uint16_t top = last_top;
+    TCNT1 = 0;
+    counts_to_event = counts;
+    load_timer_chunk();
+    // (the period it was counting has been cut short, unless it had only just started)
+    last_top = elapsed != 0 ? elapsed - 1u : top;
+    arm_sync();
+    // the click still ends at the same time
+    if (click_left != 0) {
+        uint16_t left = click_left;
+        arm_click_end(left > elapsed ? left - elapsed : 0u);
+    }
+}
+
+/*
+ * Moves the metronome along its beat so that the current beat started the
+ * given number of Timer1 counts ago, e.g. at a tap or a sync pulse: the next
+ * event is the first one of the schedule after that. Anything which would
+ * have happened before then in this beat is skipped, including the start of
+ * the beat, if it hasn't happened yet. The beat number doesn't change.
  */
-void Metronome::update_timer() {
-    if (bpm < HARD_MIN_BPM) {
-        // BPM is too slow to keep a full count, so just maximise w/o overflow
-        tock_period_floor = TIMER1_HIGHEST_COUNT;
-        tock_period_remainder = 0;
+void MetronomeBase::align_beat(uint32_t since_beat) {
+    auto sreg = SREG;
+    cli();
+    if (!running) {
+        SREG = sreg;
+        return;
+    }
+    uint32_t period = beat_period_floor;
+    if (since_beat >= period) {
+        since_beat = period - 1u;
+    }
+
+    /*
+     * Work out how far into the beat playback has got: the scheduled event is
+     * beat_elapsed counts after the start of the beat (or it's the start of
+     * the next one), and Timer1 is part of the way through the wait for it.
+     * The beat is then moved whichever way is nearer, so that aligning just
+     * after a downbeat that hasn't been played yet skips ahead to it, rather
+     * than holding back nearly a whole beat.
+     */
+    uint32_t remaining = wait_left();
+    uint32_t event_time = tock_num_modulo_beat != 0 ? beat_elapsed : period;
+    uint32_t played = event_time > remaining ? event_time - remaining : 0u;
+    bool next_beat = since_beat + period / 2u < played;
+    uint32_t ahead;
+    if (next_beat) {
+        ahead = since_beat + period - played;
+    } else if (since_beat > played + period / 2u) {
+        // the beat that's playing started early, and will have to wait for the
+        // start of the one being aligned to
+        restart_wait(remaining + (played + period - since_beat));
+        SREG = sreg;
+        return;
+    } else if (since_beat < played) {
+        // (what has already played isn't played again)
+        restart_wait(remaining + (played - since_beat));
+        SREG = sreg;
+        return;
     } else {
-        tock_period_floor = static_cast<uint16_t>(TOCK_PERIOD_FOR_1_BPM / bpm);
-        tock_period_remainder = static_cast<uint8_t>(TOCK_PERIOD_FOR_1_BPM % bpm);
+        ahead = since_beat - played;
+    }
+    if (ahead <= remaining) {
+        // the scheduled event is still to come
+        restart_wait(remaining - ahead);
+        SREG = sreg;
+        return;
     }
 
     /*
-     * Reset count of tocks modulo bpm, since it's used for frequency
-     * correction and we have a new bpm. But we keep the other tock counts
-     * the same, so that the position in the measure/beat is maintained.
+     * Otherwise the events up to since_beat are skipped, from the one that's
+     * scheduled on. If that goes past the start of a beat, the beat still
+     * counts, and gets passed to the listeners by the main loop as usual, but
+     * its click would be late, so it isn't played.
      */
-    tock_num_modulo_bpm = 0;
-    uint16_t new_OCR1A = calc_timer_count();
+    if (next_beat) {
+        tock_num_modulo_beat = 0;
+        schedule_pos = 0;
+        next_clock_tock = clock_output ? 0 : TOCKS_PER_BEAT;
+        counts_to_event = 0;
+        BeatEvent e = advance();
+        if (e.flags & ~BeatEvent::CLOCK) {
+            events.push(e);
+        }
+    }
 
-    uint8_t old_SREG = SREG;
+    // (this may have just changed, at the start of the beat)
+    const Schedule& s = *schedule;
+    uint8_t pos = schedule_pos;
+    uint8_t ticks = subbeat_num;
+    while (pos < s.length && calc_tock_time(s.entries[pos].tock) <= since_beat) {
+        ticks += s.entries[pos].layers & 1u;
+        ++pos;
+    }
+#if SKIP_EMPTY_TOCKS
+    uint16_t next_tock = pos < s.length ? s.entries[pos].tock : TOCKS_PER_BEAT;
+    if (clock_output) {
+        // the clock pulses carry on from the same point of the beat
+        // (a beat period, shifted up by the fraction bits, fits in 32 bits)
+        uint16_t clock_tock = static_cast<uint16_t>((since_beat << TOCK_PERIOD_FRACTION_BITS) / tock_period)
+                / TOCKS_PER_MIDI_CLOCK * TOCKS_PER_MIDI_CLOCK;
+        if (clock_tock < next_clock_tock) {
+            clock_tock = next_clock_tock;
+        }
+        while (clock_tock < TOCKS_PER_BEAT && calc_tock_time(clock_tock) <= since_beat) {
+            clock_tock += TOCKS_PER_MIDI_CLOCK;
+        }
+        next_clock_tock = clock_tock;
+        if (clock_tock < next_tock) {
+            next_tock = clock_tock;
+        }
+    }
+#else
+    // (a beat period, shifted up by the fraction bits, fits in 32 bits)
+    uint16_t next_tock = static_cast<uint16_t>((since_beat << TOCK_PERIOD_FRACTION_BITS) / tock_period);
+    // (the scheduled tock hasn't been played, unless it was the start of the beat)
+    uint16_t first_tock = next_beat ? 1u : tock_num_modulo_beat;
+    if (next_tock < first_tock) {
+        next_tock = first_tock;
+    }
+    while (next_tock < TOCKS_PER_BEAT && calc_tock_time(next_tock) <= since_beat) {
+        ++next_tock;
+    }
+    if (clock_output) {
+        next_clock_tock = (next_tock + TOCKS_PER_MIDI_CLOCK - 1u) / TOCKS_PER_MIDI_CLOCK * TOCKS_PER_MIDI_CLOCK;
+    }
+#endif
+
+    beat_elapsed = since_beat;
+    uint32_t wait = calc_timer_count(next_tock);
+    if (next_tock >= TOCKS_PER_BEAT) {
+        next_tock = 0;
+        pos = 0;
+        next_clock_tock = clock_output ? 0 : TOCKS_PER_BEAT;
+    }
+    tock_num_modulo_beat = next_tock;
+    schedule_pos = pos;
+    subbeat_num = ticks;
+    restart_wait(wait);
+    SREG = sreg;
+}
+
+/*
+ * Gives the ISR the tempo to change to at the start of the next beat. The
+ * periods are worked out here in the main loop, so the ISR only has to copy them.
+ */
+void MetronomeBase::set_next_tempo(uint16_t new_tempo) {
+    auto p = periods_for_tempo(new_tempo);
+    auto sreg = SREG;
     cli();
+    next_tempo = new_tempo;
+    next_periods = p;
+    pending |= PENDING_TEMPO;
+    SREG = sreg;
+}
 
-    OCR1A = new_OCR1A;
-    /* make sure that we don't miss a match, e.g. in the following situation
-     ******|********************>                  |
-           ^                    ^                  ^
-        new max      current counter value          old_max
-     * NB if the current counter value is close enough to old_max, it might
-     * match by the time the comparison finishes, so do that comparison second
-     * NB2 I think this can also happen when increasing the BPM somehow, so we'll
-     * check every time;
-     */
-    if (new_OCR1A <= TCNT1) {
-        // trigger a match on next count
-        TCNT1 = new_OCR1A - 1_u16;
+void MetronomeBase::startRamp(uint16_t target_tempo, uint16_t beats) {
+    constexpr uint16_t min_tempo = HARD_MIN_BPM * TEMPO_SCALE;
+    if (target_tempo < min_tempo) {
+        target_tempo = min_tempo;
     }
-    SREG = old_SREG;
+    if (beats == 0) {
+        set_tempo(target_tempo);
+        return;
+    }
+    stopSong();
+    uint16_t from = tempo;
+    uint16_t change = target_tempo > from ? target_tempo - from : from - target_tempo;
+    ramp_mode = RAMP_LINEAR;
+    ramp_tempo = from;
+    ramp_target = target_tempo;
+    ramp_step = change / beats;
+    ramp_step_remainder = change % beats;
+    ramp_length = beats;
+    ramp_error = 0;
+    ramp_count = beats;
+    // the first step happens at the next beat
+    update_ramp(BeatEvent {BeatEvent::BEAT, 0, 0, 0, LEVEL_NORMAL, 0});
+}
+
+void MetronomeBase::startSteppedRamp(uint16_t target_tempo, uint16_t step, uint16_t measures) {
+    constexpr uint16_t min_tempo = HARD_MIN_BPM * TEMPO_SCALE;
+    if (target_tempo < min_tempo) {
+        target_tempo = min_tempo;
+    }
+    if (step == 0 || measures == 0) {
+        return;
+    }
+    stopSong();
+    ramp_mode = RAMP_STEPS;
+    ramp_tempo = tempo;
+    ramp_target = target_tempo;
+    ramp_step = step;
+    ramp_length = measures;
+    ramp_count = measures;
+}
+
+void MetronomeBase::stopRamp() {
+    if (ramp_mode == RAMP_OFF) {
+        return;
+    }
+    ramp_mode = RAMP_OFF;
+    // the ramp only ever changes the tempo
+    auto sreg = SREG;
+    cli();
+    pending &= byteInverse(PENDING_TEMPO);
+    SREG = sreg;
 }
 
+/*
+ * Called by the main loop for every beat. Works out the tempo for the next
+ * beat, if the ramp changes it then. Since the ISR switches to it at the start
+ * of the next beat, this has to happen within a beat, which is ~240ms at the
+ * most.
+ */
+bool MetronomeBase::update_ramp(const BeatEvent& e) {
+    if (ramp_mode == RAMP_OFF) {
+        return false;
+    }
+    // whether the beat which just started is playing at the ramp's tempo
+    bool in_force = ramp_tempo == tempo;
 
-void Metronome::tock() {
-    /* Metronome event checks */
-    // check if we've reached the next subBeat or beat
-    if (tock_num_modulo_beat == 0) {
-        beat();
-        subbeat_num = 0;
+    if (ramp_tempo == ramp_target) {
+        // that was the last step
+        ramp_mode = RAMP_OFF;
+        return in_force;
     }
-    if (tock_num_modulo_subbeat == 0) {
-        subBeat();
-        subbeat_num++;
-        if (subbeat_num >= beat_divisor) {
-            subbeat_num = 0;
+
+    uint16_t step;
+    if (ramp_mode == RAMP_LINEAR) {
+        step = ramp_step;
+        ramp_error += ramp_step_remainder;
+        if (ramp_error >= ramp_length) {
+            ramp_error -= ramp_length;
+            step++;
         }
+        ramp_count--;
+    } else {
+        // only step when the next beat starts a measure
+        bool last_in_measure = e.beat_num + 1u >= beats_per_measure;
+        if (!last_in_measure || --ramp_count != 0) {
+            return in_force;
+        }
+        ramp_count = ramp_length;
+        step = ramp_step;
+    }
+
+    // move towards the target, without overshooting
+    if (ramp_target > ramp_tempo) {
+        ramp_tempo = ramp_target - ramp_tempo > step ? ramp_tempo + step : ramp_target;
+    } else {
+        ramp_tempo = ramp_tempo - ramp_target > step ? ramp_tempo - step : ramp_target;
+    }
+    if (ramp_mode == RAMP_LINEAR && ramp_count == 0) {
+        // in case of rounding, make sure it finishes exactly on the target
+        ramp_tempo = ramp_target;
     }
+    set_next_tempo(ramp_tempo);
+    return in_force;
+}
 
-    tock_num_modulo_beat++;
-    tock_num_modulo_subbeat++;
+void MetronomeBase::playSong(const uint8_t* song_P) {
+    stopRamp();
+    stopSong();
+    song_sections_left = pgm_read_byte(song_P);
+    song_section = song_P + 1;
+    song_playing = true;
+    prepare_song_section();
+}
 
-    if (tock_num_modulo_subbeat >= tocks_per_subbeat[beat_divisor]) {
-        tock_num_modulo_subbeat = 0;
+void MetronomeBase::stopSong() {
+    if (!song_playing) {
+        return;
     }
-    if (tock_num_modulo_beat >= TOCKS_PER_BEAT) {
-        tock_num_modulo_beat = 0;
-        tock_num_modulo_subbeat = 0;
+    song_playing = false;
+    song_starting = false;
+    auto sreg = SREG;
+    cli();
+    bool waiting = pending & PENDING_AT_BAR;
+    if (waiting) {
+        pending = 0;
+    }
+    SREG = sreg;
+    if (waiting) {
+        // in case the swing was changed while the next section was waiting
+        update_schedule();
     }
+}
 
-    /* BPM correction calculations */
+/*
+ * Reads the next section of the song, works out everything that the ISR needs
+ * for it, and gives it to the ISR to switch to at the start of the next bar.
+ * This is done at the start of the last bar of the section before, so there's
+ * a whole bar to do it in.
+ */
+void MetronomeBase::prepare_song_section() {
+    if (song_sections_left == 0) {
+        // carry on as we are
+        song_playing = false;
+        return;
+    }
+    song_next = SongSection::read_P(song_section);
+    song_section += SONG_SECTION_SIZE;
+    song_sections_left--;
+
+    // keep the current settings for anything out of range
+    constexpr uint16_t min_tempo = HARD_MIN_BPM * TEMPO_SCALE;
+    if (song_next.tempo < min_tempo) {
+        song_next.tempo = tempo;
+    }
+    if (song_next.beats_per_measure > MAX_BEATS_PER_MEASURE) {
+        song_next.beats_per_measure = beats_per_measure;
+    }
+    if (!tocks_per_subbeat.canPlay(song_next.beat_divisor)) {
+        song_next.beat_divisor = layers[0].divisor;
+    }
+    if (song_next.bars == 0) {
+        song_next.bars = 1;
+    }
 
-    /* If there's a nonzero error/remainder when we calculated the timer count
-     * for a given BPM, then we may need to do dynamic adjustement of the
-     * count, in order to make it more accurate
-     */
-    if (tock_period_remainder > 0) {
-        timer_count_dynamic_adjust();
+    Layer next_layers[MAX_LAYERS];
+    for (uint8_t l = 0; l < MAX_LAYERS; ++l) {
+        next_layers[l] = layers[l];
     }
+    next_layers[0].divisor = song_next.beat_divisor;
+    // nothing else uses the spare schedule until the ISR switches to it
+    Schedule& next = schedule == &schedules[0] ? schedules[1] : schedules[0];
+    build_schedule(next, next_layers);
+    auto p = periods_for_tempo(song_next.tempo);
 
-    tock_num_modulo_bpm++;
+    auto sreg = SREG;
+    cli();
+    next_tempo = song_next.tempo;
+    next_periods = p;
+    next_beats_per_measure = song_next.beats_per_measure;
+    next_beat_levels = song_next.levels;
+    next_schedule = &next;
+    pending = PENDING_TEMPO | PENDING_METER | PENDING_SCHEDULE | PENDING_AT_BAR;
+    SREG = sreg;
 
-    if (tock_num_modulo_bpm >= bpm) {
-        tock_num_modulo_bpm = 0;
+    song_starting = true;
+}
+
+/*
+ * Called by the main loop for every beat. At the start of each bar, keeps
+ * track of which bar of the section is playing, and sets up the next section
+ * during the last one.
+ */
+bool MetronomeBase::update_song(const BeatEvent& e) {
+    // (every beat is the start of a bar when there are no measures)
+    if (!song_playing || e.beat_num != 0) {
+        return false;
+    }
+    bool started = false;
+    if (song_starting && !(pending & PENDING_AT_BAR)) {
+        // the ISR has switched to the next section, at this bar
+        song_starting = false;
+        layers[0].divisor = song_next.beat_divisor;
+        // the section has its own beat levels
+        grouping = 0;
+        // in case the layers were changed after the schedule was built
+        // (which drops it from the pending changes, see update_schedule())
+        update_schedule();
+        song_bars = song_next.bars;
+        song_bar = 0;
+        started = true;
+    }
+    if (song_starting) {
+        // still waiting for it
+        return false;
+    }
+    song_bar++;
+    if (song_bar >= song_bars) {
+        // this is the last bar of the section
+        prepare_song_section();
     }
+    return started;
 }
@@ -5,20 +5,38 @@
 #define METRONOME_H
 
 #include "byte_ops.h"
+#include "EventQueue.h"
+#include "TempoMap.h"
 #include <avr/io.h>
 
 
 // beep sound parameters
 #define BEEP_FREQ_MEASURE (554u)
 #define BEEP_FREQ_BEAT (440u)
+// first beat of each group of beats, other than the first (see MeterGrouping)
+#define BEEP_FREQ_GROUP (494u)
 #define BEEP_FREQ_SUB (293u)
+// ticks of the other layers, unaccented and accented
+#define BEEP_FREQ_LAYER1 (370u)
+#define BEEP_FREQ_LAYER1_ACCENT (740u)
+#define BEEP_FREQ_LAYER2 (330u)
+#define BEEP_FREQ_LAYER2_ACCENT (659u)
 //#define BEEP_FREQ_SUB (100u)
-#define BEEP_LENGTH_TOCKS 4
+// how long clicks last, in microseconds (see clickLength())
+#define BEEP_LENGTH_US 60000ul
+#define BEEP_LENGTH_GHOST_US 16000ul
 
 // parameters for button controls, all in ms
+// (the BPM starts off repeating slowly, and halves the time between repeats
+// every REPEAT_ACCELERATE_EVERY repeats, until it gets to the rate)
+#define BPM_INCREMENT_REPEAT_START 100
 #define BPM_INCREMENT_REPEAT_RATE 10
+#define REPEAT_ACCELERATE_EVERY 8
 #define TICKS_INCREMENT_REPEAT_RATE 100
 #define INCREMENT_REPEAT_DELAY 300
+#define LONG_PRESS_TIME 1000
+// how long the settings screens stay up without any buttons being pressed
+#define SCREEN_TIMEOUT 8000
 
 #define WITHOUT_DOT false
 #define WITH_DOT true
@@ -28,7 +46,7 @@
  * beat - an event that occurs with frequency (in Hz)
  *        approximately equal to the user-entered bpm divided by 60.
  *        This is the main 'event' of the metronome, and is always audible.
- * tock - a tock happens every 1/TOCKS_PER_BEAT (e.g. 1/60) of a beat duration.
+ * tock - a tock happens every 1/TOCKS_PER_BEAT (e.g. 1/5040) of a beat duration.
  *        This allows subdivisions of the beat based on multiples of tocks,
  *        which is easy to achieve with counters.
  *        Tocks themselves are not exposed to the user.
@@ -46,9 +64,9 @@
  * on every Timer1 match with OCR1A, fclk_io is the speed of the prescaler,
  * which in this case is equal to F_CPU, N is the prescale value set for timer 1,
  * and OCR1A is the value for timer1 at which it resets.
- * Here, we have N=8, fclk_io = 8000000, and f_tock = fOCR1A*2, since we tock on
+ * Here, we have fclk_io = 8000000, and f_tock = fOCR1A*2, since we tock on
  * every reset of the timer, whereas one period of a PWM wave lasts two resets.
- * Thus,
+ * Thus, with N = 8
  * f_beat = f_tock/60
  *        = fOCR1A/30
  *        = 8000000/(16*30*(1+OCR1A
@@ -56,32 +74,135 @@
  * For 1BPM, f_beat = 1/60 Hz, so 1 + OCR1A = 50000*60/3 = 1000000
  * thus to get an arbitrary integer BPM, we need to divide 1000000 by the BPM,
  * correct for any integer division error, and then subtract 1
+ * (In general, the count per tock at 1BPM is F_CPU/N.)
  */
 
-/* This value is determined by the value in TCCR1B,
- * and is set during timer_init()
+/* If this is nonzero, Timer1 does not interrupt on every tock, but instead
+ * is programmed to count straight to the next beat or subBeat, since the
+ * tocks in between have nothing to do. This cuts the Timer1 interrupt rate
+ * by a factor of up to TOCKS_PER_BEAT.
+ * Waits longer than Timer1 can count in one go are split into several
+ * 'chunks' of at most TIMER1_HIGHEST_COUNT + 1 counts (see load_timer_chunk()).
+ * The slower prescaler keeps the number of these chunks low; its resolution
+ * (8us at 8MHz) is still far below anything audible.
  */
+#define SKIP_EMPTY_TOCKS 1
 
+/* This value is determined by the value in TCCR1B,
+ * and is set during start()
+ */
+#if SKIP_EMPTY_TOCKS
+#define TIMER1_PRESCALE 64
+#define TIMER1_CLOCK_SELECT (_BV(CS11) | _BV(CS10))
+#else
 #define TIMER1_PRESCALE 8
+#define TIMER1_CLOCK_SELECT _BV(CS11)
+#endif
 
-// how many timer1 increments (tocks) are needed to count to 1BPM
-static constexpr uint32_t TOCK_PERIOD_FOR_1_BPM = F_CPU/TIMER1_PRESCALE;
+// how many timer1 increments happen in one second
+static constexpr uint32_t TIMER1_COUNTS_PER_SECOND = F_CPU/TIMER1_PRESCALE;
 static constexpr uint16_t TIMER1_HIGHEST_COUNT = 65535;
 
-#define TOCKS_PER_BEAT 60
+// Timer1 counts in the given number of microseconds, for click lengths
+constexpr uint16_t clickLength(uint32_t us) {
+    return static_cast<uint16_t>((static_cast<uint64_t>(us) * TIMER1_COUNTS_PER_SECOND + 500000u) / 1000000u);
+}
+
+/* How finely each beat is divided up. Every subdivision which is played
+ * (see tocks_per_subbeat) has to divide this exactly, so it should have lots
+ * of factors: 5040 (= 7!) allows 1 to 10, 12, 14, 15 and 16 ticks per beat,
+ * while e.g. 840 allows 1 to 8.
+ * Tock counts are 16 bit, so this can be at most 32767.
+ */
+#define TOCKS_PER_BEAT 5040
+
+// how many timer1 increments are needed to count one beat at 1BPM
+static constexpr uint32_t BEAT_PERIOD_FOR_1_BPM = TIMER1_COUNTS_PER_SECOND*60;
+
+/* Tempo is stored in hundredths of a BPM, so that tempos
+ * such as 117.5 BPM can be played exactly.
+ */
+#define TEMPO_SCALE 100
 
-#define HARD_MIN_BPM 16 // ceil(TIMER1_COUNT_FOR_1BPM/(TIMER1_HIGHEST_COUNT + 1))
 #define SOFT_MIN_BPM 30
 // will overflow in uint8_t otherwise
 #define SOFT_MAX_BPM 254
 
+// number of bits needed to write the given number in binary
+static constexpr uint8_t bitWidth(uint32_t x) {
+    return x == 0 ? 0 : 1 + bitWidth(x >> 1u);
+}
+
+/* Tock periods are kept in fixed point (see Metronome::tock_period),
+ * and a whole beat's worth of them must fit in 32 bits. So the fraction gets
+ * all the bits which aren't needed for the longest beat period that can be
+ * set using the buttons, at SOFT_MIN_BPM. The more of them there are, the
+ * less the rounding error in the tock period adds up over the TOCKS_PER_BEAT
+ * tocks in a beat: at most TOCKS_PER_BEAT/2^(TOCK_PERIOD_FRACTION_BITS + 1) counts.
+ */
+static constexpr uint8_t TOCK_PERIOD_FRACTION_BITS = 32 - bitWidth(BEAT_PERIOD_FOR_1_BPM / SOFT_MIN_BPM);
+static constexpr uint32_t MAX_BEAT_PERIOD = 1ul << (32u - TOCK_PERIOD_FRACTION_BITS);
+// ceil(BEAT_PERIOD_FOR_1_BPM/MAX_BEAT_PERIOD)
+static constexpr uint8_t HARD_MIN_BPM = (BEAT_PERIOD_FOR_1_BPM + MAX_BEAT_PERIOD - 1)/MAX_BEAT_PERIOD;
+
+static_assert(HARD_MIN_BPM <= SOFT_MIN_BPM, "SOFT_MIN_BPM is too slow");
+// see TimerPeriods::forTempo()
+static_assert(TOCK_PERIOD_FRACTION_BITS <= 17, "tempo remainder must fit in 32 bits in fixed point");
+static_assert(TOCKS_PER_BEAT <= 32767, "tock counts must fit in 16 bits");
+
+/*
+ * Timer periods for a given tempo; see the comments on the members
+ * of Metronome with the same names.
+ */
+struct TimerPeriods {
+    uint32_t beat_period_floor;
+    uint32_t tock_period;
+    uint16_t beat_period_remainder;
+
+    /*
+     * Works out the timer periods for the given tempo, in hundredths of a BPM.
+     * This needs several 32 bit divisions, which take hundreds of cycles each
+     * on the AVR, so the periods for whole BPMs are precomputed at compile time
+     * using this same function (see tempo_table in Metronome.cpp).
+     */
+    static constexpr TimerPeriods forTempo(uint16_t tempo) {
+        /* beat period = BEAT_PERIOD_FOR_1_BPM * TEMPO_SCALE / tempo
+         * This is done in two steps, since the numerator doesn't always fit in
+         * 32 bits, but the whole part of BEAT_PERIOD_FOR_1_BPM / tempo times
+         * TEMPO_SCALE does.
+         */
+        uint32_t whole = BEAT_PERIOD_FOR_1_BPM / tempo;
+        uint32_t part = (BEAT_PERIOD_FOR_1_BPM % tempo) * TEMPO_SCALE;
+        uint32_t floor = whole * TEMPO_SCALE + part / tempo;
+        auto remainder = static_cast<uint16_t>(part % tempo);
+        // convert to fixed point (rounded), including the fractional part
+        // of the beat period
+        constexpr uint8_t bits = TOCK_PERIOD_FRACTION_BITS;
+        uint32_t fixed = (floor << bits) + (static_cast<uint32_t>(remainder) << bits) / tempo;
+        uint32_t tock_period = (fixed + TOCKS_PER_BEAT/2) / TOCKS_PER_BEAT;
+        return {floor, tock_period, remainder};
+    }
+};
+
 #define MIN_BEATS_PER_MEASURE 0
 #define MAX_BEATS_PER_MEASURE 16
 #define MIN_TICKS_PER_BEAT 1
-#define MAX_TICKS_PER_BEAT 6
+#define MAX_TICKS_PER_BEAT 16
 
+/* Swing is how much of each pair of ticks of the main layer the first one
+ * takes, in thirtieths of a percent: 1500 is straight, 2000 is a triplet
+ * shuffle. The second tick of each pair is just moved later on the tock grid.
+ * In thirtieths, two thirds is a whole number, so a triplet shuffle lands
+ * exactly on the tock grid, as long as a pair of ticks is a multiple of 3
+ * tocks. With 5040 tocks per beat, it is for every even number of ticks.
+ */
+#define SWING_SCALE 30
+#define SWING_STRAIGHT (50 * SWING_SCALE)
+#define SWING_TRIPLET (200 * SWING_SCALE / 3)
+#define MAX_SWING (75 * SWING_SCALE)
 
 /* how many tocks happen before we play a subdivided beat 'tick'
+ * With TOCKS_PER_BEAT = 60 this would be
  * 1 tick  per beat -> 60 tocks per tick
  * 2 ticks per beat -> 30 tocks per tick
  * 3 ticks per beat -> 20 tocks per tick
@@ -96,138 +217,1064 @@ static constexpr uint16_t TIMER1_HIGHEST_COUNT = 65535;
  *              |**************|**************|**************|**************|
  * tocks>       0              15             30             45             60->0
  * ticks/beats> B              T              T              T              B
+ * The table is worked out at compile time for the actual TOCKS_PER_BEAT.
+ * Subdivisions which don't divide it exactly can't be played, and are 0.
  */
-// 1- indexed, first entry is filler
-static constexpr uint8_t tocks_per_subbeat[] {0, 60, 30, 20, 15, 12, 10};
+struct SubdivisionTable {
+    // 1- indexed, first entry is filler
+    uint16_t tocks[MAX_TICKS_PER_BEAT + 1];
 
-// int indicates which beat of the measure it is
+    constexpr SubdivisionTable() noexcept : tocks() {
+        for (uint8_t d = 1; d <= MAX_TICKS_PER_BEAT; ++d) {
+            tocks[d] = TOCKS_PER_BEAT % d == 0 ? TOCKS_PER_BEAT / d : 0;
+        }
+    }
 
-class Metronome {
-    typedef void (*oneParamCallback)(uint8_t);
-    typedef void (*twoParamCallback)(uint8_t, uint8_t);
+    constexpr uint16_t operator[](uint8_t ticks_per_beat) const {
+        return tocks[ticks_per_beat];
+    }
 
-private:
-    volatile bool running;
+    constexpr bool canPlay(uint8_t ticks_per_beat) const {
+        return ticks_per_beat >= MIN_TICKS_PER_BEAT && ticks_per_beat <= MAX_TICKS_PER_BEAT
+            && tocks[ticks_per_beat] != 0;
+    }
+};
+
+static constexpr SubdivisionTable tocks_per_subbeat = SubdivisionTable();
+
+static_assert(tocks_per_subbeat.canPlay(MIN_TICKS_PER_BEAT) && tocks_per_subbeat.canPlay(MAX_TICKS_PER_BEAT),
+        "TOCKS_PER_BEAT must be divisible by MIN_TICKS_PER_BEAT and MAX_TICKS_PER_BEAT");
+
+/* The Timer1 ISR sets OCR1A for the next event after the timer has already
+ * started counting towards it, so events can't be closer together than the
+ * time this takes. This is how many CPU cycles are allowed for it.
+ * (Ticks on different layers can be as little as a tock apart, and so can
+ * the next event just after the layers are changed.)
+ */
+#define MIN_EVENT_CYCLES 256
+/* Ticks happen within a timer count of where they should, so there have to
+ * be enough counts in a tick for that to be precise. This many counts per
+ * tick keeps the error within 1%.
+ */
+#define MIN_TICK_COUNTS 100
+
+// Timer1 counts per tock, and per tick at the finest subdivision, at SOFT_MAX_BPM
+static constexpr uint32_t MIN_TOCK_PERIOD = BEAT_PERIOD_FOR_1_BPM / SOFT_MAX_BPM / TOCKS_PER_BEAT;
+static constexpr uint32_t MIN_TICK_PERIOD = BEAT_PERIOD_FOR_1_BPM / SOFT_MAX_BPM / MAX_TICKS_PER_BEAT;
+
+static_assert(MIN_TOCK_PERIOD * TIMER1_PRESCALE >= MIN_EVENT_CYCLES,
+        "TOCKS_PER_BEAT is too large for Timer1 to keep up at SOFT_MAX_BPM");
+static_assert(MIN_TICK_PERIOD >= MIN_TICK_COUNTS,
+        "MAX_TICKS_PER_BEAT is too large for the Timer1 resolution at SOFT_MAX_BPM");
+
+/* MIDI clock runs at 24 pulses per quarter note, i.e. per beat. Each pulse is
+ * a whole number of tocks apart, so the clock is timed on the same grid as
+ * the beats and ticks (see setClockOutput()).
+ */
+#define MIDI_CLOCKS_PER_BEAT 24
+static constexpr uint16_t TOCKS_PER_MIDI_CLOCK = TOCKS_PER_BEAT / MIDI_CLOCKS_PER_BEAT;
+static_assert(TOCKS_PER_BEAT % MIDI_CLOCKS_PER_BEAT == 0, "TOCKS_PER_BEAT must be divisible by MIDI_CLOCKS_PER_BEAT");
+
+/* Several 'layers' of ticks can be played at once, e.g. 3 against 4.
+ * Each layer evenly subdivides the beat into its own number of ticks, with
+ * its own accents. Layer 0 is the main one, whose ticks are passed to the
+ * tick listener; the ticks of the other layers are only played.
+ */
+#define MAX_LAYERS 3
+static_assert(MAX_LAYERS <= 8, "layers are stored as bits of a byte");
+
+/* How loudly each beat or tick is played. A pattern of levels, one for each
+ * beat of the measure (or tick of the beat), is packed LEVEL_BITS to an entry
+ * in a LevelPattern, so the level of any one of them is just a shift and a
+ * mask (see levelOf()).
+ */
+enum AccentLevel : uint8_t {
+    LEVEL_MUTE = 0,
+    // played, but shorter
+    LEVEL_GHOST = 1,
+    LEVEL_NORMAL = 2,
+    LEVEL_ACCENT = 3
+};
+#define LEVEL_BITS 2
+#define LEVEL_MASK 3u
+typedef uint32_t LevelPattern;
+static_assert(MAX_BEATS_PER_MEASURE * LEVEL_BITS <= 32 && MAX_TICKS_PER_BEAT * LEVEL_BITS <= 32,
+        "a LevelPattern doesn't have room for every beat or tick");
+static_assert(MAX_LAYERS * LEVEL_BITS <= 8, "the tick levels of all layers are stored in a byte");
+
+// every beat or tick at the same level
+constexpr LevelPattern levelPattern(AccentLevel level) {
+    return 0x55555555u * level;
+}
+
+// the given pattern with beat or tick n set to the given level
+constexpr LevelPattern withLevel(LevelPattern p, uint8_t n, AccentLevel level) {
+    return (p & ~(static_cast<LevelPattern>(LEVEL_MASK) << (n * LEVEL_BITS)))
+            | (static_cast<LevelPattern>(level) << (n * LEVEL_BITS));
+}
+
+inline AccentLevel levelOf(LevelPattern p, uint8_t n) {
+    return static_cast<AccentLevel>((p >> (n * LEVEL_BITS)) & LEVEL_MASK);
+}
 
-    twoParamCallback onBeat;
-    twoParamCallback onSubBeat;
-    oneParamCallback onBpmChanged;
-    oneParamCallback onBeatsChanged;
-    oneParamCallback onTicksChanged;
+// accent the first beat of the measure only
+#define DEFAULT_BEAT_LEVELS withLevel(levelPattern(LEVEL_NORMAL), 0, LEVEL_ACCENT)
 
-    /* How fast a 'crotchet' is in beats per minute */
-    volatile uint8_t bpm;
+/* Divides each measure into groups of beats, e.g. 7 beats as 2+2+3, the first
+ * beat of each of which is accented. The number of beats in each group is
+ * packed GROUPING_BITS to an entry, first group lowest, up to the first 0.
+ * 0 on its own means one group of the whole measure.
+ */
+typedef uint32_t MeterGrouping;
+#define GROUPING_BITS 4
+#define GROUPING_MASK 15u
+#define MAX_GROUPS (32 / GROUPING_BITS)
+static_assert(MAX_GROUPS * 2 >= MAX_BEATS_PER_MEASURE, "not enough groups for a measure of 2s");
+
+constexpr MeterGrouping meterGrouping() {
+    return 0;
+}
+
+// e.g. meterGrouping(2, 2, 3)
+template <typename... Sizes>
+constexpr MeterGrouping meterGrouping(uint8_t first, Sizes... rest) {
+    return first | meterGrouping(rest...) << GROUPING_BITS;
+}
+
+struct Layer {
+    // ticks per beat, or 0 if the layer is off (layer 0 is always on)
+    uint8_t divisor;
+    // the level of each tick of the beat (for layer 0, the level of
+    // tick 0 is the beat's level instead; see MetronomeBase::beat_levels)
+    LevelPattern levels;
+};
+
+/* Everything that happens during a beat, on any layer, as a list of the
+ * tocks at which something happens, in order. This is worked out by the main
+ * loop whenever the layers change, so all the ISR has to do for each event is
+ * read off the next entry, no matter how many layers there are.
+ */
+struct Schedule {
+    struct Entry {
+        uint16_t tock;
+        // bit n is set if layer n ticks at this tock
+        uint8_t layers;
+        // the level of each layer's tick, LEVEL_BITS per layer
+        uint8_t levels;
+    };
+
+    uint8_t length;
+    // all layers tick at tock 0, so at most this many entries are needed
+    Entry entries[1 + MAX_LAYERS*(MAX_TICKS_PER_BEAT - 1)];
+};
+
+/*
+ * Describes what happened on a Timer1 event. Returned from tock() so that the
+ * ISR can start the click straight away, and queued for the main loop, which
+ * passes it on to the beat and tick listeners (see dispatchEvents()).
+ */
+struct BeatEvent {
+    enum : uint8_t {
+        NONE = 0,
+        BEAT = 1,
+        SUBBEAT = 2,
+        // first beat of the measure, when there are measures
+        MEASURE = 4,
+        // a MIDI clock pulse (these aren't passed on to the main loop)
+        CLOCK = 8
+    };
+
+    uint8_t flags;
+    // which beat of the measure it is
+    uint8_t beat_num;
+    // which subdivision of the beat it is
+    uint8_t subbeat_num;
+    // bit n is set if layer n ticks (bit 0 is the same as SUBBEAT)
+    uint8_t layers;
+    // the level of the beat, for BEAT events
+    AccentLevel beat_level;
+    // the level of each layer's tick, LEVEL_BITS per layer
+    uint8_t levels;
+
+    AccentLevel tickLevel(uint8_t layer) const {
+        return static_cast<AccentLevel>((levels >> (layer * LEVEL_BITS)) & LEVEL_MASK);
+    }
+};
+
+/*
+ * The parts of the metronome which don't need to call any listeners: all the
+ * state, and the timing logic. See BasicMetronome below for the public class.
+ * The functions used by the Timer1 ISR are defined inline at the bottom of
+ * this file, so that they can be inlined into it.
+ */
+class MetronomeBase {
+protected:
+    volatile bool running;
+
+    /* How fast a 'crotchet' is in beats per minute, times TEMPO_SCALE */
+    volatile uint16_t tempo;
     /* A measure is like a bar, and the first beat of each measure is accented.
      * Has no other effect other than 'accent the nth crotchet'
      * If this is set to zero then no accents are played.
      */
     volatile uint8_t beats_per_measure;
-    /* Each beat is evenly subdivided into 'ticks'
+    /* The level of each beat of the measure (see AccentLevel).
+     * Normally just the first one is accented.
+     */
+    volatile LevelPattern beat_levels;
+    /* How the beats of the measure are grouped. Only used by the main loop,
+     * to work out beat_levels whenever it or the measure length changes.
+     */
+    MeterGrouping grouping;
+    /* Each beat is evenly subdivided into 'ticks', on each layer.
      * Used to play quavers, semiquavers, triplets etc.
-     * Patten of accents can be programmed using the DIP switches.
+     * layers[0].divisor is the number of ticks per beat for the main layer.
+     * Only used by the main loop; the ISR follows the schedule made from them.
      */
-    volatile uint8_t beat_divisor;
+    Layer layers[MAX_LAYERS];
+    /* See SWING_SCALE. Also only used by the main loop. */
+    uint16_t swing;
 
     /* where we are in the measure */
     volatile uint8_t beat_num;
     /* Which subdivision we are on.*/
     volatile uint8_t subbeat_num;
 
-    // Counts once from 0 to TOCKS_PER_BEAT - 1 every beat
-    volatile uint8_t tock_num_modulo_beat;
-    // Counts from 0 to tocks_per_subbeat[beat_divisor] - 1 several times per beat
-    // (The number of times this happens is precisely beat_divisor)
-    volatile uint8_t tock_num_modulo_subbeat;
+    // Counts once from 0 to TOCKS_PER_BEAT - 1 every beat.
+    // This is the tock of the event that Timer1 is currently counting to.
+    volatile uint16_t tock_num_modulo_beat;
+
+    /* The ISR follows one of these schedules while the main loop is free to
+     * rewrite the other one, and then switch the ISR over to it.
+     * schedule_pos is the index of the entry for the next event.
+     */
+    Schedule schedules[2];
+    Schedule* volatile schedule;
+    volatile uint8_t schedule_pos;
+    /* The tock of the next MIDI clock pulse, which is counted to as well as
+     * the schedule's, or TOCKS_PER_BEAT if there's no more this beat or the
+     * clock is off.
+     */
+    volatile uint16_t next_clock_tock;
+    volatile bool clock_output;
+    // whether OC1A pulses at the start of each beat (see setSyncOutput())
+    volatile bool sync_output;
 
     /* These variables are used to control BPM (actually, tock) duration
-     * via timer 1 resets. In order to remove error from integer division,
-     * the timer1 reset count is adaptively adjusted, so that the reset
-     * can average out to be a rational number.
-     * For example, a count period of 100.5 can be achieved by counting to 100
-     * half the time and 101 the other half of the time. In order to do this,
-     * we need the following variables:
-     * tock_period_floor
-     *      The period corresponding to the desired BPM.
-     *      A tock period of 1 denotes the time taken per increment of timer1
-     * tock_period_remainder
-     *      Stores the remainder of TOCK_PERIOD_FOR_1BPM / bpm
-     * tock_num_modulo_bpm
-     *      Counts from 0 to bpm - 1 and then is reset to 0. No relation to beats or ticks.
-     *      The correct way to achieve rational tock periods using integer
-     *      timer counts is to have a period of:
-     *      tock_period_floor for (tock_period_remainder/bpm) of the time, and
-     *      tock_period_floor+1 for (1 - tock_period_remainder/bpm) of the time
-     *      The easiest way to achieve this is to set the actual timer count
-     *      to tock_period_floor+1 initially, and then reduce it by 1 when
-     *      tock_num_modulo_bpm reaches tock_period_remainder.
-     */
-    volatile uint16_t tock_period_floor;
-    volatile uint8_t tock_period_remainder; // less than BPM
-    volatile uint8_t tock_num_modulo_bpm; // also less than BPM
+     * via timer 1 resets. The time at which each tock happens is worked out
+     * using a phase accumulator relative to the start of the beat, while the
+     * start of each beat is worked out exactly using integer arithmetic, so
+     * that timing errors never accumulate from one beat to the next.
+     * beat_period_floor, beat_period_remainder
+     *      The quotient and remainder of the beat period in timer counts,
+     *      i.e. BEAT_PERIOD_FOR_1_BPM * TEMPO_SCALE / tempo.
+     *      A period of 1 denotes the time taken per increment of timer1.
+     * beat_error
+     *      Accumulates the remainders (which are in units of 1/tempo timer
+     *      counts) of all beats counted so far. Whenever it reaches tempo,
+     *      a whole count of error has built up, so the next beat is given
+     *      one extra count. Thus beats average out to exactly the rational
+     *      period above, and the start of every beat is within half a count
+     *      of where it should be, no matter how long the metronome runs.
+     *      (This is the same as counting to 100 half the time and to 101 the
+     *      other half, to achieve an average of 100.5)
+     * tock_period
+     *      The beat period / TOCKS_PER_BEAT, rounded to fixed point with
+     *      TOCK_PERIOD_FRACTION_BITS fractional bits. Tock n of a beat happens
+     *      (n * tock_period) >> TOCK_PERIOD_FRACTION_BITS counts (rounded)
+     *      after the start of the beat, so every tock is within a timer count
+     *      of where it should be.
+     * beat_elapsed
+     *      How many counts after the start of the beat the next event is
+     *      scheduled for.
+     */
+    volatile uint32_t beat_period_floor;
+    volatile uint16_t beat_period_remainder; // less than tempo
+    volatile uint16_t beat_error; // also less than tempo
+    volatile uint32_t tock_period;
+    volatile uint32_t beat_elapsed;
 
-public:
-    Metronome() noexcept:
+    // Timer counts still to go before the next event, after the current
+    // Timer1 period ends. Nonzero when the wait is too long for one Timer1 period.
+    volatile uint32_t counts_to_event;
+    /* While a click is playing, how many counts after the last compare match A
+     * it ends, and what OCR1A was then. Zero when there's no click.
+     * OCR1B is set to go off at the end, once it's before the next match A.
+     */
+    volatile uint16_t click_left;
+    uint16_t click_top;
+    /* What OCR1A was for Timer1's last period, before it started counting from
+     * 0 again: the top it reached, or one less than the count it was at when
+     * restart_wait() cut the period short (see lastPeriod()).
+     */
+    volatile uint16_t last_top;
+
+    // beat events waiting to be passed to the listeners by the main loop
+    EventQueue<BeatEvent, 8> events;
+
+    /* Changes for the ISR to make at the start of the next beat, or of the
+     * next measure if PENDING_AT_BAR is set. The main loop works these out
+     * ahead of time, and then sets the bits of pending for the ones to make,
+     * so that the ISR only has to copy them (see apply_pending()).
+     */
+    enum : uint8_t {
+        // next_tempo and next_periods
+        PENDING_TEMPO = 1,
+        // next_beats_per_measure and next_beat_levels
+        PENDING_METER = 2,
+        // next_schedule
+        PENDING_SCHEDULE = 4,
+        PENDING_AT_BAR = 8
+    };
+    volatile uint8_t pending;
+    uint16_t next_tempo;
+    TimerPeriods next_periods;
+    uint8_t next_beats_per_measure;
+    LevelPattern next_beat_levels;
+    Schedule* next_schedule;
+
+    /* Tempo ramp (see startRamp() and startSteppedRamp())
+     * ramp_mode
+     *      What sort of ramp is playing, if any.
+     * ramp_tempo
+     *      The tempo of the last step worked out. This is a beat ahead of
+     *      tempo, except when the ramp has just started.
+     * ramp_target
+     *      The tempo at the end of the ramp.
+     * ramp_step, ramp_step_remainder, ramp_length, ramp_error
+     *      For a linear ramp, the tempo changes by the total change divided
+     *      by the number of beats (ramp_length) every beat. Like the beat
+     *      period, the quotient (ramp_step) is added every time, and the
+     *      remainder is accumulated in ramp_error, to add an extra hundredth
+     *      of a BPM whenever a whole one has built up. So the ramp reaches
+     *      ramp_target on exactly the last beat, without any divisions on the way.
+     *      For a stepped ramp, ramp_step is the change every ramp_length measures.
+     * ramp_count
+     *      Beats (for a linear ramp) or measures (stepped) left until the
+     *      end of the ramp or the next step, respectively.
+     */
+    uint8_t ramp_mode;
+    uint16_t ramp_tempo;
+    uint16_t ramp_target;
+    uint16_t ramp_step;
+    uint16_t ramp_step_remainder;
+    uint16_t ramp_length;
+    uint16_t ramp_error;
+    uint16_t ramp_count;
+
+    /* Song mode (see playSong())
+     * song_section, song_sections_left
+     *      Where the next section to be played is in flash, and how many
+     *      sections there are from there to the end of the song.
+     * song_next
+     *      The section which was last set up to start at the next bar.
+     * song_bars, song_bar
+     *      How many bars the current section lasts for, and which one is playing.
+     * song_starting
+     *      Set when song_next has been given to the ISR, until it starts.
+     */
+    bool song_playing;
+    bool song_starting;
+    const uint8_t* song_section;
+    uint8_t song_sections_left;
+    uint8_t song_bars;
+    uint8_t song_bar;
+    SongSection song_next;
+
+    MetronomeBase() noexcept:
           running(false)
-        , onBeat(dummyCallback2)
-        , onSubBeat(dummyCallback2)
-        , onBpmChanged(dummyCallback1)
-        , onBeatsChanged(dummyCallback1)
-        , onTicksChanged(dummyCallback1)
-        , bpm(0)
+        , tempo(0)
         , beats_per_measure(0)
-        , beat_divisor(1)
+        , beat_levels(DEFAULT_BEAT_LEVELS)
+        , grouping(0)
+        , layers{{1, levelPattern(LEVEL_NORMAL)}}
+        , swing(SWING_STRAIGHT)
         , beat_num(0)
         , subbeat_num(0)
         , tock_num_modulo_beat(0)
-        , tock_num_modulo_subbeat(0)
-        , tock_period_floor(0)
-        , tock_period_remainder(0)
-        , tock_num_modulo_bpm(0)
-        { reset(); }
+        , schedules()
+        , schedule(&schedules[0])
+        , schedule_pos(0)
+        , next_clock_tock(TOCKS_PER_BEAT)
+        , clock_output(false)
+        , sync_output(false)
+        , beat_period_floor(0)
+        , beat_period_remainder(0)
+        , beat_error(0)
+        , tock_period(0)
+        , beat_elapsed(0)
+        , counts_to_event(0)
+        , click_left(0)
+        , click_top(0)
+        , last_top(0)
+        , pending(0)
+        , next_tempo(0)
+        , next_periods()
+        , next_beats_per_measure(0)
+        , next_beat_levels(0)
+        , next_schedule(nullptr)
+        , ramp_mode(RAMP_OFF)
+        , ramp_tempo(0)
+        , ramp_target(0)
+        , ramp_step(0)
+        , ramp_step_remainder(0)
+        , ramp_length(0)
+        , ramp_error(0)
+        , ramp_count(0)
+        , song_playing(false)
+        , song_starting(false)
+        , song_section(nullptr)
+        , song_sections_left(0)
+        , song_bars(0)
+        , song_bar(0)
+        , song_next()
+        { update_schedule(); reset(); }
 
-    void setBpm(uint8_t);
-    void setMeasureLength(uint8_t);
-    void setBeatDivision(uint8_t);
+public:
+    enum RampMode : uint8_t {
+        RAMP_OFF,
+        // tempo changes a little every beat
+        RAMP_LINEAR,
+        // tempo changes by a set amount every few measures
+        RAMP_STEPS
+    };
 
     void setup();
     void start();
     void stop();
     void reset();
     void toggle() { running ? stop() : start(); }
+    bool isRunning() const { return running; }
+    /* How many counts long Timer1's last period was, for timing something
+     * that happened before it started counting from 0 again (see SyncIn).
+     * Only for ISRs, or with interrupts disabled.
+     */
+    uint32_t lastPeriod() const {
+        // (until the compare match ISR runs, OCR1A is still that period's top)
+        return (bitRead(TIFR1, OCF1A) ? OCR1A : last_top) + 1ul;
+    }
 
-    void incrementBpm(uint8_t);
-    void incrementBeats(uint8_t);
-    void incrementTicks(uint8_t);
-
-    // parameters: current beat, total beats
-    void setBeatEventListener(const twoParamCallback& f) { onBeat = f; }
-    void setTickEventListener(const twoParamCallback& f) { onSubBeat = f; }
-    void setBpmChangeCallback(const oneParamCallback& f) { onBpmChanged = f; }
-    void setBeatsChangeCallback(const oneParamCallback& f) { onBeatsChanged = f; }
-    void setTicksChangeCallback(const oneParamCallback& f) { onTicksChanged = f; }
+    /* Turns the MIDI clock pulses on or off (see the listener's onClock()).
+     * Turning them on takes effect from the next beat, or straight away when
+     * stopped.
+     */
+    void setClockOutput(bool on);
+    /* Turns the sync pulses on or off. Timer1's compare output, OC1A, goes
+     * high at the compare match which starts each beat, so the pulse is set
+     * by the hardware, to the count, and goes low at the next compare match.
+     * The MIDI clock tocks make sure that's at most 1/24 of a beat later (or
+     * a tock, without SKIP_EMPTY_TOCKS), so this turns the clock on (or off)
+     * too. OC1A has to be made an output separately.
+     */
+    void setSyncOutput(bool on);
 
+    // whole part of the tempo
     uint8_t getBpm() const;
+    // tempo in hundredths of a BPM
+    uint16_t getTempo() const;
     uint8_t getMeasureLength() const;
+    LevelPattern getBeatLevels() const;
+    // sets the level of every beat of the measure at once
+    void setBeatLevels(LevelPattern levels);
+    void setBeatLevel(uint8_t beat, AccentLevel level);
+    MeterGrouping getGrouping() const { return grouping; }
+    uint16_t getSwing() const { return swing; }
+    /* Sets the swing (see SWING_SCALE) from the start of the next beat.
+     * Only has any effect with an even number of ticks per beat.
+     * Returns false (and does nothing) if it's out of range.
+     */
+    bool setSwing(uint16_t swing);
     uint8_t getBeatSubdivisions() const;
+    const Layer& getLayer(uint8_t layer) const { return layers[layer]; }
+
+    /* Sets the number of ticks per beat (0 for off, except for layer 0)
+     * and the level of each tick for one layer. Returns false, and does nothing, if the
+     * layer doesn't exist or the subdivision can't be played.
+     * Changing layer 0's divisor this way doesn't call the ticks listener.
+     */
+    bool setLayer(uint8_t layer, uint8_t divisor, LevelPattern levels);
     //uint8_t getCurrentBeat();
 
-    // needs to be put in ISR
-    void tock();
+    /* Changes the tempo (in hundredths of a BPM) evenly from the current
+     * tempo to the target over the given number of beats, e.g. 8 bars of 4/4
+     * is 32 beats. Setting the tempo or BPM directly stops the ramp.
+     */
+    void startRamp(uint16_t target_tempo, uint16_t beats);
+    /* Changes the tempo by step (in hundredths of a BPM, up or down towards
+     * the target) every given number of measures, until it reaches the target.
+     */
+    void startSteppedRamp(uint16_t target_tempo, uint16_t step, uint16_t measures);
+    void stopRamp();
+    RampMode getRampMode() const { return static_cast<RampMode>(ramp_mode); }
 
-private:
+    /* Plays the sections of the given song (see TempoMap.h) one after the
+     * other, starting from the next measure. Each section changes the tempo,
+     * meter, subdivision and beat levels exactly at the start of its first bar.
+     * After the last section, the metronome carries on with its settings.
+     * Setting the tempo or BPM directly, or starting a ramp, stops the song.
+     */
+    void playSong(const uint8_t* song_P);
+    void stopSong();
+    bool isPlayingSong() const { return song_playing; }
+
+protected:
+    // These set the corresponding values without calling any listeners
+    void set_bpm(uint8_t);
+    void set_tempo(uint16_t);
+    // (also goes back to one group per measure)
+    void set_measure_length(uint8_t);
+    /* Sets the grouping and accents the first beat of each group, replacing
+     * the beat levels. Returns false (and does nothing) if the groups don't
+     * add up to the measure length.
+     */
+    bool set_grouping(MeterGrouping);
+    /* The groupings of the given number of beats into 2s and 3s, in order,
+     * starting and ending with 0 (see incrementGrouping())
+     */
+    static MeterGrouping next_grouping(MeterGrouping, uint8_t beats);
+    static MeterGrouping previous_grouping(MeterGrouping, uint8_t beats);
+    // returns false (and does nothing) if the subdivision can't be played
+    bool set_beat_division(uint8_t);
+
+    static uint8_t change(uint8_t what, uint8_t howMuch, uint8_t low, uint8_t high);
 
-    void subBeat();
-    void beat();
-    void update_timer();
+    /* Moves the tempo ramp along after the given beat event. Returns true if
+     * the tempo now playing is the ramp's, i.e. the listener should be told.
+     */
+    bool update_ramp(const BeatEvent&);
+    /* Moves the song along after the given beat event. Returns true if a new
+     * section has just started, i.e. the listeners should be told.
+     */
+    bool update_song(const BeatEvent&);
+
+    /* The work of a Timer1 compare match is split in two, so that the click
+     * can be started in between (see tock()). advance() works out what
+     * happens at this compare match, with layers == 0 if nothing does, and
+     * schedule_next() then sets up the timer for the next one.
+     */
+    BeatEvent advance();
+    void schedule_next();
+    // sets OCR1B for the end of the click, if there is one, after a compare match A
+    void time_click(uint16_t length);
+    // (the rest of the compare match B ISR)
+    void end_click();
+    // returns true if a click was playing
+    bool cancel_click();
+    void align_beat(uint32_t since_beat);
+
+private:
+    void subBeat(BeatEvent&);
+    void beat(BeatEvent&);
+    void update_timer(uint16_t, const TimerPeriods&);
+    uint32_t wait_left();
+    void rescale_wait(uint16_t old_tempo);
+    void restart_wait(uint32_t counts);
+    void set_next_tempo(uint16_t);
+    void apply_pending();
+    void prepare_song_section();
+    void update_schedule();
+    void update_beat_levels();
+    void build_schedule(Schedule&, const Layer (&)[MAX_LAYERS]) const;
     static void timerSetup();
 
-    void timer_count_dynamic_adjust();
-    uint16_t calc_timer_count();
+    uint32_t calc_tock_time(uint16_t tock) const;
+    uint32_t calc_timer_count(uint16_t next_tock);
+    void load_timer_chunk();
+    void arm_click_end(uint16_t left);
+    void arm_sync();
+};
+
+/*
+ * Listener with nothing to do for any event. Listeners which only care about
+ * some events can derive from this and hide the functions they need.
+ */
+struct NullListener {
+    /* Called from the Timer1 ISR, as soon as possible after a beat or tick.
+     * Returns how long the click lasts for in Timer1 counts (see clickLength()),
+     * or 0 if there isn't one; onClickEnd() is called from the Timer1 compare
+     * match B ISR when it's over.
+     */
+    static uint16_t onClick(BeatEvent) { return 0; }
+    static void onClickEnd() { }
+    /* Called from the Timer1 ISR, straight after onClick(), on each MIDI clock
+     * pulse, while they're turned on.
+     */
+    static void onClock() { }
+    // called by start() just before the first beat, and by stop()
+    static void onStart() { }
+    static void onStop() { }
+    // parameters: current beat, total beats
+    // These two are called from dispatchEvents(), not the ISR
+    static void onBeat(uint8_t, uint8_t) { }
+    static void onSubBeat(uint8_t, uint8_t) { }
+    // called with the new value when the settings are changed
+    static void onBpmChanged(uint8_t) { }
+    static void onBeatsChanged(uint8_t) { }
+    static void onTicksChanged(uint8_t) { }
+    static void onGroupingChanged(MeterGrouping) { }
+};
+
+/*
+ * Listener which calls function pointers that are set at run time, for when
+ * the listeners aren't known at compile time (e.g. the host benchmarks).
+ */
+class CallbackListener {
+public:
+    typedef uint16_t (*eventCallback)(BeatEvent);
+    typedef void (*noParamCallback)();
+    typedef void (*oneParamCallback)(uint8_t);
+    typedef void (*twoParamCallback)(uint8_t, uint8_t);
+    typedef void (*groupingParamCallback)(MeterGrouping);
+
+    CallbackListener() noexcept:
+          clickCallback(NullListener::onClick)
+        , clickEndCallback(NullListener::onClickEnd)
+        , clockCallback(NullListener::onClock)
+        , startCallback(NullListener::onStart)
+        , stopCallback(NullListener::onStop)
+        , beatCallback(NullListener::onBeat)
+        , subBeatCallback(NullListener::onSubBeat)
+        , bpmCallback(NullListener::onBpmChanged)
+        , beatsCallback(NullListener::onBeatsChanged)
+        , ticksCallback(NullListener::onTicksChanged)
+        , groupingCallback(NullListener::onGroupingChanged)
+        { }
+
+    void setClickListener(const eventCallback& f) { clickCallback = f; }
+    void setClickEndListener(const noParamCallback& f) { clickEndCallback = f; }
+    void setClockListener(const noParamCallback& f) { clockCallback = f; }
+    void setStartListener(const noParamCallback& f) { startCallback = f; }
+    void setStopListener(const noParamCallback& f) { stopCallback = f; }
+    void setBeatEventListener(const twoParamCallback& f) { beatCallback = f; }
+    void setTickEventListener(const twoParamCallback& f) { subBeatCallback = f; }
+    void setBpmChangeCallback(const oneParamCallback& f) { bpmCallback = f; }
+    void setBeatsChangeCallback(const oneParamCallback& f) { beatsCallback = f; }
+    void setTicksChangeCallback(const oneParamCallback& f) { ticksCallback = f; }
+    void setGroupingChangeCallback(const groupingParamCallback& f) { groupingCallback = f; }
+
+protected:
+    uint16_t onClick(BeatEvent e) const { return clickCallback(e); }
+    void onClickEnd() const { clickEndCallback(); }
+    void onClock() const { clockCallback(); }
+    void onStart() const { startCallback(); }
+    void onStop() const { stopCallback(); }
+    void onBeat(uint8_t beat, uint8_t beats) const { beatCallback(beat, beats); }
+    void onSubBeat(uint8_t tick, uint8_t ticks) const { subBeatCallback(tick, ticks); }
+    void onBpmChanged(uint8_t bpm) const { bpmCallback(bpm); }
+    void onBeatsChanged(uint8_t beats) const { beatsCallback(beats); }
+    void onTicksChanged(uint8_t ticks) const { ticksCallback(ticks); }
+    void onGroupingChanged(MeterGrouping g) const { groupingCallback(g); }
+
+private:
+    eventCallback clickCallback;
+    noParamCallback clickEndCallback;
+    noParamCallback clockCallback;
+    noParamCallback startCallback;
+    noParamCallback stopCallback;
+    twoParamCallback beatCallback;
+    twoParamCallback subBeatCallback;
+    oneParamCallback bpmCallback;
+    oneParamCallback beatsCallback;
+    oneParamCallback ticksCallback;
+    groupingParamCallback groupingCallback;
+};
+
+/*
+ * The metronome, which tells the given Listener about what it does (see
+ * NullListener for the functions it needs). The listener is bound at compile
+ * time, so that the calls made from the Timer1 ISR can be inlined into it,
+ * rather than being made through function pointers, which would force the
+ * ISR to save every call-clobbered register.
+ */
+template <typename Listener>
+class BasicMetronome : public MetronomeBase, public Listener {
+public:
+    void setBpm(uint8_t newValue) {
+        set_bpm(newValue);
+        Listener::onBpmChanged(getBpm());
+    }
+    // sets tempo in hundredths of a BPM
+    void setTempo(uint16_t newValue) {
+        set_tempo(newValue);
+        Listener::onBpmChanged(getBpm());
+    }
+    /* Sets the tempo (in hundredths of a BPM), and if the metronome is running,
+     * lines the beat up so that it started the given number of Timer1 counts
+     * ago, e.g. at the last tap of a tapped tempo.
+     */
+    void syncTempo(uint16_t newValue, uint32_t countsSinceBeat) {
+        set_tempo(newValue);
+        align_beat(countsSinceBeat);
+        Listener::onBpmChanged(getBpm());
+    }
+    void setMeasureLength(uint8_t newValue) {
+        set_measure_length(newValue);
+        Listener::onBeatsChanged(newValue);
+        Listener::onGroupingChanged(grouping);
+    }
+    void setGrouping(MeterGrouping newValue) {
+        if (set_grouping(newValue)) {
+            Listener::onGroupingChanged(newValue);
+        }
+    }
+    void setBeatDivision(uint8_t newValue) {
+        if (set_beat_division(newValue)) {
+            Listener::onTicksChanged(newValue);
+        }
+    }
+
+    /* increases or decreases the stored value for bpm by 1, keeping it within range,
+     * and adjusts the Timer1 compare register to trigger the TIM1_COMPA
+     * interrupt at the corresponding frequency.
+     */
+    void incrementBpm(uint8_t increment) {
+        setBpm(change(getBpm(), increment, SOFT_MIN_BPM, SOFT_MAX_BPM));
+    }
+    void incrementBeats(uint8_t increment) {
+        setMeasureLength(change(beats_per_measure, increment, MIN_BEATS_PER_MEASURE, MAX_BEATS_PER_MEASURE));
+    }
+    // skips over subdivisions which can't be played
+    void incrementTicks(uint8_t increment) {
+        uint8_t new_value = layers[0].divisor;
+        do {
+            new_value = change(new_value, increment, MIN_TICKS_PER_BEAT, MAX_TICKS_PER_BEAT);
+        } while (!tocks_per_subbeat.canPlay(new_value));
+        setBeatDivision(new_value);
+    }
+    // steps through the ways to group the measure into 2s and 3s (one at a time)
+    void incrementGrouping(uint8_t increment) {
+        setGrouping(static_cast<int8_t>(increment) > 0
+                ? next_grouping(grouping, beats_per_measure)
+                : previous_grouping(grouping, beats_per_measure));
+    }
+
+    /* needs to be put in ISR for Timer1 compare match A
+     * Calls the listener's onClick() for the beat or tick (if there is one),
+     * so that it can start the sound with as little delay as possible. This
+     * is done before the timer is set up for the next event, which is most
+     * of the work, so that the delay is short and about the same every time.
+     */
+    BeatEvent tock() {
+        BeatEvent e = advance();
+        uint16_t click_length = 0;
+        if (e.layers != 0) {
+            click_length = Listener::onClick(e);
+        }
+        if (e.flags & BeatEvent::CLOCK) {
+            Listener::onClock();
+        }
+        schedule_next();
+        time_click(click_length);
+        if (e.flags & ~BeatEvent::CLOCK) {
+            // if the main loop has fallen behind, the listeners just miss out
+            events.push(e);
+        }
+        return e;
+    }
 
-    // dummy callbacks used for default initialisation
-    static void dummyCallback1(uint8_t a) { }
-    static void dummyCallback2(uint8_t a, uint8_t b) { }
+    /* needs to be put in ISR for Timer1 compare match B
+     * Calls the listener's onClickEnd() when the click has lasted as long as
+     * onClick() said it should.
+     */
+    void endClick() {
+        end_click();
+        Listener::onClickEnd();
+    }
 
+    void start() {
+        Listener::onStart();
+        MetronomeBase::start();
+    }
+    // (this makes sure the click doesn't go on forever)
+    void stop() {
+        MetronomeBase::stop();
+        if (cancel_click()) {
+            Listener::onClickEnd();
+        }
+        Listener::onStop();
+    }
+    void toggle() { running ? stop() : start(); }
 
+    /* Calls the beat and tick listeners for the events which happened since
+     * this was last called. Should be called from the main loop.
+     */
+    void dispatchEvents() {
+        BeatEvent e;
+        while (events.pop(e)) {
+            if (e.flags & BeatEvent::BEAT) {
+                if (update_song(e)) {
+                    Listener::onBpmChanged(getBpm());
+                    Listener::onBeatsChanged(beats_per_measure);
+                    Listener::onTicksChanged(layers[0].divisor);
+                    Listener::onGroupingChanged(grouping);
+                }
+                if (update_ramp(e)) {
+                    Listener::onBpmChanged(getBpm());
+                }
+                Listener::onBeat(e.beat_num, beats_per_measure);
+            }
+            if (e.flags & BeatEvent::SUBBEAT) {
+                Listener::onSubBeat(e.subbeat_num, layers[0].divisor);
+            }
+        }
+    }
 };
+
+// Metronome with listeners that are set at run time
+typedef BasicMetronome<CallbackListener> Metronome;
+
+inline void MetronomeBase::beat(BeatEvent& e) {
+    e.flags |= BeatEvent::BEAT;
+    e.beat_num = beat_num;
+    if (beats_per_measure > 0) {
+        if (beat_num == 0) {
+            e.flags |= BeatEvent::MEASURE;
+        }
+        e.beat_level = levelOf(beat_levels, beat_num);
+    } else {
+        e.beat_level = LEVEL_NORMAL;
+    }
+    beat_num++;
+    // need >= check (not just ==) in case beats_per_measure = 0
+    if (beat_num >= beats_per_measure) {
+        beat_num = 0;
+    }
+}
+
+inline void MetronomeBase::subBeat(BeatEvent& e) {
+    e.flags |= BeatEvent::SUBBEAT;
+    e.subbeat_num = subbeat_num;
+}
+
+/*
+ * Returns how many timer counts after the start of the beat the given tock
+ * happens, using the fixed point tock period.
+ */
+inline uint32_t MetronomeBase::calc_tock_time(uint16_t tock) const {
+    constexpr uint32_t half = 1ul << (TOCK_PERIOD_FRACTION_BITS - 1u);
+    // round to the nearest count
+    return (tock * tock_period + half) >> TOCK_PERIOD_FRACTION_BITS;
+}
+
+/*
+ * Returns the number of timer counts from the currently scheduled event
+ * to the given tock, and advances beat_elapsed to it.
+ * A next_tock of TOCKS_PER_BEAT means the start of the next beat. Rather than
+ * using the fixed point tock period, this is worked out from the exact beat
+ * period: normally it's beat_period_floor counts long, but if the
+ * beat_period_remainder is nonzero, it means we would be (ever so) slightly
+ * too fast if we always counted that long. We correct for this error by
+ * counting for 1 extra count whenever the accumulated remainders add up
+ * to a whole count (see beat_error).
+ * OCR1A should be 1 less than the count period returned, since it resets to 0.
+ */
+inline uint32_t MetronomeBase::calc_timer_count(uint16_t next_tock) {
+    uint32_t elapsed = beat_elapsed;
+
+    if (next_tock >= TOCKS_PER_BEAT) {
+        uint32_t beat_end = beat_period_floor;
+        uint16_t error = beat_error + beat_period_remainder;
+        if (error >= tempo) {
+            // remainders have added up to a whole count
+            error -= tempo;
+            beat_end++;
+        }
+        beat_error = error;
+        beat_elapsed = 0;
+        return beat_end - elapsed;
+    } else {
+        auto next_time = calc_tock_time(next_tock);
+        beat_elapsed = next_time;
+        return next_time - elapsed;
+    }
+}
+
+/*
+ * Sets Timer1 to count the next part of counts_to_event. If this is longer than
+ * Timer1 can count in one go, it's split up, and the rest is left in
+ * counts_to_event for the next compare match. When the wait is less than two
+ * full timer periods, it's split in half rather than leaving a short last chunk,
+ * so that there's always plenty of time to set OCR1A before the timer reaches it.
+ */
+inline void MetronomeBase::load_timer_chunk() {
+    constexpr uint32_t max_chunk = TIMER1_HIGHEST_COUNT + 1ul;
+    uint32_t remaining = counts_to_event;
+    uint32_t chunk;
+
+    if (remaining > 2*max_chunk) {
+        chunk = max_chunk;
+    } else if (remaining > max_chunk) {
+        chunk = remaining / 2;
+    } else {
+        chunk = remaining;
+    }
+
+    counts_to_event = remaining - chunk;
+    last_top = OCR1A;
+    OCR1A = static_cast<uint16_t>(chunk - 1);
+}
+
+/*
+ * Sets what OC1A does at the next compare match, once the timer has been set
+ * up for it: it goes high if that's the start of a beat, and low otherwise.
+ */
+inline void MetronomeBase::arm_sync() {
+    if (!sync_output) {
+        return;
+    }
+    if (tock_num_modulo_beat == 0 && counts_to_event == 0) {
+        bitSet(TCCR1A, COM1A0);
+    } else {
+        bitClear(TCCR1A, COM1A0);
+    }
+}
+
+/*
+ * Makes the changes which the main loop has set up in advance (see pending),
+ * for the beat that is starting. Only called by the ISR, at the start of a beat.
+ * Everything has already been worked out, so there's nothing to do but copy.
+ */
+inline void MetronomeBase::apply_pending() {
+    uint8_t what = pending;
+    if (what & PENDING_TEMPO) {
+        tempo = next_tempo;
+        beat_period_floor = next_periods.beat_period_floor;
+        beat_period_remainder = next_periods.beat_period_remainder;
+        tock_period = next_periods.tock_period;
+        // keep the accumulated error in range
+        if (beat_error >= tempo) {
+            beat_error = tempo / 2u;
+        }
+    }
+    if (what & PENDING_METER) {
+        beats_per_measure = next_beats_per_measure;
+        beat_levels = next_beat_levels;
+    }
+    if (what & PENDING_SCHEDULE) {
+        schedule = next_schedule;
+        schedule_pos = 0;
+    }
+    pending = 0;
+}
+
+/*
+ * Keeps OCR1B pointing at the end of the click, if there is one, after each
+ * compare match A: given a new click's length, or else by counting down the
+ * timer period which has just finished.
+ */
+inline void MetronomeBase::time_click(uint16_t length) {
+    if (length != 0) {
+        arm_click_end(length);
+    } else if (click_left != 0) {
+        uint16_t left = click_left;
+        arm_click_end(left > click_top ? left - click_top - 1u : 0u);
+    }
+}
+
+/*
+ * Sets OCR1B to the end of the click, given how many counts after the last
+ * compare match A it is, if that's before the next one. Otherwise it's left
+ * until a later compare match A.
+ */
+inline void MetronomeBase::arm_click_end(uint16_t left) {
+    uint16_t top = OCR1A;
+    // if it's too late already, as soon as possible
+    uint16_t soonest = TCNT1 + 1u;
+    uint16_t match = left > soonest ? left - 1u : soonest;
+    if (match <= top) {
+        OCR1B = match;
+        // (writing a one clears the flag)
+        TIFR1 = _BV(OCF1B);
+        bitSet(TIMSK1, OCIE1B);
+    } else {
+        bitClear(TIMSK1, OCIE1B);
+    }
+    click_left = left != 0 ? left : 1u;
+    click_top = top;
+}
+
+inline void MetronomeBase::end_click() {
+    bitClear(TIMSK1, OCIE1B);
+    click_left = 0;
+}
+
+inline BeatEvent MetronomeBase::advance() {
+    BeatEvent e {BeatEvent::NONE, 0, 0, 0, LEVEL_MUTE, 0};
+
+    if (counts_to_event > 0) {
+        // nothing happens at the end of this chunk
+        return e;
+    }
+
+    uint16_t tock = tock_num_modulo_beat;
+
+    // ramps and songs only change things between beats or measures
+    // (beat_num is the number of the beat that is starting)
+    if (tock == 0 && pending != 0 && (!(pending & PENDING_AT_BAR) || beat_num == 0)) {
+        apply_pending();
+    }
+
+    if (tock == next_clock_tock) {
+        e.flags |= BeatEvent::CLOCK;
+        next_clock_tock = tock + TOCKS_PER_MIDI_CLOCK;
+    }
+
+    const Schedule& s = *schedule;
+    uint8_t pos = schedule_pos;
+
+    /* Metronome event checks */
+    // (there may be nothing to do here if the schedule has just changed)
+    if (pos < s.length && s.entries[pos].tock == tock) {
+        const Schedule::Entry& entry = s.entries[pos];
+        if (tock == 0) {
+            subbeat_num = 0;
+            beat(e);
+        }
+        if (entry.layers & 1u) {
+            subBeat(e);
+            subbeat_num++;
+        }
+        e.layers = entry.layers;
+        e.levels = entry.levels;
+        schedule_pos = pos + 1u;
+    }
+
+    return e;
+}
+
+inline void MetronomeBase::schedule_next() {
+    if (counts_to_event > 0) {
+        // just keep counting
+        load_timer_chunk();
+        arm_sync();
+        return;
+    }
+
+    uint8_t pos = schedule_pos;
+
+    /* Skip ahead to the next tock where something happens */
+#if SKIP_EMPTY_TOCKS
+    const Schedule& s = *schedule;
+    uint16_t next_tock = pos < s.length ? s.entries[pos].tock : TOCKS_PER_BEAT;
+    if (next_clock_tock < next_tock) {
+        next_tock = next_clock_tock;
+    }
+#else
+    uint16_t next_tock = tock_num_modulo_beat + 1u;
+#endif
+
+    // program the timer to count until then
+    counts_to_event = calc_timer_count(next_tock);
+    load_timer_chunk();
+
+    if (next_tock >= TOCKS_PER_BEAT) {
+        next_tock = 0;
+        pos = 0;
+        next_clock_tock = clock_output ? 0 : TOCKS_PER_BEAT;
+    }
+    tock_num_modulo_beat = next_tock;
+    schedule_pos = pos;
+    arm_sync();
+}
+
 #endif
@@ -0,0 +1,84 @@
+//
+// MIDI clock over the USART
+//
+
+#include "Midi.h"
+#include "millis.h"
+#include "byte_ops.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+MidiOut::MidiOut() noexcept
+    : queue()
+{ }
+
+// (MidiOut and MidiIn share it, so this leaves the other half as it is)
+static void usart_setup() {
+    bitClear(PRR, PRUSART0);
+    UBRR0 = MIDI_UBRR;
+    UCSR0A = 0;
+    // 8 data bits, no parity, 1 stop bit
+    UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+}
+
+void MidiOut::setup() {
+    auto sreg = SREG;
+    cli();
+    usart_setup();
+    bitSet(UCSR0B, TXEN0);
+    SREG = sreg;
+}
+
+/*
+ * The queue has more than one producer (the ISRs and the main loop), so
+ * interrupts are held off while it's written to. That's only a few cycles.
+ */
+bool MidiOut::send(uint8_t byte) {
+    auto sreg = SREG;
+    cli();
+    bool sent = true;
+    if (queue.isEmpty() && bitRead(UCSR0A, UDRE0)) {
+        UDR0 = byte;
+    } else {
+        sent = queue.push(byte);
+        bitSet(UCSR0B, UDRIE0);
+    }
+    SREG = sreg;
+    return sent;
+}
+
+void MidiOut::dataRegisterEmpty() {
+    uint8_t byte;
+    if (queue.pop(byte)) {
+        UDR0 = byte;
+    } else {
+        // (or it would keep going off)
+        bitClear(UCSR0B, UDRIE0);
+    }
+}
+
+MidiIn::MidiIn() noexcept
+    : messages()
+{ }
+
+void MidiIn::setup() {
+    auto sreg = SREG;
+    cli();
+    usart_setup();
+    UCSR0B |= _BV(RXEN0) | _BV(RXCIE0);
+    SREG = sreg;
+}
+
+void MidiIn::receive() {
+    uint32_t time = micros() - MIDI_RECEIVE_DELAY_US;
+    // (the flags have to be read before the data)
+    bool bad = UCSR0A & (_BV(FE0) | _BV(DOR0));
+    uint8_t byte = UDR0;
+    if (bad) {
+        return;
+    }
+    if (byte == MIDI_CLOCK || byte == MIDI_START || byte == MIDI_STOP) {
+        messages.push({byte, time});
+    }
+}
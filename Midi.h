@@ -0,0 +1,109 @@
+//
+// MIDI clock over the USART
+//
+
+#ifndef METRONOME_MIDI_H
+#define METRONOME_MIDI_H
+
+#include "EventQueue.h"
+
+#include <stdint.h>
+
+// the system realtime messages, which are all single bytes
+#define MIDI_CLOCK 0xF8
+#define MIDI_START 0xFA
+#define MIDI_CONTINUE 0xFB
+#define MIDI_STOP 0xFC
+
+/* How long the clock can stop for before it's taken to have gone away, in
+ * ms. (Several times longer than the pulses are apart at HARD_MIN_BPM.)
+ */
+#define MIDI_CLOCK_TIMEOUT 500
+/* How hard the clock is followed (see ClockPll). MIDI clock can be a
+ * millisecond or more out either way, so this smooths over a few beats.
+ */
+#define MIDI_PLL_PHASE_SHIFT 3
+#define MIDI_PLL_PERIOD_SHIFT 7
+
+#define MIDI_BAUD 31250
+// (exact at 8MHz, so there's no baud rate error)
+static constexpr uint16_t MIDI_UBRR = F_CPU / 16u / MIDI_BAUD - 1u;
+static_assert(F_CPU % (16ul * MIDI_BAUD) == 0, "F_CPU isn't a multiple of the MIDI baud rate");
+// how long a byte takes to send (start bit, 8 data bits, stop bit), in CPU cycles
+static constexpr uint16_t MIDI_BYTE_CYCLES = 10u * 16u * (MIDI_UBRR + 1u);
+/* How long after a byte started coming in the receiver has it, in us: the
+ * USART takes it half way through the stop bit.
+ */
+static constexpr uint16_t MIDI_RECEIVE_DELAY_US = 19u * 1000000ul / MIDI_BAUD / 2u;
+
+/*
+ * Sends MIDI out of the USART's TXD pin, without ever waiting for it.
+ *
+ * When the USART's data register is empty, a byte goes straight into it.
+ * That only means the last byte has moved on to the shift register, which
+ * may still be sending it, so this one starts going out when that's done,
+ * i.e. within MIDI_BYTE_CYCLES of the write (or at the next bit boundary,
+ * within 16 * (MIDI_UBRR + 1) cycles, if nothing was being sent). Otherwise
+ * it's queued, and the data register empty interrupt sends it after the ones
+ * in front, each of which takes another MIDI_BYTE_CYCLES. Only realtime
+ * messages are sent, and clock pulses are at least 9ms apart, so there's
+ * hardly ever more than one byte waiting, and a clock pulse is usually only
+ * held up by a Start or Stop just before it.
+ */
+class MidiOut {
+public:
+    MidiOut() noexcept;
+
+    // powers up the USART, and sets it up to transmit at MIDI_BAUD, 8N1
+    void setup();
+
+    /* Sends the byte, or queues it if the USART is busy. Returns false (and
+     * drops it) if the queue is full. Can be called from ISRs.
+     */
+    bool send(uint8_t byte);
+
+    // needs to be called from the USART data register empty ISR
+    void dataRegisterEmpty();
+
+private:
+    EventQueue<uint8_t, 8> queue;
+};
+
+struct MidiMessage {
+    // one of the realtime messages above
+    uint8_t status;
+    // the micros() when it started coming in
+    uint32_t time;
+};
+
+/*
+ * Receives MIDI clock, start and stop on the USART's RXD pin, and passes them
+ * to the main loop with the time each one came in. Everything else is
+ * ignored: realtime messages are single bytes, and can come in the middle of
+ * any other message, so they don't need the rest of it to be parsed.
+ *
+ * The time is read as soon as the receive interrupt goes off, and then taken
+ * back to when the byte started, which is when the sender sent it. It's to the
+ * 8us of micros() (which counts Timer0, at the same rate as Timer1), plus
+ * however long the interrupt was held up by another ISR.
+ */
+class MidiIn {
+public:
+    MidiIn() noexcept;
+
+    // powers up the USART, and sets it up to receive at MIDI_BAUD, 8N1
+    void setup();
+
+    // needs to be called from the USART receive complete ISR
+    void receive();
+
+    // Main loop side. Returns false if there are no messages waiting.
+    bool pop(MidiMessage& message) {
+        return messages.pop(message);
+    }
+
+private:
+    EventQueue<MidiMessage, 8> messages;
+};
+
+#endif //METRONOME_MIDI_H
@@ -0,0 +1,114 @@
+//
+// Picking out notes played into the ADC, to follow the player's tempo
+//
+
+#include "OnsetDetector.h"
+#include "pindefs.h"
+#include "byte_ops.h"
+
+#include <avr/interrupt.h>
+
+// time constants, as the number of bits to shift each filter's difference by
+// (~13ms)
+#define DC_SHIFT 6
+// (~7ms)
+#define ENVELOPE_SHIFT 5
+// (~110ms)
+#define BACKGROUND_SHIFT 9
+
+static constexpr uint16_t HOLDOFF_SAMPLES = static_cast<uint16_t>(
+        static_cast<uint32_t>(ONSET_HOLDOFF) * ONSET_SAMPLE_RATE / 1000u);
+static_assert(HOLDOFF_SAMPLES <= 255, "ONSET_HOLDOFF is too long to count in a byte");
+static_assert(ONSET_ADC_PRESCALE == 128, "the ADC prescaler bits are for /128");
+
+OnsetDetector::OnsetDetector() noexcept
+    : dc(128u << 8)
+    , envelope(0)
+    , background(0)
+    , peak(0)
+    , holdoff(0)
+    , armed(false)
+    , onsets()
+{ }
+
+void OnsetDetector::start() {
+    bitClear(PRR, PRADC);
+    // no pullup, and no digital input, which would waste power on an analogue signal
+    bitClear(ONSET_PORT, ONSET_PIN);
+    bitSet(DIDR0, ONSET_DIGITAL_DISABLE);
+    // AVcc reference, left adjusted so that ADCH is the top 8 bits
+    ADMUX = _BV(REFS0) | _BV(ADLAR) | ONSET_ADC_CHANNEL;
+    // free running
+    ADCSRB = 0;
+    ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIF) | _BV(ADIE)
+            | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+}
+
+void OnsetDetector::stop() {
+    ADCSRA = 0;
+    bitSet(PRR, PRADC);
+    dc = 128u << 8;
+    envelope = 0;
+    background = 0;
+    peak = 0;
+    holdoff = 0;
+    armed = false;
+    onsets.clear();
+}
+
+void OnsetDetector::conversionComplete() {
+    // (writing a zero to ADIF leaves it alone)
+    ADCSRA = static_cast<uint8_t>(ADCSRA & ~(_BV(ADIE) | _BV(ADIF)));
+    sei();
+    if (addSample(ADCH)) {
+        onsets.push(micros());
+    }
+    cli();
+    ADCSRA = static_cast<uint8_t>((ADCSRA & ~_BV(ADIF)) | _BV(ADIE));
+}
+
+bool OnsetDetector::addSample(uint8_t sample) {
+    uint16_t level = static_cast<uint16_t>(sample) << 8u;
+    if (level > dc) {
+        dc += (level - dc) >> DC_SHIFT;
+    } else {
+        dc -= (dc - level) >> DC_SHIFT;
+    }
+    uint8_t bias = static_cast<uint8_t>(dc >> 8u);
+    uint8_t rectified = sample > bias ? sample - bias : bias - sample;
+
+    uint16_t e = static_cast<uint16_t>(rectified) << 8u;
+    if (e > envelope) {
+        envelope = e;
+    } else {
+        envelope -= envelope >> ENVELOPE_SHIFT;
+        e = envelope;
+    }
+    if (e > background) {
+        background += (e - background) >> BACKGROUND_SHIFT;
+    } else {
+        background -= (background - e) >> BACKGROUND_SHIFT;
+    }
+
+    if (holdoff != 0) {
+        holdoff--;
+        return false;
+    }
+    // (halved, so that one and a half times the background fits in 16 bits)
+    uint16_t half = e >> 1u;
+    if (!armed) {
+        // until it has died down to half of the onset's peak
+        if (e > peak) {
+            peak = e;
+        }
+        armed = e <= peak / 2u;
+        return false;
+    }
+    if (half > background - (background >> 2u) + (ONSET_THRESHOLD << 7u)) {
+        armed = false;
+        peak = e;
+        holdoff = HOLDOFF_SAMPLES;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,88 @@
+//
+// Picking out notes played into the ADC, to follow the player's tempo
+//
+
+#ifndef METRONOME_ONSETDETECTOR_H
+#define METRONOME_ONSETDETECTOR_H
+
+#include "EventQueue.h"
+#include "millis.h"
+
+#include <avr/io.h>
+#include <stdint.h>
+
+/*
+ * The ADC runs continuously, at the slowest clock it has, which is 62.5kHz at
+ * 8MHz (within the 50-200kHz it needs for full accuracy), and a conversion
+ * takes 13 ADC clocks. Only the top 8 bits of each sample are used.
+ */
+#define ONSET_ADC_PRESCALE 128
+static constexpr uint16_t ONSET_SAMPLE_RATE = F_CPU / ONSET_ADC_PRESCALE / 13u;
+
+/*
+ * How far above one and a half times the background level (in 8 bit ADC
+ * steps) the envelope has to jump to count as a note starting.
+ */
+#define ONSET_THRESHOLD 8
+// the shortest time between notes, so that a note can't start twice, in ms
+#define ONSET_HOLDOFF 50
+
+/*
+ * Finds the starts of notes (onsets) in the signal on ONSET_PIN, e.g. from a
+ * piezo pickup on a drum. Each sample is handled in the ADC ISR, in a few
+ * dozen cycles of 8 and 16 bit fixed point:
+ *  - the DC bias is tracked with a slow low pass filter and taken off,
+ *  - the rest is rectified, and followed by an envelope which jumps up
+ *    straight away but dies down over about 7ms,
+ *  - and the envelope is compared with a much slower average of itself, the
+ *    background level, so that loud and quiet playing both work.
+ * When the envelope jumps well above the background, the time is queued for
+ * the main loop, and the detector waits for ONSET_HOLDOFF, and for the
+ * envelope to die down to half its peak, before it looks for the next one.
+ */
+class OnsetDetector {
+public:
+    OnsetDetector() noexcept;
+
+    // powers up the ADC and starts sampling ONSET_PIN
+    void start();
+    /* stops sampling and powers the ADC down again, and forgets the signal,
+     * so that the next start() doesn't pick up an onset from it
+     */
+    void stop();
+
+    /* Needs to be called from the ADC ISR, which must be a blocking one.
+     * The sample can wait for the Timer1 ISRs, so this lets them in, but
+     * turns its own interrupt off until it's done: if it took longer than a
+     * conversion, it would come in again on top of itself, and the filters
+     * and the onset queue would have two writers at once.
+     */
+    void conversionComplete();
+
+    /* Runs the detector on the next sample (which is unsigned, with the bias
+     * at about half way). Returns true if a note has just started. This is
+     * public for replaying recorded samples (see host/onset_replay.cpp).
+     */
+    bool addSample(uint8_t sample);
+
+    // Main loop side. Gets the micros() of the next onset, if there is one
+    bool pop(uint32_t& time) {
+        return onsets.pop(time);
+    }
+
+private:
+    // all in 8.8 fixed point, in ADC steps
+    uint16_t dc;
+    uint16_t envelope;
+    uint16_t background;
+    // the highest the envelope has got since the last onset
+    uint16_t peak;
+    // samples left until the next onset can be looked for
+    uint8_t holdoff;
+    // set once the envelope has died down after an onset
+    bool armed;
+
+    EventQueue<uint32_t, 4> onsets;
+};
+
+#endif //METRONOME_ONSETDETECTOR_H
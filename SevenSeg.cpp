@@ -189,9 +189,18 @@ void SevenSeg::displayOn() {
 
 
 void SevenSeg::setup() {
+#if SYNC_ENABLED
+    bitSet(DIGIT_DDR, SYNC_DIGIT_0_PIN, DIGIT_2);
+    bitSet(SYNC_DIGIT_1_DDR, SYNC_DIGIT_1_PIN);
+#else
     bitSet(DIGIT_DDR, DIGIT_0, DIGIT_1, DIGIT_2);
+#endif
     // fixed PORTD for segment control
     SEGMENT_DDR = 0b11111111;
+#if MIDI_ENABLED
+    bitSet(MIDI_TX_SEGMENT_DDR, MIDI_TX_SEGMENT_PIN);
+    bitSet(MIDI_RX_SEGMENT_DDR, MIDI_RX_SEGMENT_PIN);
+#endif
 }
 
 void SevenSeg::cycleDigit() {
@@ -230,14 +239,80 @@ void SevenSeg::showNumber(int number, bool hide_leading_zeros) {
     }
 }
 
+/*
+ * Digits 0 and 1 are on other pins when Timer1 needs theirs for the sync
+ * pulses (see pindefs.h).
+ *
+ * The display ISRs let the Timer1 ones in (see main.cpp), and the end of a
+ * click turns the LED off, which is on PORTB too. Setting a bit picked at
+ * run time is a read-modify-write of the port, rather than a single sbi or
+ * cbi, so if the click ended in between, this would put the LED back on.
+ * Interrupts are held off for those few cycles.
+ */
+static inline void digit_on(uint8_t digit) {
+    auto sreg = SREG;
+    cli();
+#if SYNC_ENABLED
+    if (digit == 0) {
+        bitSet(DIGIT_PORT, SYNC_DIGIT_0_PIN);
+    } else if (digit == 1) {
+        bitSet(SYNC_DIGIT_1_PORT, SYNC_DIGIT_1_PIN);
+    } else {
+        bitSet(DIGIT_PORT, digit_pin[digit]);
+    }
+#else
+    bitSet(DIGIT_PORT, digit_pin[digit]);
+#endif
+    SREG = sreg;
+}
+
+static inline void digit_off(uint8_t digit) {
+    auto sreg = SREG;
+    cli();
+#if SYNC_ENABLED
+    if (digit == 0) {
+        bitClear(DIGIT_PORT, SYNC_DIGIT_0_PIN);
+    } else if (digit == 1) {
+        bitClear(SYNC_DIGIT_1_PORT, SYNC_DIGIT_1_PIN);
+    } else {
+        bitClear(DIGIT_PORT, digit_pin[digit]);
+    }
+#else
+    bitClear(DIGIT_PORT, digit_pin[digit]);
+#endif
+    SREG = sreg;
+}
+
 void SevenSeg::switchOnActiveDigit() {
-    bitSet(DIGIT_PORT, digit_pin[currentDigit]);
-    SEGMENT_PORT = segmentData[currentDigit];
+    digit_on(currentDigit);
+    uint8_t segments = segmentData[currentDigit];
+#if MIDI_ENABLED
+    // (the USART has the segments' usual pins; RXD keeps its pullup on)
+    SEGMENT_PORT = segments | _BV(MIDI_RX_SEGMENT_BIT);
+    if (segments & _BV(MIDI_TX_SEGMENT_BIT)) {
+        bitSet(MIDI_TX_SEGMENT_PORT, MIDI_TX_SEGMENT_PIN);
+    } else {
+        bitClear(MIDI_TX_SEGMENT_PORT, MIDI_TX_SEGMENT_PIN);
+    }
+    if (segments & _BV(MIDI_RX_SEGMENT_BIT)) {
+        bitSet(MIDI_RX_SEGMENT_PORT, MIDI_RX_SEGMENT_PIN);
+    } else {
+        bitClear(MIDI_RX_SEGMENT_PORT, MIDI_RX_SEGMENT_PIN);
+    }
+#else
+    SEGMENT_PORT = segments;
+#endif
 }
 
 void SevenSeg::switchOffActiveDigit() {
-    bitClear(DIGIT_PORT, currentDigit);
+    digit_off(currentDigit);
+#if MIDI_ENABLED
+    SEGMENT_PORT = _BV(MIDI_RX_SEGMENT_BIT);
+    bitClear(MIDI_TX_SEGMENT_PORT, MIDI_TX_SEGMENT_PIN);
+    bitClear(MIDI_RX_SEGMENT_PORT, MIDI_RX_SEGMENT_PIN);
+#else
     SEGMENT_PORT = 0;
+#endif
 }
 
 /* Switches off the display */
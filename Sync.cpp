@@ -0,0 +1,43 @@
+//
+// Sync pulses in and out, for chaining metronomes together
+//
+
+#include "Sync.h"
+#include "Metronome.h"
+#include "millis.h"
+#include "pindefs.h"
+#include "byte_ops.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+static constexpr uint32_t US_PER_COUNT = 1000000ul / TIMER1_COUNTS_PER_SECOND;
+
+SyncIn::SyncIn() noexcept
+    : edges()
+{ }
+
+void SyncIn::setup() {
+    auto sreg = SREG;
+    cli();
+    bitClear(SYNC_IN_DDR, SYNC_IN_PIN);
+    // (the metronome only changes the clock select bits of TCCR1B from here on)
+    bitSet(TCCR1B, ICNC1, ICES1);
+    // (writing a one clears the flag)
+    TIFR1 = _BV(ICF1);
+    bitSet(TIMSK1, ICIE1);
+    SREG = sreg;
+}
+
+void SyncIn::capture(uint32_t last_period) {
+    uint32_t now = micros();
+    uint16_t count = TCNT1;
+    uint16_t edge = ICR1;
+    /* Timer1 may have started a new period since the edge, but it can't have
+     * finished it, as the compare match ISR can't run before this one. The
+     * edge was then in the last period, which may not have run to the OCR1A
+     * in force now, if the main loop has restarted the timer since.
+     */
+    uint32_t since = count >= edge ? count - edge : count + last_period - edge;
+    edges.push(now - since * US_PER_COUNT);
+}
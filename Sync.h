@@ -0,0 +1,61 @@
+//
+// Sync pulses in and out, for chaining metronomes together
+//
+
+#ifndef METRONOME_SYNC_H
+#define METRONOME_SYNC_H
+
+#include "EventQueue.h"
+
+#include <stdint.h>
+
+// one pulse at the start of each beat, both ways
+#define SYNC_PULSES_PER_BEAT 1
+/* How hard the pulses are followed (see ClockPll). Pulses from another
+ * metronome are timed by the hardware at both ends, to within a count, so
+ * there's no jitter to smooth out: each beat is taken as it comes, and the
+ * tempo is just the last one's length. That way a tempo change goes down a
+ * chain of them in a beat or two per metronome, rather than overshooting.
+ */
+#define SYNC_PLL_PHASE_SHIFT 0
+#define SYNC_PLL_PERIOD_SHIFT 0
+// how many beats the pulses can stop for before the metronome stops with them
+#define SYNC_TIMEOUT_BEATS 2
+
+/*
+ * Times the rising edges on ICP1 with Timer1's input capture, and passes them
+ * to the main loop as micros() times.
+ *
+ * Timer1 keeps the count at the edge in ICR1, however long the interrupt is
+ * held up, so the time is worked back from that: it's as good as the
+ * hardware's, rather than depending on the ISR's latency. (Timer1 counts in
+ * the same 8us steps as micros(), since they share the prescaler.) While the
+ * metronome is stopped, Timer1 doesn't count, and the time is just the ISR's.
+ *
+ * The pulses out come from the metronome itself (see setSyncOutput()).
+ */
+class SyncIn {
+public:
+    SyncIn() noexcept;
+
+    /* Sets up the input capture for rising edges, with the noise canceller.
+     * (The board pulls the input down, so nothing plugged in reads low.)
+     * Needs to be done after the metronome's setup().
+     */
+    void setup();
+
+    /* needs to be called from the Timer1 input capture ISR, with how long
+     * Timer1's last period was (see Metronome's lastPeriod())
+     */
+    void capture(uint32_t last_period);
+
+    // Main loop side. Returns false if there are no pulses waiting.
+    bool pop(uint32_t& time) {
+        return edges.pop(time);
+    }
+
+private:
+    EventQueue<uint32_t, 4> edges;
+};
+
+#endif //METRONOME_SYNC_H
@@ -0,0 +1,128 @@
+//
+// Working out a tempo from taps on a button
+//
+
+#include "TapTempo.h"
+#include "Metronome.h"
+
+// the time between taps at the ends of the BPM range
+static constexpr uint32_t LONGEST_TAP_INTERVAL = 60000000ul / SOFT_MIN_BPM;
+static constexpr uint32_t SHORTEST_TAP_INTERVAL = 60000000ul / SOFT_MAX_BPM;
+/* Two intervals in a row which are both more than an eighth longer (or both
+ * shorter) than the median of the ones so far are taken to be a change of
+ * tempo, rather than bad taps, and the averaging starts again from them.
+ */
+#define TAP_CHANGE_FRACTION 8
+
+static_assert(TAP_HISTORY <= 255, "TAP_HISTORY is counted in a byte");
+// (so the sum of the intervals can't overflow)
+static_assert(TAP_HISTORY * LONGEST_TAP_INTERVAL < UINT32_MAX / 2, "TAP_HISTORY is too long");
+
+TapTempo::TapTempo() noexcept
+    : last_tap(0)
+    , tapped(false)
+    , count(0)
+    , next(0)
+    , drift(0)
+    , estimate(0)
+    , intervals()
+    , sorted()
+{ }
+
+void TapTempo::reset() {
+    tapped = false;
+    estimate = 0;
+    count = 0;
+    next = 0;
+    drift = 0;
+}
+
+bool TapTempo::tap(uint32_t time) {
+    uint32_t interval = time - last_tap;
+    if (!tapped || interval > LONGEST_TAP_INTERVAL) {
+        // the first tap of a new tempo (the old one stays until the next)
+        tapped = true;
+        count = 0;
+        next = 0;
+        drift = 0;
+        last_tap = time;
+        return false;
+    }
+    if (interval < SHORTEST_TAP_INTERVAL) {
+        return false;
+    }
+    last_tap = time;
+
+    int8_t off = 0;
+    if (count > 0) {
+        uint32_t median = sorted[count / 2u];
+        uint32_t change = median / TAP_CHANGE_FRACTION;
+        if (interval > median + change) {
+            off = 1;
+        } else if (interval < median - change) {
+            off = -1;
+        }
+    }
+    if (off != 0 && off == drift) {
+        // keep the last one, which was at the new tempo too
+        uint32_t previous = intervals[(next + TAP_HISTORY - 1u) % TAP_HISTORY];
+        count = 0;
+        next = 0;
+        add_interval(previous);
+        off = 0;
+    }
+    drift = off;
+    add_interval(interval);
+    estimate = trimmed_mean_tempo();
+    return true;
+}
+
+void TapTempo::add_interval(uint32_t interval) {
+    uint8_t n = count;
+    if (n == TAP_HISTORY) {
+        // the oldest one goes, from wherever it is in the sorted ones
+        uint32_t oldest = intervals[next];
+        uint8_t i = 0;
+        while (sorted[i] != oldest) {
+            ++i;
+        }
+        for (--n; i < n; ++i) {
+            sorted[i] = sorted[i + 1u];
+        }
+    }
+    intervals[next] = interval;
+    next = static_cast<uint8_t>((next + 1u) % TAP_HISTORY);
+
+    // insertion, from the long end
+    uint8_t i = n;
+    while (i > 0 && sorted[i - 1u] > interval) {
+        sorted[i] = sorted[i - 1u];
+        --i;
+    }
+    sorted[i] = interval;
+    count = n + 1u;
+}
+
+uint16_t TapTempo::trimmed_mean_tempo() const {
+    uint8_t trim = count / 4u;
+    uint8_t kept = count - 2u * trim;
+    uint32_t sum = 0;
+    for (uint8_t i = trim; i < count - trim; ++i) {
+        sum += sorted[i];
+    }
+    uint32_t mean = (sum + kept / 2u) / kept;
+
+    /* 60 s per minute, in hundredths of a BPM, is 6e9, which doesn't fit in
+     * 32 bits, so the mean is halved instead (losing half a microsecond at worst).
+     */
+    uint32_t half_mean = mean / 2u;
+    uint32_t t = (30000000ul * TEMPO_SCALE + half_mean / 2u) / half_mean;
+    constexpr uint32_t min_tempo = SOFT_MIN_BPM * TEMPO_SCALE;
+    constexpr uint32_t max_tempo = SOFT_MAX_BPM * TEMPO_SCALE;
+    if (t < min_tempo) {
+        t = min_tempo;
+    } else if (t > max_tempo) {
+        t = max_tempo;
+    }
+    return static_cast<uint16_t>(t);
+}
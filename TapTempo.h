@@ -0,0 +1,66 @@
+//
+// Working out a tempo from taps on a button
+//
+
+#ifndef METRONOME_TAPTEMPO_H
+#define METRONOME_TAPTEMPO_H
+
+#include <stdint.h>
+
+// how many of the latest intervals between taps are averaged
+#define TAP_HISTORY 8
+
+/*
+ * Keeps the intervals between the last few taps, and estimates the tempo from
+ * them with a trimmed mean: the shortest and longest quarter are left out, so
+ * the odd tap which is early or late doesn't pull the tempo off, but the rest
+ * are still averaged, to smooth out the jitter of tapping.
+ *
+ * The intervals are also kept in sorted order, which is updated as each one
+ * comes in by taking out the oldest and putting in the newest, so it's never
+ * sorted from scratch.
+ *
+ * Everything is in whole microseconds, and worked out in 32 bit integers.
+ */
+class TapTempo {
+public:
+    TapTempo() noexcept;
+
+    /*
+     * Adds a tap at the given time, from micros(). Returns true if there's a
+     * new tempo estimate, which needs at least two taps in a row, close
+     * enough together to be within the BPM range. A tap too long after the
+     * last one starts again, and one too soon after it is ignored.
+     */
+    bool tap(uint32_t time);
+    // forgets all the taps so far, and the tempo
+    void reset();
+
+    // in hundredths of a BPM (as used by Metronome::setTempo()), or 0 if there isn't one yet
+    uint16_t tempo() const {
+        return estimate;
+    }
+    // the time of the last tap which was counted
+    uint32_t lastTap() const {
+        return last_tap;
+    }
+
+private:
+    uint32_t last_tap;
+    bool tapped;
+    // how many intervals there are, and where the next one goes in intervals
+    uint8_t count;
+    uint8_t next;
+    // whether the last interval was well above (1) or below (-1) the median
+    int8_t drift;
+    uint16_t estimate;
+    // in the order they were tapped, as a ring buffer
+    uint32_t intervals[TAP_HISTORY];
+    // the same ones, from shortest to longest
+    uint32_t sorted[TAP_HISTORY];
+
+    void add_interval(uint32_t interval);
+    uint16_t trimmed_mean_tempo() const;
+};
+
+#endif //METRONOME_TAPTEMPO_H
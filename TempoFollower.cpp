@@ -0,0 +1,118 @@
+//
+// Estimating the player's tempo from the notes they play
+//
+
+#include "TempoFollower.h"
+#include "Metronome.h"
+
+// what each vote adds to its bin, and how many of them the peak needs
+#define VOTE_WEIGHT 16u
+#define MIN_VOTES 4u
+// each note, the bins lose this fraction (as a shift), forgetting old notes
+#define FORGET_SHIFT 4
+
+// intervals of more than this many quarter beats aren't counted
+static constexpr uint8_t MAX_GRID_STEPS = 8;
+
+static_assert(FOLLOW_HISTORY <= 255, "FOLLOW_HISTORY is counted in a byte");
+static_assert(FOLLOW_RANGE < 25, "FOLLOW_RANGE is too wide to tell quarter beats apart");
+
+TempoFollower::TempoFollower() noexcept
+    : set_tempo(0)
+    , grid(0)
+    , count(0)
+    , next(0)
+    , estimate(0)
+    , onsets()
+    , bins()
+{ }
+
+void TempoFollower::reset() {
+    count = 0;
+    next = 0;
+    estimate = 0;
+    for (uint16_t& bin : bins) {
+        bin = 0;
+    }
+}
+
+void TempoFollower::onset(uint32_t time, uint16_t tempo) {
+    if (tempo != set_tempo) {
+        reset();
+        set_tempo = tempo;
+        // a quarter of 60s per minute, in hundredths of a BPM, fits in 32 bits
+        grid = (15000000ul * TEMPO_SCALE + tempo / 2u) / tempo;
+    }
+
+    for (uint16_t& bin : bins) {
+        bin -= bin >> FORGET_SHIFT;
+    }
+    for (uint8_t i = 0; i < count; ++i) {
+        vote(time - onsets[i]);
+    }
+    onsets[next] = time;
+    next = static_cast<uint8_t>((next + 1u) % FOLLOW_HISTORY);
+    if (count < FOLLOW_HISTORY) {
+        count++;
+    }
+
+    uint16_t peak = find_peak();
+    if (peak == 0) {
+        estimate = 0;
+    } else {
+        // the player's beat is longer than the set one by peak - 10000 in 10000
+        estimate = static_cast<uint16_t>((static_cast<uint32_t>(set_tempo) * 10000u + peak / 2u) / peak);
+    }
+}
+
+/*
+ * Works out which whole number of quarter beats the interval is closest to,
+ * and how far off it is, as a fraction of the interval, in bins of half a
+ * percent. Intervals nowhere near the grid (e.g. triplets) don't vote.
+ */
+void TempoFollower::vote(uint32_t interval) {
+    uint32_t steps = (interval + grid / 2u) / grid;
+    if (steps == 0 || steps > MAX_GRID_STEPS) {
+        return;
+    }
+    uint32_t on_grid = steps * grid;
+    bool longer = interval >= on_grid;
+    uint32_t off = longer ? interval - on_grid : on_grid - interval;
+    // (off is less than half a grid step, so this doesn't overflow)
+    uint8_t offset = static_cast<uint8_t>((off * 200u + on_grid / 2u) / on_grid);
+    if (offset > CENTRE_BIN) {
+        return;
+    }
+    bins[longer ? CENTRE_BIN + offset : CENTRE_BIN - offset] += VOTE_WEIGHT;
+}
+
+/*
+ * Returns the player's beat period relative to the set one, in units of
+ * 1/10000, from the weighted average around the highest bin, or 0 if it hasn't
+ * had enough votes.
+ */
+uint16_t TempoFollower::find_peak() const {
+    uint8_t peak = 0;
+    for (uint8_t i = 1; i < NUM_BINS; ++i) {
+        if (bins[i] > bins[peak]) {
+            peak = i;
+        }
+    }
+    if (bins[peak] < VOTE_WEIGHT * MIN_VOTES) {
+        return 0;
+    }
+
+    uint32_t total = 0;
+    int32_t moment = 0;
+    for (int8_t d = -1; d <= 1; ++d) {
+        int8_t i = static_cast<int8_t>(peak + d);
+        if (i < 0 || i >= NUM_BINS) {
+            continue;
+        }
+        total += bins[i];
+        moment += static_cast<int32_t>(bins[i]) * (i - CENTRE_BIN);
+    }
+    // each bin is 50 in 10000
+    int32_t offset = (moment * 50 + (moment >= 0 ? 1 : -1) * static_cast<int32_t>(total / 2u)) / static_cast<int32_t>(total);
+    return static_cast<uint16_t>(10000 + offset);
+}
@@ -0,0 +1,68 @@
+//
+// Estimating the player's tempo from the notes they play
+//
+
+#ifndef METRONOME_TEMPOFOLLOWER_H
+#define METRONOME_TEMPOFOLLOWER_H
+
+#include <stdint.h>
+
+// how many of the previous onsets each new one is compared with
+#define FOLLOW_HISTORY 8
+/*
+ * The player's tempo is looked for within this many percent of the set one,
+ * in steps of half a percent.
+ */
+#define FOLLOW_RANGE 12
+
+/*
+ * Works out the tempo that the player is actually at, from the times of the
+ * notes they play (see OnsetDetector), relative to the tempo that the
+ * metronome is set to. Each new note is compared with the last FOLLOW_HISTORY
+ * ones, and each interval between them which is close to a whole number of
+ * quarter beats (i.e. crotchets, quavers or semiquavers at the set tempo)
+ * votes for how far off it is, as a fraction of the beat. The votes go in a
+ * histogram of inter-onset intervals, whose bins are steps of that fraction,
+ * and which slowly forgets old votes, so the peak follows the player.
+ *
+ * This is all integer maths, incremental (a bounded amount of work per note),
+ * and takes about 130 bytes of RAM.
+ */
+class TempoFollower {
+public:
+    TempoFollower() noexcept;
+
+    // forgets all the notes so far
+    void reset();
+
+    /* Adds a note which started at the given time, from micros(), while the
+     * metronome was set to the given tempo (in hundredths of a BPM). If the
+     * tempo has changed since the last one, it starts again.
+     */
+    void onset(uint32_t time, uint16_t tempo);
+
+    /* The player's tempo in hundredths of a BPM, or 0 if there isn't enough to
+     * go on yet.
+     */
+    uint16_t tempo() const {
+        return estimate;
+    }
+
+private:
+    static constexpr uint8_t NUM_BINS = 4u * FOLLOW_RANGE + 1u;
+    static constexpr uint8_t CENTRE_BIN = 2u * FOLLOW_RANGE;
+
+    uint16_t set_tempo;
+    // the set beat period, over 4
+    uint32_t grid;
+    uint8_t count;
+    uint8_t next;
+    uint16_t estimate;
+    uint32_t onsets[FOLLOW_HISTORY];
+    uint16_t bins[NUM_BINS];
+
+    void vote(uint32_t interval);
+    uint16_t find_peak() const;
+};
+
+#endif //METRONOME_TEMPOFOLLOWER_H
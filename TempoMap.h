@@ -0,0 +1,79 @@
+//
+// Song tempo maps, stored in flash
+//
+
+#ifndef METRONOME_TEMPOMAP_H
+#define METRONOME_TEMPOMAP_H
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+/*
+ * A setlist is a sequence of songs, and each song is a sequence of sections,
+ * each with its own tempo, meter and subdivision, played one after the other.
+ * They are stored in flash as a stream of bytes, which is usually generated
+ * from a text file using host/setlist_compiler.
+ *   setlist: [number of songs] song...
+ *   song:    [number of sections] section...
+ *   section: [bars] [tempo, 2 bytes] [beats per measure] [ticks per beat]
+ *            [beat levels, 4 bytes]
+ * Tempos are in hundredths of a BPM, and the beat levels are a LevelPattern
+ * (see Metronome.h). All multibyte values are little endian.
+ */
+#define SONG_SECTION_SIZE 9
+
+struct SongSection {
+    // how many measures the section lasts for; at least 1
+    uint8_t bars;
+    uint16_t tempo;
+    uint8_t beats_per_measure;
+    uint8_t beat_divisor;
+    uint32_t levels;
+
+    // reads the section stored at the given address in flash
+    static SongSection read_P(const uint8_t* section) {
+        SongSection s;
+        s.bars = pgm_read_byte(section);
+        s.tempo = read_word_P(section + 1);
+        s.beats_per_measure = pgm_read_byte(section + 3);
+        s.beat_divisor = pgm_read_byte(section + 4);
+        s.levels = read_word_P(section + 5) | static_cast<uint32_t>(read_word_P(section + 7)) << 16u;
+        return s;
+    }
+
+    // writes the section out in the same format, for the setlist compiler
+    void write(uint8_t* section) const {
+        section[0] = bars;
+        section[1] = static_cast<uint8_t>(tempo);
+        section[2] = static_cast<uint8_t>(tempo >> 8u);
+        section[3] = beats_per_measure;
+        section[4] = beat_divisor;
+        for (uint8_t i = 0; i < 4; ++i) {
+            section[5 + i] = static_cast<uint8_t>(levels >> (8u * i));
+        }
+    }
+
+private:
+    // little endian, whatever the alignment
+    static uint16_t read_word_P(const uint8_t* p) {
+        return static_cast<uint16_t>(pgm_read_byte(p) | (pgm_read_byte(p + 1) << 8u));
+    }
+};
+
+/*
+ * Returns the address in flash of the given song of a setlist (which starts
+ * with the number of sections in it), or nullptr if there aren't that many songs.
+ */
+inline const uint8_t* setlist_song_P(const uint8_t* setlist, uint8_t song) {
+    uint8_t num_songs = pgm_read_byte(setlist);
+    if (song >= num_songs) {
+        return nullptr;
+    }
+    const uint8_t* p = setlist + 1;
+    for (uint8_t i = 0; i < song; ++i) {
+        p += 1 + pgm_read_byte(p) * SONG_SECTION_SIZE;
+    }
+    return p;
+}
+
+#endif //METRONOME_TEMPOMAP_H
@@ -0,0 +1,138 @@
+//
+// Software timers, counted in Timer0 overflows
+//
+
+#include "TimerWheel.h"
+
+static_assert(TIMER_POOL_SIZE < TimerWheel::NO_TIMER, "too many timers to index with a byte");
+// (the deadlines kept for the top level have to fit in Timer::rest)
+static_assert(TIMER_WHEEL_SLOT_BITS * (TIMER_WHEEL_LEVELS - 1) <= 8, "the wheel is too big");
+
+TimerWheel::TimerWheel() noexcept
+    : ticks(0)
+    , now(0)
+    , num_timers(0)
+    , timers()
+{
+    for (uint8_t& head : heads) {
+        head = NO_TIMER;
+    }
+}
+
+TimerId TimerWheel::create(timerAction action) {
+    if (num_timers >= TIMER_POOL_SIZE) {
+        return NO_TIMER;
+    }
+    TimerId id = num_timers++;
+    timers[id] = {action, NO_TIMER, NO_TIMER, NO_SLOT, 0};
+    return id;
+}
+
+void TimerWheel::schedule(TimerId id, uint16_t delay) {
+    if (id >= num_timers) {
+        return;
+    }
+    unlink(id);
+    if (delay == 0) {
+        delay = 1;
+    } else if (delay > MAX_DELAY) {
+        delay = MAX_DELAY;
+    }
+    // count from the ISR's tick, not the one the wheel has got up to
+    uint8_t behind = static_cast<uint8_t>(ticks - static_cast<uint8_t>(now));
+    if (delay > MAX_DELAY - behind) {
+        delay = MAX_DELAY - behind;
+    }
+    place(id, now + behind + delay);
+}
+
+void TimerWheel::cancel(TimerId id) {
+    if (id < num_timers) {
+        unlink(id);
+    }
+}
+
+bool TimerWheel::isScheduled(TimerId id) const {
+    return id < num_timers && timers[id].slot != NO_SLOT;
+}
+
+void TimerWheel::run() {
+    while (static_cast<uint8_t>(now) != ticks) {
+        step();
+    }
+}
+
+/*
+ * Moves on one tick: the blocks which start at the new tick are moved down a
+ * level (the biggest first, since it can add to the smaller ones), and then
+ * everything in the new tick's slot has expired.
+ */
+void TimerWheel::step() {
+    ++now;
+    for (uint8_t level = TIMER_WHEEL_LEVELS; --level > 0; ) {
+        if ((now & ((1u << (TIMER_WHEEL_SLOT_BITS * level)) - 1u)) == 0) {
+            cascade(level);
+        }
+    }
+
+    uint8_t& head = heads[now % SLOTS];
+    while (head != NO_TIMER) {
+        uint8_t index = head;
+        unlink(index);
+        // (this may schedule it again, but not for this tick)
+        timers[index].action();
+    }
+}
+
+// moves everything in the level's current slot down to the levels below
+void TimerWheel::cascade(uint8_t level) {
+    uint8_t slot = static_cast<uint8_t>(level * SLOTS + (now >> (TIMER_WHEEL_SLOT_BITS * level)) % SLOTS);
+    while (heads[slot] != NO_TIMER) {
+        uint8_t index = heads[slot];
+        unlink(index);
+        // the block starts now, so its deadline is just the rest of the way
+        place(index, now + timers[index].rest);
+    }
+}
+
+/*
+ * Puts the timer into the slot for the smallest block that its deadline and
+ * now are both in. The deadline must be from now to MAX_DELAY ticks after.
+ * If it's the next block of that size, it can't share a slot with now's,
+ * so it goes in the same level; otherwise the levels are ordered so that the
+ * right slot comes round before the deadline does.
+ */
+void TimerWheel::place(uint8_t index, uint16_t deadline) {
+    uint8_t level = 0;
+    uint8_t shift = 0;
+    while (level + 1u < TIMER_WHEEL_LEVELS
+            && (deadline >> (shift + TIMER_WHEEL_SLOT_BITS)) != (now >> (shift + TIMER_WHEEL_SLOT_BITS))) {
+        ++level;
+        shift += TIMER_WHEEL_SLOT_BITS;
+    }
+    Timer& t = timers[index];
+    t.slot = static_cast<uint8_t>(level * SLOTS + (deadline >> shift) % SLOTS);
+    t.rest = static_cast<uint8_t>(deadline & ((1u << shift) - 1u));
+    t.prev = NO_TIMER;
+    t.next = heads[t.slot];
+    if (t.next != NO_TIMER) {
+        timers[t.next].prev = index;
+    }
+    heads[t.slot] = index;
+}
+
+void TimerWheel::unlink(uint8_t index) {
+    Timer& t = timers[index];
+    if (t.slot == NO_SLOT) {
+        return;
+    }
+    if (t.prev != NO_TIMER) {
+        timers[t.prev].next = t.next;
+    } else {
+        heads[t.slot] = t.next;
+    }
+    if (t.next != NO_TIMER) {
+        timers[t.next].prev = t.prev;
+    }
+    t.slot = NO_SLOT;
+}
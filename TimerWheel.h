@@ -0,0 +1,108 @@
+//
+// Software timers, counted in Timer0 overflows
+//
+
+#ifndef METRONOME_TIMERWHEEL_H
+#define METRONOME_TIMERWHEEL_H
+
+#include <stdint.h>
+
+/*
+ * How many timers can exist at once. They're all allocated up front
+ * (see TimerWheel::create()), and each one takes 6 bytes of RAM.
+ */
+#define TIMER_POOL_SIZE 8
+
+/*
+ * The wheel has three levels of 16 slots each: the first level has a slot for
+ * each of the next 16 ticks, the second for each of the next 16 blocks of 16
+ * ticks, and the third for blocks of 256 ticks. A timer goes in the slot for
+ * the block which its deadline is in, and is moved down a level when that
+ * block comes round, so every tick does a constant amount of work, plus one
+ * step for each timer which expires or moves down. Moving down only needs the
+ * part of the deadline within the block, so it's kept in one byte per timer.
+ */
+#define TIMER_WHEEL_SLOT_BITS 4
+#define TIMER_WHEEL_LEVELS 3
+
+// the length of a tick (one Timer0 overflow, see millis.cpp)
+static constexpr uint16_t US_PER_TIMER_TICK = 64u * 256u / (F_CPU / 1000000u);
+
+// The number of ticks which is at least the given number of milliseconds
+constexpr uint16_t timerTicks(uint16_t ms) {
+    return static_cast<uint16_t>((static_cast<uint32_t>(ms) * 1000u + US_PER_TIMER_TICK - 1u) / US_PER_TIMER_TICK);
+}
+
+typedef uint8_t TimerId;
+
+class TimerWheel {
+public:
+    typedef void (*timerAction)();
+
+    static constexpr TimerId NO_TIMER = 0xFF;
+    static constexpr uint8_t SLOTS = 1u << TIMER_WHEEL_SLOT_BITS;
+    // the longest delay: one full turn of the top level, about 8.4 s
+    static constexpr uint16_t MAX_DELAY = (1u << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1u;
+
+    TimerWheel() noexcept;
+
+    /*
+     * Takes a timer from the pool, which calls the given action when it
+     * expires. Returns NO_TIMER if they've all been taken. This is meant to be
+     * done once per timer during setup; timers can't be given back.
+     */
+    TimerId create(timerAction action);
+
+    /*
+     * Starts (or restarts) the timer, so that it expires after the given number
+     * of ticks (see timerTicks()). Since the current tick has already started,
+     * it actually expires between delay - 1 and delay ticks from now. The delay
+     * is limited to 1 to MAX_DELAY ticks.
+     */
+    void schedule(TimerId id, uint16_t delay);
+    // stops the timer, if it's running, without calling its action
+    void cancel(TimerId id);
+    bool isScheduled(TimerId id) const;
+
+    // needs to be called from the Timer0 overflow ISR
+    void tick() {
+        ticks = static_cast<uint8_t>(ticks + 1u);
+    }
+
+    /*
+     * Moves the wheel on to the current tick, calling the actions of any timers
+     * which have expired. Should be called from the main loop, at least every
+     * 255 ticks (about half a second), or some ticks are missed. This and the
+     * functions above aren't safe to call from ISRs.
+     */
+    void run();
+
+private:
+    // the timers' lists are linked by index into the pool
+    struct Timer {
+        timerAction action;
+        uint8_t next;
+        uint8_t prev;
+        // which list the timer is in (level * SLOTS + slot), or NO_SLOT
+        uint8_t slot;
+        // the part of the deadline within the slot's block of ticks
+        uint8_t rest;
+    };
+    static constexpr uint8_t NO_SLOT = 0xFF;
+
+    // how many times tick() has been called, mod 256; only written by the ISR
+    volatile uint8_t ticks;
+    // the tick the wheel has got up to; its low byte catches up with ticks
+    uint16_t now;
+    uint8_t num_timers;
+    Timer timers[TIMER_POOL_SIZE];
+    // the first timer in each slot
+    uint8_t heads[TIMER_WHEEL_LEVELS * SLOTS];
+
+    void step();
+    void place(uint8_t index, uint16_t deadline);
+    void unlink(uint8_t index);
+    void cascade(uint8_t level);
+};
+
+#endif //METRONOME_TIMERWHEEL_H
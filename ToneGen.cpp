@@ -29,12 +29,21 @@ void ToneGen::setup() {
     
 }
 
+/*
+ * Starts the tone straight away: rather than waiting for the first compare
+ * match, which would be half a period later (so later for lower tones, and
+ * later again by however far through its count the prescaler happens to be),
+ * OC2A is toggled on the spot by forcing a compare match, and the counter and
+ * prescaler are restarted, so that the rest of the wave follows on exactly.
+ */
 void ToneGen::start(ToneGen::Config c) {
     auto new_tccr2b = byteOr(TCCR2B & 0xf8u, c.prescalar_bits);
     auto oldSREG = SREG;
     cli();
     OCR2A = c.count_value;
-    TCCR2B = new_tccr2b;
+    TCNT2 = 0;
+    bitSet(GTCCR, PSRASY);
+    TCCR2B = byteOr(new_tccr2b, _BV(FOC2A));
     SREG = oldSREG;
 }
 
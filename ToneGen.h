@@ -8,11 +8,12 @@
  */
 
 class ToneGen {
+public:
     struct Config {
         uint8_t prescalar_bits;
         uint8_t count_value;
     };
-public:
+
     void setup();
     void start(Config c);
     void stop();
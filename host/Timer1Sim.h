@@ -0,0 +1,87 @@
+/*
+ * Minimal simulation of Timer1 running in CTC mode, for the host build.
+ * Time is measured in Timer1 counts since the simulation started. Instead of
+ * stepping count by count, the simulation jumps straight to the next compare
+ * match and calls the given ISR there, with TCNT1 reset to zero as it would be
+ * by the hardware. ISR latency is taken to be zero.
+ * Compare match B is simulated too, while its interrupt is enabled and OCR1B
+ * is within the timer period. (If both match at once, B's ISR is called first,
+ * though on the chip A would win.)
+ */
+
+#ifndef METRONOME_TIMER1SIM_H
+#define METRONOME_TIMER1SIM_H
+
+#include <avr/io.h>
+#include <stdint.h>
+
+class Timer1Sim {
+public:
+    Timer1Sim() noexcept : now(0), last_match(0), matches(0) {
+        TCNT1 = 0;
+    }
+
+    // Timer1 counts since the start of the simulation
+    uint64_t time() const { return now; }
+    // number of compare matches (i.e. interrupts) so far
+    uint64_t interrupts() const { return matches; }
+
+    /* Runs the timer until the given time, calling isr() on every compare
+     * match A and isrB() on every compare match B
+     */
+    template <typename ISR, typename ISRB>
+    void runUntil(uint64_t end, ISR isr, ISRB isrB) {
+        // in case TCNT1 was written to since last time
+        last_match = now - TCNT1;
+        for (;;) {
+            uint64_t next_match = last_match + OCR1A + 1u;
+            if (next_match <= now) {
+                // OCR1A was moved below TCNT1, so the timer has to wrap first
+                next_match += 65536u;
+            }
+            if ((TIMSK1 & _BV(OCIE1B)) && OCR1B <= OCR1A) {
+                uint64_t match_b = last_match + OCR1B + 1u;
+                if (match_b > now && match_b <= next_match && match_b <= end) {
+                    now = match_b;
+                    TCNT1 = static_cast<uint16_t>(now - last_match);
+                    isrB();
+                    // (which may have changed OCR1A or TCNT1)
+                    last_match = now - TCNT1;
+                    continue;
+                }
+            }
+            if (next_match > end) {
+                break;
+            }
+            now = next_match;
+            last_match = now;
+            TCNT1 = 0;
+            matches++;
+            isr();
+        }
+        now = end;
+        TCNT1 = static_cast<uint16_t>(now - last_match);
+    }
+
+    template <typename ISR>
+    void runUntil(uint64_t end, ISR isr) {
+        runUntil(end, isr, []() { });
+    }
+
+    template <typename ISR, typename ISRB>
+    void runFor(uint64_t counts, ISR isr, ISRB isrB) {
+        runUntil(now + counts, isr, isrB);
+    }
+
+    template <typename ISR>
+    void runFor(uint64_t counts, ISR isr) {
+        runUntil(now + counts, isr);
+    }
+
+private:
+    uint64_t now;
+    uint64_t last_match;
+    uint64_t matches;
+};
+
+#endif //METRONOME_TIMER1SIM_H
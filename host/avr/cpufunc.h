@@ -0,0 +1,11 @@
+/*
+ * Host stand-in for avr-libc's <avr/cpufunc.h>
+ */
+
+#ifndef HOST_AVR_CPUFUNC_H
+#define HOST_AVR_CPUFUNC_H
+
+#define _NOP() do { } while (0)
+#define _MemoryBarrier() __asm__ __volatile__("" ::: "memory")
+
+#endif // HOST_AVR_CPUFUNC_H
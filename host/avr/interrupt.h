@@ -0,0 +1,19 @@
+/*
+ * Host stand-in for avr-libc's <avr/interrupt.h>.
+ * The global interrupt flag is just the I bit of the mock SREG, so code that
+ * saves SREG, calls cli() and restores SREG behaves exactly as on the AVR.
+ */
+
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define sei() (SREG = (uint8_t)(SREG | _BV(SREG_I)))
+#define cli() (SREG = (uint8_t)(SREG & ~_BV(SREG_I)))
+
+// ISRs become ordinary functions which the host harness can call directly
+#define ISR(vector, ...) extern "C" void vector(void)
+#define ISR_NOBLOCK
+
+#endif // HOST_AVR_INTERRUPT_H
@@ -0,0 +1,336 @@
+/*
+ * Host stand-in for avr-libc's <avr/io.h>, for building the firmware sources
+ * natively (see host/mock_registers.cpp).
+ *
+ * Every register used by the firmware is defined here in exactly the same way
+ * as avr-libc does it for the ATmega328P, i.e. as an lvalue expression at the
+ * register's data memory address. The only difference is that the 'data
+ * memory' is a plain array in the host process instead of the AVR's I/O space.
+ * This means the firmware sources compile unchanged against either header,
+ * so register access costs nothing extra on the real hardware.
+ *
+ * The exception is the interrupt flag registers, which are cleared by writing
+ * ones to them, so they're wrapped in HostFlagRegister to behave the same way.
+ *
+ * Only the registers and bits actually used are defined; add more as needed,
+ * using the addresses from the datasheet (or avr-libc's iom328p.h).
+ */
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+// the ATmega328P I/O and extended I/O space occupies data addresses 0x20-0xFF
+extern volatile uint8_t host_sfr_file[0x100];
+
+#define _SFR_MEM8(mem_addr) (host_sfr_file[mem_addr])
+#define _SFR_MEM16(mem_addr) (*(volatile uint16_t *)(&host_sfr_file[mem_addr]))
+#define _SFR_IO8(io_addr) _SFR_MEM8((io_addr) + 0x20)
+
+/*
+ * An interrupt flag register: writing a one to a flag clears it, and writing a
+ * zero leaves it alone. (Only the hardware sets flags, and Timer1Sim calls the
+ * ISRs as soon as they would be set, so nothing here does.) Through a pointer
+ * (e.g. bitRead()) it can only be read, so a read-modify-write like bitSet(),
+ * which would clear every flag that's set on the chip, doesn't compile.
+ */
+class HostFlagRegister {
+public:
+    explicit constexpr HostFlagRegister(uint8_t mem_addr) noexcept : mem_addr(mem_addr) { }
+
+    const HostFlagRegister& operator=(unsigned int flags) const {
+        host_sfr_file[mem_addr] = static_cast<uint8_t>(host_sfr_file[mem_addr] & ~flags);
+        return *this;
+    }
+
+    operator uint8_t() const {
+        return host_sfr_file[mem_addr];
+    }
+
+    const volatile uint8_t* operator&() const {
+        return &host_sfr_file[mem_addr];
+    }
+
+private:
+    const uint8_t mem_addr;
+};
+
+#define _SFR_FLAG8(io_addr) (HostFlagRegister((io_addr) + 0x20))
+
+#define _BV(bit) (1u << (bit))
+
+/* Ports */
+#define PINB _SFR_IO8(0x03)
+#define DDRB _SFR_IO8(0x04)
+#define PORTB _SFR_IO8(0x05)
+#define PINC _SFR_IO8(0x06)
+#define DDRC _SFR_IO8(0x07)
+#define PORTC _SFR_IO8(0x08)
+#define PIND _SFR_IO8(0x09)
+#define DDRD _SFR_IO8(0x0A)
+#define PORTD _SFR_IO8(0x0B)
+
+#define PINB0 0
+#define PINB1 1
+#define PINB2 2
+#define PINB3 3
+#define PINB4 4
+#define PINB5 5
+#define PORTB0 0
+#define PORTB1 1
+#define PORTB2 2
+#define PORTB3 3
+#define PORTB4 4
+#define PORTB5 5
+#define PINC0 0
+#define PINC1 1
+#define PINC2 2
+#define PINC3 3
+#define PINC4 4
+#define PINC5 5
+#define PORTC0 0
+#define PORTC1 1
+#define PORTC2 2
+#define PORTC3 3
+#define PORTC4 4
+#define PORTC5 5
+#define PIND0 0
+#define PIND1 1
+#define PORTD0 0
+#define PORTD1 1
+
+/* Interrupt flag registers */
+#define TIFR0 _SFR_FLAG8(0x15)
+#define TOV0 0
+#define OCF0A 1
+#define OCF0B 2
+
+#define TIFR1 _SFR_FLAG8(0x16)
+#define TOV1 0
+#define OCF1A 1
+#define OCF1B 2
+#define ICF1 5
+
+#define TIFR2 _SFR_FLAG8(0x17)
+#define TOV2 0
+#define OCF2A 1
+#define OCF2B 2
+
+#define PCIFR _SFR_FLAG8(0x1B)
+#define PCIF0 0
+#define PCIF1 1
+#define PCIF2 2
+
+#define GTCCR _SFR_IO8(0x23)
+#define PSRSYNC 0
+#define PSRASY 1
+#define TSM 7
+
+/* Timer 0 */
+#define TCCR0A _SFR_IO8(0x24)
+#define WGM00 0
+#define WGM01 1
+#define COM0B0 4
+#define COM0B1 5
+#define COM0A0 6
+#define COM0A1 7
+
+#define TCCR0B _SFR_IO8(0x25)
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define WGM02 3
+#define FOC0B 6
+#define FOC0A 7
+
+#define TCNT0 _SFR_IO8(0x26)
+#define OCR0A _SFR_IO8(0x27)
+#define OCR0B _SFR_IO8(0x28)
+
+#define SMCR _SFR_IO8(0x33)
+#define SE 0
+#define SM0 1
+#define SM1 2
+#define SM2 3
+
+#define SREG _SFR_IO8(0x3F)
+#define SREG_I 7
+
+#define PRR _SFR_MEM8(0x64)
+#define PRADC 0
+#define PRUSART0 1
+#define PRSPI 2
+#define PRTIM1 3
+#define PRTIM0 5
+#define PRTIM2 6
+#define PRTWI 7
+
+#define PCICR _SFR_MEM8(0x68)
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+
+#define PCMSK1 _SFR_MEM8(0x6C)
+#define PCINT8 0
+#define PCINT9 1
+#define PCINT10 2
+#define PCINT11 3
+#define PCINT12 4
+#define PCINT13 5
+#define PCINT14 6
+
+#define TIMSK0 _SFR_MEM8(0x6E)
+#define TOIE0 0
+#define OCIE0A 1
+#define OCIE0B 2
+
+#define TIMSK1 _SFR_MEM8(0x6F)
+#define TOIE1 0
+#define OCIE1A 1
+#define OCIE1B 2
+#define ICIE1 5
+
+#define TIMSK2 _SFR_MEM8(0x70)
+#define TOIE2 0
+#define OCIE2A 1
+#define OCIE2B 2
+
+/* ADC */
+#define ADC _SFR_MEM16(0x78)
+#define ADCL _SFR_MEM8(0x78)
+#define ADCH _SFR_MEM8(0x79)
+
+#define ADCSRA _SFR_MEM8(0x7A)
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+
+#define ADCSRB _SFR_MEM8(0x7B)
+#define ADTS0 0
+#define ADTS1 1
+#define ADTS2 2
+#define ACME 6
+
+#define ADMUX _SFR_MEM8(0x7C)
+#define MUX0 0
+#define MUX1 1
+#define MUX2 2
+#define MUX3 3
+#define ADLAR 5
+#define REFS0 6
+#define REFS1 7
+
+#define DIDR0 _SFR_MEM8(0x7E)
+#define ADC0D 0
+#define ADC1D 1
+#define ADC2D 2
+#define ADC3D 3
+#define ADC4D 4
+#define ADC5D 5
+
+/* Timer 1 */
+#define TCCR1A _SFR_MEM8(0x80)
+#define WGM10 0
+#define WGM11 1
+#define COM1B0 4
+#define COM1B1 5
+#define COM1A0 6
+#define COM1A1 7
+
+#define TCCR1B _SFR_MEM8(0x81)
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+#define ICES1 6
+#define ICNC1 7
+
+#define TCCR1C _SFR_MEM8(0x82)
+#define FOC1B 6
+#define FOC1A 7
+
+#define TCNT1 _SFR_MEM16(0x84)
+#define ICR1 _SFR_MEM16(0x86)
+#define OCR1A _SFR_MEM16(0x88)
+#define OCR1B _SFR_MEM16(0x8A)
+
+/* Timer 2 */
+#define TCCR2A _SFR_MEM8(0xB0)
+#define WGM20 0
+#define WGM21 1
+#define COM2B0 4
+#define COM2B1 5
+#define COM2A0 6
+#define COM2A1 7
+
+#define TCCR2B _SFR_MEM8(0xB1)
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define WGM22 3
+#define FOC2B 6
+#define FOC2A 7
+
+#define TCNT2 _SFR_MEM8(0xB2)
+#define OCR2A _SFR_MEM8(0xB3)
+#define OCR2B _SFR_MEM8(0xB4)
+
+/* USART0 */
+#define UCSR0A _SFR_MEM8(0xC0)
+#define MPCM0 0
+#define U2X0 1
+#define UPE0 2
+#define DOR0 3
+#define FE0 4
+#define UDRE0 5
+#define TXC0 6
+#define RXC0 7
+
+#define UCSR0B _SFR_MEM8(0xC1)
+#define TXB80 0
+#define RXB80 1
+#define UCSZ02 2
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define TXCIE0 6
+#define RXCIE0 7
+
+#define UCSR0C _SFR_MEM8(0xC2)
+#define UCSZ00 1
+#define UCSZ01 2
+
+#define UBRR0 _SFR_MEM16(0xC4)
+#define UDR0 _SFR_MEM8(0xC6)
+
+/*
+ * Interrupt vectors. As with avr-libc, ISR(X_vect) defines a function named
+ * after the vector number; on the host these are plain extern "C" functions
+ * which a test harness can call to simulate the interrupt firing.
+ */
+#define PCINT0_vect __vector_3
+#define PCINT1_vect __vector_4
+#define PCINT2_vect __vector_5
+#define TIMER2_COMPA_vect __vector_7
+#define TIMER2_COMPB_vect __vector_8
+#define TIMER2_OVF_vect __vector_9
+#define TIMER1_CAPT_vect __vector_10
+#define TIMER1_COMPA_vect __vector_11
+#define TIMER1_COMPB_vect __vector_12
+#define TIMER1_OVF_vect __vector_13
+#define TIMER0_COMPA_vect __vector_14
+#define TIMER0_COMPB_vect __vector_15
+#define TIMER0_OVF_vect __vector_16
+#define USART_RX_vect __vector_18
+#define USART_UDRE_vect __vector_19
+#define USART_TX_vect __vector_20
+#define ADC_vect __vector_21
+
+#endif // HOST_AVR_IO_H
@@ -0,0 +1,22 @@
+/*
+ * Host stand-in for avr-libc's <avr/pgmspace.h>.
+ * There is only one address space on the host, so flash data is just const
+ * data and reading it is an ordinary memory access.
+ */
+
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+
+#define memcpy_P(dest, src, n) memcpy((dest), (src), (n))
+
+#endif // HOST_AVR_PGMSPACE_H
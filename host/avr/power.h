@@ -0,0 +1,11 @@
+/*
+ * Host stand-in for avr-libc's <avr/power.h>.
+ * The firmware manipulates PRR directly, so nothing else is needed here.
+ */
+
+#ifndef HOST_AVR_POWER_H
+#define HOST_AVR_POWER_H
+
+#include <avr/io.h>
+
+#endif // HOST_AVR_POWER_H
@@ -0,0 +1,16 @@
+/*
+ * Host stand-in for avr-libc's <avr/sleep.h>.
+ * There's nothing to sleep until, so sleeping just sets and clears SE.
+ */
+
+#ifndef HOST_AVR_SLEEP_H
+#define HOST_AVR_SLEEP_H
+
+#include <avr/io.h>
+
+#define sleep_enable() (SMCR = (uint8_t)(SMCR | _BV(SE)))
+#define sleep_disable() (SMCR = (uint8_t)(SMCR & ~_BV(SE)))
+#define sleep_cpu() do { } while (0)
+#define sleep_mode() do { sleep_enable(); sleep_cpu(); sleep_disable(); } while (0)
+
+#endif // HOST_AVR_SLEEP_H
@@ -0,0 +1,1291 @@
+/*
+ * Host micro-benchmarks for the metronome's hot paths.
+ * Built against the mock register file (see host/avr/io.h), so the numbers
+ * are only meaningful relative to each other, e.g. for catching regressions
+ * between commits on the same build machine.
+ * The simulations are checked against the accuracy they're meant to have,
+ * and the bench exits non-zero if any of them is out.
+ */
+
+#include "Metronome.h"
+#include "SevenSeg.h"
+#include "Buttons.h"
+#include "pindefs.h"
+#include "Timer1Sim.h"
+#include "TimerWheel.h"
+#include "TapTempo.h"
+#include "OnsetDetector.h"
+#include "TempoFollower.h"
+#include "ClockPll.h"
+#include "Midi.h"
+#include "Sync.h"
+#include "setlist.h"
+#include "millis.h"
+
+#include <chrono>
+#include <utility>
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+static volatile uint32_t sink;
+
+static std::vector<uint64_t> beat_times;
+static std::vector<uint64_t> tick_times;
+
+// how many of the checks below have failed
+static unsigned failures;
+
+/*
+ * Checks one of the numbers a simulation reports against the most it should
+ * be, and says so if it's over, so that the bench exits non-zero. (The
+ * timings from bench() depend on the machine, so they aren't checked.)
+ */
+static void expectAtMost(const char * what, double value, double limit) {
+    if (!(value <= limit)) {
+        printf("  FAILED: %s is %.2f, should be at most %.2f\n", what, value, limit);
+        failures++;
+    }
+}
+
+static void countBeat(uint8_t beat_num, uint8_t beats_per_measure) {
+    sink += beat_num + beats_per_measure;
+}
+
+static void countTick(uint8_t tick_num, uint8_t ticks_per_beat) {
+    sink += tick_num + ticks_per_beat;
+}
+
+// largest difference between the given event times and a perfectly even grid
+static double maxError(const std::vector<uint64_t>& times, double period) {
+    double max_error = 0;
+    for (size_t n = 0; n < times.size(); ++n) {
+        auto error = fabs(times[n] - times[0] - n * period);
+        max_error = error > max_error ? error : max_error;
+    }
+    return max_error;
+}
+
+template <typename F>
+static void bench(const char * name, uint32_t iterations, F f) {
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    for (uint32_t i = 0; i < iterations; ++i) {
+        f(i);
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(clock::now() - start);
+    printf("%-28s %10u iterations %8.2f ns/iteration\n", name, iterations, elapsed.count() / iterations);
+}
+
+/*
+ * Runs the metronome on a simulated Timer1 for the given number of beats, and
+ * reports how many interrupts it took, and how far the beats and ticks strayed
+ * from where they should have been, in timer counts.
+ */
+static void simulate(Metronome& m, uint16_t tempo, uint8_t divisor, uint32_t beats) {
+    m.setTempo(tempo);
+    m.setBeatDivision(divisor);
+    m.start();
+
+    Timer1Sim timer;
+    beat_times.clear();
+    tick_times.clear();
+
+    const double beat_period = static_cast<double>(BEAT_PERIOD_FOR_1_BPM) * TEMPO_SCALE / tempo;
+    timer.runFor(static_cast<uint64_t>(beat_period * beats), [&m, &timer]() {
+        auto e = m.tock();
+        if (e.flags & BeatEvent::BEAT) {
+            beat_times.push_back(timer.time());
+        }
+        if (e.flags & BeatEvent::SUBBEAT) {
+            tick_times.push_back(timer.time());
+        }
+        m.dispatchEvents();
+    });
+
+    printf("%6.2f BPM, %u ticks/beat: %5.2f interrupts/beat, max error %4.2f counts (beats), "
+           "%4.2f counts (ticks) over %zu beats\n",
+            static_cast<double>(tempo) / TEMPO_SCALE, divisor,
+            static_cast<double>(timer.interrupts()) / beat_times.size(), maxError(beat_times, beat_period),
+            maxError(tick_times, beat_period / divisor), beat_times.size());
+    // (the ticks are rounded to whole counts from the beat's rounded start)
+    expectAtMost("beat error", maxError(beat_times, beat_period), 0.5);
+    expectAtMost("tick error", maxError(tick_times, beat_period / divisor), 1.5);
+    m.stop();
+}
+
+static const Timer1Sim* click_timer;
+static uint16_t click_length;
+static uint8_t click_every;
+static uint32_t click_ticks;
+static bool clicking;
+static uint64_t click_start;
+static std::vector<uint64_t> click_lengths;
+
+static uint16_t startClick(BeatEvent) {
+    if (click_ticks++ % click_every != 0) {
+        return 0;
+    }
+    // if the last click hasn't ended yet, this one takes over from it
+    clicking = true;
+    click_start = click_timer->time();
+    return click_length;
+}
+
+static void endClick() {
+    if (clicking) {
+        click_lengths.push_back(click_timer->time() - click_start);
+    }
+    clicking = false;
+}
+
+/*
+ * Plays a click of the given length on every so many ticks, and reports the
+ * largest difference between how long the clicks lasted and how long they
+ * should have, in timer counts. If wobble is set, the tempo keeps changing
+ * back and forth by that much while the clicks are playing.
+ */
+static void simulateClicks(Metronome& m, uint16_t tempo, uint8_t divisor, uint32_t click_us, uint8_t every,
+        uint16_t wobble, uint32_t beats) {
+    m.setTempo(tempo);
+    m.setBeatDivision(divisor);
+    m.setClickListener(startClick);
+    m.setClickEndListener(endClick);
+
+    Timer1Sim timer;
+    click_timer = &timer;
+    click_length = clickLength(click_us);
+    click_every = every;
+    click_ticks = 0;
+    clicking = false;
+    click_lengths.clear();
+    m.start();
+
+    auto isr = [&m]() {
+        m.tock();
+        m.dispatchEvents();
+    };
+    auto isrB = [&m]() {
+        m.endClick();
+    };
+
+    const double beat_period = static_cast<double>(BEAT_PERIOD_FOR_1_BPM) * TEMPO_SCALE / tempo;
+    const uint64_t end = static_cast<uint64_t>(beat_period * beats);
+    // (an odd step, so the tempo changes land all over the clicks)
+    const uint64_t step = wobble != 0 ? click_length / 3u + 7u : end;
+    for (uint32_t n = 0; timer.time() < end; ++n) {
+        if (wobble != 0) {
+            m.setTempo(n & 1u ? tempo + wobble : tempo);
+        }
+        timer.runUntil(timer.time() + step < end ? timer.time() + step : end, isr, isrB);
+    }
+    // (stopping cuts the last click short)
+    clicking = false;
+    m.stop();
+
+    double max_error = 0;
+    for (uint64_t length : click_lengths) {
+        auto error = fabs(static_cast<double>(length) - click_length);
+        max_error = error > max_error ? error : max_error;
+    }
+    printf("%6.2f BPM, %2u ticks/beat, %6.1f ms clicks on every %2u ticks%s: max length error %4.2f counts "
+           "over %zu clicks\n",
+            static_cast<double>(tempo) / TEMPO_SCALE, divisor, click_us / 1000.0, every,
+            wobble != 0 ? " (changing tempo)" : "", max_error, click_lengths.size());
+    expectAtMost("click length error", max_error, 0);
+    m.setClickListener(NullListener::onClick);
+    m.setClickEndListener(NullListener::onClickEnd);
+}
+
+/*
+ * Taps the given tempo, with each tap up to jitter_us early or late, while the
+ * metronome plays at another, handling each tap a debounce delay after it, as
+ * the main loop would. Reports how far the tapped tempo was from the real one,
+ * and the largest difference between the ticks after the last tap and an even
+ * grid at the tapped tempo starting from the last tap, in timer counts, which
+ * should be no more than rounding.
+ */
+static void simulateTaps(Metronome& m, uint16_t from, uint16_t tempo, uint32_t jitter_us, uint8_t taps,
+        uint8_t divisor) {
+    m.setTempo(from);
+    m.setBeatDivision(divisor);
+    m.start();
+
+    Timer1Sim timer;
+    TapTempo tapper;
+    tick_times.clear();
+    auto isr = [&m, &timer]() {
+        auto e = m.tock();
+        if (e.flags & BeatEvent::SUBBEAT) {
+            tick_times.push_back(timer.time());
+        }
+        m.dispatchEvents();
+    };
+
+    uint32_t seed = 97531;
+    auto random = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return seed >> 8u;
+    };
+    constexpr uint32_t us_per_count = 1000000ul / TIMER1_COUNTS_PER_SECOND;
+    const double period_us = 60e6 * TEMPO_SCALE / tempo;
+    // (somewhere in the middle of a beat at the old tempo)
+    const double start_us = 1234567.0;
+    uint64_t last_tap = 0;
+    for (uint8_t n = 0; n < taps; ++n) {
+        double jitter = static_cast<double>(random() % (2u * jitter_us + 1u)) - jitter_us;
+        auto tap_us = static_cast<uint64_t>(start_us + n * period_us + jitter);
+        timer.runUntil(tap_us / us_per_count, isr);
+        // the event comes out of the debouncing a few ms later
+        timer.runFor(DEBOUNCE_TICKS * US_PER_TIMER_TICK / us_per_count, isr);
+        if (tapper.tap(static_cast<uint32_t>(tap_us))) {
+            uint64_t now_us = timer.time() * us_per_count;
+            m.syncTempo(tapper.tempo(), static_cast<uint32_t>((now_us - tapper.lastTap()) / us_per_count));
+            last_tap = tap_us / us_per_count;
+            tick_times.clear();
+        }
+    }
+    timer.runFor(static_cast<uint64_t>(8 * period_us / us_per_count), isr);
+    m.stop();
+
+    // the ticks carry on from the last tap, without any missed or doubled
+    const double tick_period = static_cast<double>(BEAT_PERIOD_FOR_1_BPM) * TEMPO_SCALE / tapper.tempo() / divisor;
+    double max_error = 0;
+    uint64_t first = static_cast<uint64_t>(ceil((timer.time() - 8 * period_us / us_per_count - last_tap) / tick_period));
+    for (size_t n = 0; n < tick_times.size(); ++n) {
+        auto error = fabs(tick_times[n] - last_tap - (first + n) * tick_period);
+        max_error = error > max_error ? error : max_error;
+    }
+    printf("tapped %6.2f BPM (+/- %2u ms) over %6.2f BPM, %u ticks/beat, %2u taps: got %6.2f BPM, "
+           "max tick error from the last tap %4.2f counts over %zu ticks\n",
+            static_cast<double>(tempo) / TEMPO_SCALE, jitter_us / 1000u, static_cast<double>(from) / TEMPO_SCALE,
+            divisor, taps, static_cast<double>(tapper.tempo()) / TEMPO_SCALE, max_error, tick_times.size());
+    expectAtMost("tick error from the last tap", max_error, 2);
+}
+
+static const Timer1Sim* clock_timer;
+static std::vector<uint64_t> clock_times;
+static bool clock_started;
+static uint32_t clocks_before_start;
+
+static void recordClock() {
+    clocks_before_start += !clock_started;
+    clock_times.push_back(clock_timer->time());
+}
+
+static void recordStart() {
+    clock_started = true;
+}
+
+/*
+ * Plays with the MIDI clock on, and reports how far the clock pulses strayed
+ * from an even grid of MIDI_CLOCKS_PER_BEAT per beat, in timer counts, and
+ * how many interrupts it took per beat, which are more than for the ticks
+ * alone unless the ticks are on the clock's grid.
+ */
+static void simulateMidiClock(Metronome& m, uint16_t tempo, uint8_t divisor, uint32_t beats) {
+    m.setTempo(tempo);
+    m.setBeatDivision(divisor);
+    m.setClockOutput(true);
+    m.setClockListener(recordClock);
+    m.setStartListener(recordStart);
+
+    Timer1Sim timer;
+    clock_timer = &timer;
+    clock_times.clear();
+    beat_times.clear();
+    clock_started = false;
+    clocks_before_start = 0;
+    m.start();
+
+    const double beat_period = static_cast<double>(BEAT_PERIOD_FOR_1_BPM) * TEMPO_SCALE / tempo;
+    timer.runFor(static_cast<uint64_t>(beat_period * beats), [&m, &timer]() {
+        auto e = m.tock();
+        if (e.flags & BeatEvent::BEAT) {
+            beat_times.push_back(timer.time());
+        }
+        m.dispatchEvents();
+    });
+    m.stop();
+
+    printf("MIDI clock at %6.2f BPM, %2u ticks/beat: %5.2f interrupts/beat, %.2f clocks/beat, "
+           "max error %4.2f counts, first clock %lld counts from the first beat, %u before start\n",
+            static_cast<double>(tempo) / TEMPO_SCALE, divisor,
+            static_cast<double>(timer.interrupts()) / beat_times.size(),
+            static_cast<double>(clock_times.size()) / beat_times.size(),
+            maxError(clock_times, beat_period / MIDI_CLOCKS_PER_BEAT),
+            static_cast<long long>(clock_times[0]) - static_cast<long long>(beat_times[0]), clocks_before_start);
+    expectAtMost("MIDI clock error", maxError(clock_times, beat_period / MIDI_CLOCKS_PER_BEAT), 1);
+    expectAtMost("clocks per beat over 24",
+            fabs(static_cast<double>(clock_times.size()) / beat_times.size() - MIDI_CLOCKS_PER_BEAT), 0);
+    expectAtMost("first clock from the first beat",
+            fabs(static_cast<double>(clock_times[0]) - static_cast<double>(beat_times[0])), 0);
+    expectAtMost("clocks before start", clocks_before_start, 0);
+    m.setClockOutput(false);
+    m.setClockListener(NullListener::onClock);
+    m.setStartListener(NullListener::onStart);
+}
+
+/*
+ * Follows a MIDI clock at the given tempo, starting from another one, where
+ * each pulse is up to jitter_us early or late, and is handled by the main
+ * loop up to latency_us after it comes in. Reports the tempo it settles on,
+ * and how far the beats are from the sender's (the worst, and the RMS),
+ * once it's had lock_beats beats to lock on.
+ */
+static void simulateMidiFollow(Metronome& m, uint16_t from, uint16_t tempo, uint32_t jitter_us, uint32_t latency_us,
+        uint32_t beats, uint32_t lock_beats) {
+    m.setTempo(from);
+    m.setBeatDivision(1);
+    m.start();
+
+    Timer1Sim timer;
+    ClockPll pll(MIDI_CLOCKS_PER_BEAT, MIDI_PLL_PHASE_SHIFT, MIDI_PLL_PERIOD_SHIFT);
+    beat_times.clear();
+    auto isr = [&m, &timer]() {
+        auto e = m.tock();
+        if (e.flags & BeatEvent::BEAT) {
+            beat_times.push_back(timer.time());
+        }
+        m.dispatchEvents();
+    };
+
+    uint32_t seed = 24680;
+    auto random = [&seed](uint32_t range) {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 8u) % range;
+    };
+    constexpr uint32_t us_per_count = 1000000ul / TIMER1_COUNTS_PER_SECOND;
+    const double beat_us = 60e6 * TEMPO_SCALE / tempo;
+    const double pulse_us = beat_us / MIDI_CLOCKS_PER_BEAT;
+    // (somewhere in the middle of a beat at the old tempo)
+    const double start_us = 765432.0;
+    uint32_t first_locked = 0;
+    for (uint32_t n = 0; n < beats * MIDI_CLOCKS_PER_BEAT; ++n) {
+        double jitter = static_cast<double>(random(2u * jitter_us + 1u)) - jitter_us;
+        auto pulse = static_cast<uint64_t>(start_us + n * pulse_us + jitter);
+        timer.runUntil(pulse / us_per_count, isr);
+        // (micros() only counts in steps of a Timer1 count)
+        auto stamp = static_cast<uint32_t>(timer.time() * us_per_count);
+        timer.runFor((random(latency_us + 1u)) / us_per_count, isr);
+        if (pll.pulse(stamp)) {
+            uint64_t now_us = timer.time() * us_per_count;
+            m.syncTempo(pll.tempo(), static_cast<uint32_t>((now_us - pll.beatStart()) / us_per_count));
+        }
+        if (n == lock_beats * MIDI_CLOCKS_PER_BEAT) {
+            first_locked = static_cast<uint32_t>(beat_times.size());
+        }
+    }
+    m.stop();
+
+    // each beat against the nearest of the sender's
+    double max_error = 0;
+    double sum_squares = 0;
+    uint32_t count = 0;
+    for (size_t n = first_locked; n < beat_times.size(); ++n) {
+        double t = static_cast<double>(beat_times[n] * us_per_count) - start_us;
+        double error = t - round(t / beat_us) * beat_us;
+        max_error = fabs(error) > max_error ? fabs(error) : max_error;
+        sum_squares += error * error;
+        ++count;
+    }
+    printf("followed MIDI clock at %6.2f BPM (+/- %4u us, %4u us latency) from %6.2f BPM: %s at %6.2f BPM, "
+           "beat error max %4.0f us, RMS %4.0f us over %u beats\n",
+            static_cast<double>(tempo) / TEMPO_SCALE, jitter_us, latency_us, static_cast<double>(from) / TEMPO_SCALE,
+            pll.isLocked() ? "locked" : "not locked", static_cast<double>(pll.tempo()) / TEMPO_SCALE,
+            max_error, count ? sqrt(sum_squares / count) : 0.0, count);
+    // (micros() is in steps of a count, and each beat is aligned from one pulse)
+    expectAtMost("not locked", !pll.isLocked(), 0);
+    expectAtMost("beat error (us)", max_error, jitter_us + latency_us + 2 * us_per_count);
+    expectAtMost("tempo error (%)", fabs(static_cast<double>(pll.tempo()) - tempo) * 100 / tempo, 0.1);
+}
+
+/*
+ * Chains metronomes together with their sync pulses, as if they were wired
+ * up: the first plays at the given tempo, which changes to change_to half way
+ * through (unless that's 0), and each of the others starts off at from and
+ * follows the one before, handling each pulse up to latency_us late. The
+ * units are run one after another, each given the pulses that the one before
+ * made (the rising edges of OC1A, at the compare matches it was set for).
+ * Reports how far each unit's pulses are from the first one's, once it's had
+ * lock_beats beats to lock on, leaving out the settle_beats beats after the
+ * change of tempo, and the worst in those.
+ */
+static void simulateSyncChain(uint16_t tempo, uint16_t change_to, uint16_t from, uint8_t units, uint32_t latency_us,
+        uint32_t beats, uint32_t lock_beats, uint32_t settle_beats) {
+    constexpr uint32_t us_per_count = 1000000ul / TIMER1_COUNTS_PER_SECOND;
+    const double beat_period = static_cast<double>(BEAT_PERIOD_FOR_1_BPM) * TEMPO_SCALE / tempo;
+    uint32_t seed = 13579;
+    auto random = [&seed](uint32_t range) {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 8u) % range;
+    };
+
+    std::vector<uint64_t> leader;
+    std::vector<uint64_t> upstream;
+    uint64_t change_time = 0;
+    printf("sync chain at %6.2f BPM", static_cast<double>(tempo) / TEMPO_SCALE);
+    if (change_to != 0) {
+        printf(" (changing to %6.2f BPM)", static_cast<double>(change_to) / TEMPO_SCALE);
+    }
+    printf(", followers from %6.2f BPM, up to %4u us latency:\n", static_cast<double>(from) / TEMPO_SCALE, latency_us);
+
+    for (uint8_t unit = 0; unit < units; ++unit) {
+        static Metronome u;
+        u.setup();
+        u.setBeatDivision(4);
+        u.setSyncOutput(true);
+        Timer1Sim timer;
+        std::vector<uint64_t> edges;
+        // (the simulated timer doesn't stop with the metronome)
+        auto isr = [&timer, &edges]() {
+            if (!u.isRunning()) {
+                return;
+            }
+            if (TCCR1A & _BV(COM1A0)) {
+                edges.push_back(timer.time());
+            }
+            u.tock();
+            u.dispatchEvents();
+        };
+
+        if (unit == 0) {
+            u.setTempo(tempo);
+            u.start();
+            auto half = static_cast<uint64_t>(beat_period * beats / 2);
+            timer.runUntil(half, isr);
+            if (change_to != 0) {
+                u.setTempo(change_to);
+                change_time = half;
+            }
+            timer.runUntil(static_cast<uint64_t>(beat_period * beats), isr);
+            u.stop();
+            leader = edges;
+            upstream = edges;
+            continue;
+        }
+
+        // what main.cpp does with SYNC_ENABLED
+        u.setTempo(from);
+        ClockPll pll(SYNC_PULSES_PER_BEAT, SYNC_PLL_PHASE_SHIFT, SYNC_PLL_PERIOD_SHIFT);
+        uint64_t align_at = 0;
+        for (size_t n = 0; n < upstream.size(); ++n) {
+            if (align_at != 0 && align_at < upstream[n]) {
+                timer.runUntil(align_at, isr);
+                if (pll.isLocked()) {
+                    u.syncTempo(pll.tempo(), static_cast<uint32_t>(timer.time() - pll.beatStart() / us_per_count));
+                }
+                align_at = 0;
+            }
+            timer.runUntil(upstream[n], isr);
+            auto stamp = static_cast<uint32_t>(upstream[n] * us_per_count);
+            timer.runFor(random(latency_us + 1u) / us_per_count, isr);
+            bool align = pll.pulse(stamp);
+            if (!u.isRunning() && pll.tempo() != 0) {
+                u.setTempo(pll.tempo());
+                u.start();
+            }
+            if (align) {
+                align_at = timer.time() + 30000000ul * TEMPO_SCALE / pll.tempo() / us_per_count;
+            }
+        }
+        timer.runFor(static_cast<uint64_t>(beat_period), isr);
+        u.stop();
+
+        // each pulse against the nearest of the first unit's
+        double max_error = 0;
+        double max_settling = 0;
+        double sum = 0;
+        double sum_squares = 0;
+        uint32_t count = 0;
+        size_t j = 0;
+        const auto lock_time = static_cast<uint64_t>(lock_beats * beat_period);
+        const auto settle_time = static_cast<uint64_t>(settle_beats * beat_period);
+        for (uint64_t edge : edges) {
+            while (j + 1 < leader.size() && leader[j + 1] <= edge) {
+                ++j;
+            }
+            uint64_t nearest = j + 1 < leader.size() && leader[j + 1] - edge < edge - leader[j] ? leader[j + 1] : leader[j];
+            double error = (static_cast<double>(edge) - static_cast<double>(nearest)) * us_per_count;
+            /* (the first time, each unit starts on the second pulse from the one
+             * before, and carries on for a beat after it stops)
+             */
+            if (edge < edges[0] + lock_time || edge > leader.back() + beat_period / 2) {
+                continue;
+            }
+            if (change_time != 0 && edge >= change_time && edge < change_time + settle_time) {
+                max_settling = fabs(error) > max_settling ? fabs(error) : max_settling;
+                continue;
+            }
+            max_error = fabs(error) > max_error ? fabs(error) : max_error;
+            sum += error;
+            sum_squares += error * error;
+            ++count;
+        }
+        printf("  unit %u: %s at %6.2f BPM, pulse error from the first unit max %3.0f us, mean %4.0f us, "
+               "RMS %3.0f us over %u beats", unit, pll.isLocked() ? "locked" : "not locked",
+                static_cast<double>(u.getTempo()) / TEMPO_SCALE, max_error, count ? sum / count : 0.0,
+                count ? sqrt(sum_squares / count) : 0.0, count);
+        if (change_time != 0) {
+            printf(", max %5.0f us while settling", max_settling);
+        }
+        printf("\n");
+        expectAtMost("not locked", !pll.isLocked(), 0);
+        expectAtMost("pulse error (us)", max_error, 100);
+        upstream = edges;
+    }
+}
+
+/*
+ * Plays with the given swing, which is changed from straight part way through
+ * the first beat, and reports the largest difference between each tick and
+ * where it should be for the swing, from the second beat on, and how many
+ * ticks of the first beat were moved.
+ */
+static void simulateSwing(Metronome& m, uint16_t tempo, uint8_t divisor, uint16_t swing, uint32_t beats) {
+    m.setTempo(tempo);
+    m.setBeatDivision(divisor);
+    m.setSwing(SWING_STRAIGHT);
+    m.start();
+
+    Timer1Sim timer;
+    tick_times.clear();
+    auto isr = [&m, &timer]() {
+        if (m.tock().flags & BeatEvent::SUBBEAT) {
+            tick_times.push_back(timer.time());
+        }
+        m.dispatchEvents();
+    };
+
+    const double beat_period = static_cast<double>(BEAT_PERIOD_FOR_1_BPM) * TEMPO_SCALE / tempo;
+    const double tick_period = beat_period / divisor;
+    timer.runFor(static_cast<uint64_t>(tick_period * 1.5), isr);
+    m.setSwing(swing);
+    timer.runFor(static_cast<uint64_t>(beat_period * beats), isr);
+
+    unsigned moved = 0;
+    double max_error = 0;
+    for (size_t n = 0; n < tick_times.size(); ++n) {
+        double straight = tick_times[0] + n * tick_period;
+        double swung = straight + ((n & 1u) && !(divisor & 1u) ? 2 * tick_period * (swing - SWING_STRAIGHT) / (100.0 * SWING_SCALE) : 0);
+        if (n < divisor) {
+            moved += fabs(tick_times[n] - straight) > 1;
+        } else {
+            max_error = fabs(tick_times[n] - swung) > max_error ? fabs(tick_times[n] - swung) : max_error;
+        }
+    }
+
+    printf("%6.2f BPM, %2u ticks/beat, swing %4.1f%%: max error %5.2f counts over %zu ticks, "
+           "%u ticks moved in the first beat\n",
+            static_cast<double>(tempo) / TEMPO_SCALE, divisor, static_cast<double>(swing) / SWING_SCALE,
+            max_error, tick_times.size(), moved);
+    // (if the swing lands on the tock grid, the ticks are only rounded to whole counts)
+    const uint32_t pair_tocks = 2u * TOCKS_PER_BEAT / divisor;
+    const bool on_grid = (divisor & 1u) || pair_tocks * (swing - SWING_STRAIGHT) % (100u * SWING_SCALE) == 0;
+    expectAtMost("swing error", max_error, on_grid ? 1.5 : beat_period / TOCKS_PER_BEAT);
+    expectAtMost("ticks moved in the first beat", moved, 0);
+    m.setSwing(SWING_STRAIGHT);
+    m.stop();
+}
+
+static uint32_t layer_only_clicks;
+
+static uint16_t countLayerClick(BeatEvent e) {
+    layer_only_clicks += e.flags == BeatEvent::NONE;
+    return 0;
+}
+
+/*
+ * Plays the given layers on top of each other for the given number of beats,
+ * and reports how far each layer's ticks strayed from its own perfectly even
+ * grid, which shows whether the layers stay locked in phase with each other,
+ * and whether the ticks on the other layers alone (with nothing on the main
+ * one) got a click.
+ */
+static void simulateLayers(Metronome& m, uint16_t tempo, const uint8_t (&divisors)[MAX_LAYERS], uint32_t beats) {
+    m.setTempo(tempo);
+    for (uint8_t l = 0; l < MAX_LAYERS; ++l) {
+        m.setLayer(l, divisors[l], levelPattern(LEVEL_NORMAL));
+    }
+    m.setClickListener(countLayerClick);
+    layer_only_clicks = 0;
+    m.start();
+
+    Timer1Sim timer;
+    std::vector<uint64_t> layer_times[MAX_LAYERS];
+    uint32_t layer_only = 0;
+
+    const double beat_period = static_cast<double>(BEAT_PERIOD_FOR_1_BPM) * TEMPO_SCALE / tempo;
+    timer.runFor(static_cast<uint64_t>(beat_period * beats), [&m, &timer, &layer_times, &layer_only]() {
+        auto e = m.tock();
+        for (uint8_t l = 0; l < MAX_LAYERS; ++l) {
+            if (e.layers & (1u << l)) {
+                layer_times[l].push_back(timer.time());
+            }
+        }
+        layer_only += e.flags == BeatEvent::NONE && e.layers != 0;
+        m.dispatchEvents();
+    });
+
+    printf("%6.2f BPM, layers", static_cast<double>(tempo) / TEMPO_SCALE);
+    for (uint8_t l = 0; l < MAX_LAYERS; ++l) {
+        printf(" %2u", divisors[l]);
+    }
+    printf(": %5.2f interrupts/beat, max error", static_cast<double>(timer.interrupts()) / beats);
+    for (uint8_t l = 0; l < MAX_LAYERS; ++l) {
+        if (divisors[l] != 0) {
+            printf(" %4.2f", maxError(layer_times[l], beat_period / divisors[l]));
+        }
+    }
+    printf(" counts over %u beats, %u of %u ticks on the other layers alone clicked\n",
+            beats, layer_only_clicks, layer_only);
+    for (uint8_t l = 0; l < MAX_LAYERS; ++l) {
+        if (divisors[l] != 0) {
+            expectAtMost("layer tick error", maxError(layer_times[l], beat_period / divisors[l]), 1.5);
+        }
+    }
+    expectAtMost("ticks on the other layers alone without a click", layer_only - layer_only_clicks, 0);
+    m.setClickListener(NullListener::onClick);
+    m.stop();
+    for (uint8_t l = 1; l < MAX_LAYERS; ++l) {
+        m.setLayer(l, 0, 0);
+    }
+}
+
+/*
+ * Sweeps the BPM one at a time from one value to another, spending the given
+ * number of ms on each, like holding down the up or down button, and reports
+ * the worst error in the time between beats. The time a beat should take is
+ * however long it takes for the phase to go round once at the tempos in force
+ * during it, so a beat which the tempo changes part way through should be
+ * partly at the old tempo and partly at the new one.
+ */
+static void simulateSweep(Metronome& m, uint8_t from_bpm, uint8_t to_bpm, uint16_t step_ms, uint8_t divisor) {
+    struct Change {
+        uint64_t time;
+        double beat_period;
+    };
+    std::vector<Change> changes;
+
+    m.setBeatDivision(divisor);
+    m.setBpm(from_bpm);
+    m.start();
+
+    Timer1Sim timer;
+    beat_times.clear();
+    auto isr = [&m, &timer]() {
+        if (m.tock().flags & BeatEvent::BEAT) {
+            beat_times.push_back(timer.time());
+        }
+        m.dispatchEvents();
+    };
+
+    const uint64_t step = static_cast<uint64_t>(step_ms) * TIMER1_COUNTS_PER_SECOND / 1000u;
+    const int8_t direction = to_bpm > from_bpm ? 1 : -1;
+    for (uint8_t bpm = from_bpm; ; bpm += direction) {
+        if (bpm != from_bpm) {
+            m.setBpm(bpm);
+        }
+        changes.push_back({timer.time(), static_cast<double>(BEAT_PERIOD_FOR_1_BPM) / bpm});
+        timer.runFor(step, isr);
+        if (bpm == to_bpm) {
+            break;
+        }
+    }
+    // let the last beat finish
+    timer.runFor(static_cast<uint64_t>(changes.back().beat_period) + 1u, isr);
+
+    double max_error = 0;
+    for (size_t n = 0; n + 1 < beat_times.size(); ++n) {
+        // find when the phase will have gone round once since this beat
+        double phase_left = 1;
+        double t = beat_times[n];
+        size_t c = 0;
+        while (c + 1 < changes.size() && changes[c + 1].time <= t) {
+            ++c;
+        }
+        for (;; ++c) {
+            double period = changes[c].beat_period;
+            double end = c + 1 < changes.size() ? changes[c + 1].time : INFINITY;
+            if ((end - t) / period >= phase_left) {
+                t += phase_left * period;
+                break;
+            }
+            phase_left -= (end - t) / period;
+            t = end;
+        }
+        auto error = fabs(beat_times[n + 1] - t);
+        max_error = error > max_error ? error : max_error;
+    }
+
+    printf("%3u -> %3u BPM, %4u ms per BPM, %2u ticks/beat: worst inter-beat interval error "
+           "%5.2f counts (%6.1f us) over %zu beats\n",
+            from_bpm, to_bpm, step_ms, divisor, max_error, max_error * 1e6 / TIMER1_COUNTS_PER_SECOND,
+            beat_times.size());
+    expectAtMost("inter-beat interval error", max_error, 4);
+    m.stop();
+}
+
+/*
+ * Ramps the tempo linearly over the given number of beats, and reports the
+ * largest difference between each beat's length and the length it should have
+ * at the ramp's tempo for that beat, and at the exact (unrounded) tempo.
+ */
+static void simulateRamp(Metronome& m, uint16_t from, uint16_t to, uint16_t beats, uint8_t divisor) {
+    m.setBeatDivision(divisor);
+    m.setTempo(from);
+    m.start();
+
+    Timer1Sim timer;
+    beat_times.clear();
+    auto isr = [&m, &timer]() {
+        if (m.tock().flags & BeatEvent::BEAT) {
+            beat_times.push_back(timer.time());
+        }
+        m.dispatchEvents();
+    };
+
+    // start the ramp part way through the first beat
+    const double beat_period = static_cast<double>(BEAT_PERIOD_FOR_1_BPM) * TEMPO_SCALE / from;
+    timer.runFor(static_cast<uint64_t>(beat_period / 2), isr);
+    m.startRamp(to, beats);
+    // enough for the ramp and a few beats after it
+    const double end_period = static_cast<double>(BEAT_PERIOD_FOR_1_BPM) * TEMPO_SCALE / to;
+    timer.runFor(static_cast<uint64_t>((beat_period > end_period ? beat_period : end_period) * (beats + 4)), isr);
+
+    double max_error = 0;
+    double max_curve_error = 0;
+    const int32_t change = static_cast<int32_t>(to) - from;
+    for (size_t n = 1; n + 1 < beat_times.size(); ++n) {
+        // beat n is the nth step of the ramp
+        size_t step = n < beats ? n : beats;
+        // (rounded towards the start tempo, like the ramp)
+        int32_t whole_step = change * static_cast<int32_t>(step) / beats;
+        double rounded = BEAT_PERIOD_FOR_1_BPM * static_cast<double>(TEMPO_SCALE) / (from + whole_step);
+        double exact = BEAT_PERIOD_FOR_1_BPM * static_cast<double>(TEMPO_SCALE) /
+                (from + static_cast<double>(change) * step / beats);
+        double length = beat_times[n + 1] - beat_times[n];
+        max_error = fabs(length - rounded) > max_error ? fabs(length - rounded) : max_error;
+        max_curve_error = fabs(length - exact) > max_curve_error ? fabs(length - exact) : max_curve_error;
+    }
+
+    printf("ramp %6.2f -> %6.2f BPM over %3u beats, %2u ticks/beat: max error %4.2f counts "
+           "(ramp tempos), %5.2f counts (exact line) over %zu beats\n",
+            static_cast<double>(from) / TEMPO_SCALE, static_cast<double>(to) / TEMPO_SCALE, beats, divisor,
+            max_error, max_curve_error, beat_times.size());
+    // (the exact line isn't checked: the tempos are only to 0.01 BPM)
+    expectAtMost("beat error from the ramp tempo", max_error, 1);
+    expectAtMost("tempo off the end of the ramp", fabs(static_cast<double>(m.getTempo()) - to), 0);
+    m.stop();
+}
+
+/*
+ * Plays the given song of the firmware's setlist (see setlist.txt),
+ * starting part way through a bar, and checks that each section starts exactly
+ * at the start of a bar, with the right meter, beat levels and ticks from its
+ * first beat, and reports the largest difference between each beat's length
+ * and the length it should have at its section's tempo.
+ */
+static void simulateSong(Metronome& m, uint8_t song) {
+    struct Beat {
+        uint64_t time;
+        uint8_t flags;
+        AccentLevel level;
+        uint8_t ticks;
+    };
+    std::vector<Beat> beats;
+
+    m.setBeatDivision(1);
+    m.setMeasureLength(4);
+    m.setTempo(9000);
+    m.start();
+
+    Timer1Sim timer;
+    auto isr = [&m, &timer, &beats]() {
+        auto e = m.tock();
+        if (e.flags & BeatEvent::BEAT) {
+            beats.push_back(Beat{timer.time(), e.flags, e.beat_level, 0});
+        }
+        if ((e.flags & BeatEvent::SUBBEAT) && !beats.empty()) {
+            beats.back().ticks++;
+        }
+        m.dispatchEvents();
+    };
+
+    const double beat_period = static_cast<double>(BEAT_PERIOD_FOR_1_BPM) * TEMPO_SCALE / 9000;
+    timer.runFor(static_cast<uint64_t>(beat_period * 5 / 2), isr);
+    const uint8_t* song_P = setlist_song_P(setlist, song);
+    m.playSong(song_P);
+    // (the first section starts at the next bar)
+    const size_t first = beats.size() + 1;
+
+    // work out what every beat of the song should be
+    struct Expected {
+        SongSection section;
+        uint8_t beat_num;
+    };
+    std::vector<Expected> expected;
+    uint8_t num_sections = pgm_read_byte(song_P);
+    uint64_t song_length = 0;
+    for (uint8_t n = 0; n < num_sections; ++n) {
+        auto s = SongSection::read_P(song_P + 1 + n * SONG_SECTION_SIZE);
+        uint16_t bar_length = s.beats_per_measure > 0 ? s.beats_per_measure : 1;
+        for (uint16_t b = 0; b < s.bars * bar_length; ++b) {
+            expected.push_back(Expected{s, static_cast<uint8_t>(b % bar_length)});
+        }
+        song_length += static_cast<uint64_t>(s.bars) * bar_length * BEAT_PERIOD_FOR_1_BPM * TEMPO_SCALE / s.tempo;
+    }
+    timer.runFor(static_cast<uint64_t>(beat_period * 4) + song_length, isr);
+
+    double max_error = 0;
+    unsigned wrong_beats = 0;
+    size_t n = 0;
+    for (; n < expected.size() && first + n + 1 < beats.size(); ++n) {
+        const SongSection& s = expected[n].section;
+        const uint8_t beat_num = expected[n].beat_num;
+        const Beat& b = beats[first + n];
+        double period = static_cast<double>(BEAT_PERIOD_FOR_1_BPM) * TEMPO_SCALE / s.tempo;
+        double length = beats[first + n + 1].time - b.time;
+        max_error = fabs(length - period) > max_error ? fabs(length - period) : max_error;
+
+        bool measure = s.beats_per_measure > 0 && beat_num == 0;
+        AccentLevel level = s.beats_per_measure > 0 ? levelOf(s.levels, beat_num) : LEVEL_NORMAL;
+        if (measure != ((b.flags & BeatEvent::MEASURE) != 0) || level != b.level
+                || b.ticks != s.beat_divisor) {
+            wrong_beats++;
+        }
+    }
+
+    printf("song %u: %zu of %zu beats, max error %4.2f counts (section tempos), %u with the wrong meter or ticks\n",
+            song, n, expected.size(), max_error, wrong_beats);
+    expectAtMost("beats missing", static_cast<double>(expected.size() - n), 0);
+    expectAtMost("beat error from the section tempo", max_error, 1);
+    expectAtMost("beats with the wrong meter or ticks", wrong_beats, 0);
+    m.stop();
+}
+
+static TimerWheel wheel;
+static uint32_t wheel_ticks;
+static uint32_t wheel_last_run;
+static uint32_t wheel_fired;
+static uint32_t wheel_early;
+static uint32_t wheel_late;
+static uint32_t wheel_deadlines[TIMER_POOL_SIZE];
+
+template <uint8_t N>
+static void wheelAction() {
+    wheel_fired++;
+    if (wheel_ticks < wheel_deadlines[N]) {
+        wheel_early++;
+    } else if (wheel_deadlines[N] <= wheel_last_run) {
+        // (it should have expired last time)
+        wheel_late++;
+    }
+}
+
+// (the timers are numbered in the order they're created)
+template <uint8_t... N>
+static void createWheelTimers(std::integer_sequence<uint8_t, N...>) {
+    TimerId ids[] = {wheel.create(wheelAction<N>)...};
+    (void) ids;
+}
+
+/*
+ * Schedules, reschedules and cancels the timer wheel's timers at random,
+ * letting the main loop fall behind the ticks by up to a few hundred ms, and
+ * reports how many timers expired before their deadline, or weren't run by
+ * the first call to run() after it.
+ */
+static void checkTimerWheel(uint32_t ticks) {
+    createWheelTimers(std::make_integer_sequence<uint8_t, TIMER_POOL_SIZE>());
+    uint32_t scheduled = 0;
+    uint32_t cancelled = 0;
+    uint32_t seed = 12345;
+    auto random = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return seed >> 8u;
+    };
+    for (wheel_ticks = 0; wheel_ticks < ticks; ) {
+        // the main loop is sometimes held up for a while
+        uint8_t behind = static_cast<uint8_t>(random() % 4u == 0 ? random() % 200u : 1u);
+        for (uint8_t n = 0; n < behind; ++n) {
+            wheel.tick();
+        }
+        wheel_ticks += behind;
+        auto id = static_cast<TimerId>(random() % TIMER_POOL_SIZE);
+        switch (random() % 3u) {
+            case 0:
+                if (wheel.isScheduled(id)) {
+                    wheel.cancel(id);
+                    cancelled++;
+                }
+                break;
+            default: {
+                // mostly short delays, some up to the maximum
+                uint16_t delay = static_cast<uint16_t>(random() % 2u ? 1u + random() % 300u : 1u + random() % TimerWheel::MAX_DELAY);
+                wheel.schedule(id, delay);
+                wheel_deadlines[id] = wheel_ticks + delay;
+                scheduled++;
+                break;
+            }
+        }
+        // (after which, so that timers are scheduled while the wheel is behind)
+        wheel.run();
+        wheel_last_run = wheel_ticks;
+    }
+    printf("timer wheel: %u scheduled, %u cancelled, %u expired, %u early, %u late over %u ticks\n",
+            scheduled, cancelled, wheel_fired, wheel_early, wheel_late, wheel_ticks);
+    expectAtMost("timers early", wheel_early, 0);
+    expectAtMost("timers late", wheel_late, 0);
+}
+
+/*
+ * Runs timer0 for the given number of overflows, calling millis() and micros()
+ * every so often (sometimes after long gaps), and reports how many times they
+ * differed from the exact time.
+ */
+static void checkMillis(uint32_t overflows) {
+    uint32_t seed = 54321;
+    auto random = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return seed >> 8u;
+    };
+    uint64_t ovf = 0;
+    uint32_t calls = 0;
+    uint32_t wrong_millis = 0;
+    uint32_t wrong_micros = 0;
+    while (ovf < overflows) {
+        uint32_t gap = random() % 8u == 0 ? random() % 100000u : random() % 3u;
+        for (uint32_t n = 0; n < gap; ++n) {
+            millis_timer0_callback();
+        }
+        ovf += gap;
+        TCNT0 = static_cast<uint8_t>(random());
+        uint64_t ticks = ovf * 256u + TCNT0;
+        calls++;
+        wrong_millis += millis() != static_cast<uint32_t>(ticks * 64u / (F_CPU / 1000u));
+        wrong_micros += micros() != static_cast<uint32_t>(ticks * 64u / (F_CPU / 1000000u));
+    }
+    printf("millis(): %u calls over %llu overflows, %u wrong, micros(): %u wrong\n",
+            calls, static_cast<unsigned long long>(ovf), wrong_millis, wrong_micros);
+    expectAtMost("wrong millis()", wrong_millis, 0);
+    expectAtMost("wrong micros()", wrong_micros, 0);
+}
+
+/*
+ * Feeds the buttons presses which bounce for up to 10ms at each end, with
+ * short glitches in between, and reports any presses which were missed or
+ * doubled, and the longest time from the last bounce to the event, in ms.
+ * (Buttons itself measures from the first.)
+ */
+static void checkButtons(uint32_t presses) {
+    struct Edge {
+        uint64_t time_us;
+        uint8_t pins;
+    };
+    uint32_t seed = 2468;
+    auto random = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return seed >> 8u;
+    };
+
+    // the pins are pulled up, and pressing a button grounds its pin
+    constexpr uint8_t all_up = _BV(SWITCHC) | _BV(SWITCHD) | _BV(SWITCHU) | _BV(SWITCHS);
+    std::vector<Edge> edges;
+    std::vector<uint64_t> press_times;
+    std::vector<uint64_t> release_times;
+    uint64_t t = 10000;
+    auto bounce = [&](uint8_t from, uint8_t to) {
+        uint32_t bounces = random() % 6u;
+        for (uint32_t n = 0; n < bounces; ++n) {
+            edges.push_back({t, to});
+            t += 50u + random() % 1000u;
+            edges.push_back({t, from});
+            t += 50u + random() % 1000u;
+        }
+        edges.push_back({t, to});
+    };
+    for (uint32_t n = 0; n < presses; ++n) {
+        uint8_t button = static_cast<uint8_t>(random() % 4u);
+        uint8_t down = static_cast<uint8_t>(all_up & ~_BV(button));
+        bounce(all_up, down);
+        press_times.push_back(t);
+        t += 20000u + (random() % 4u == 0 ? random() % 2000000u : random() % 200000u);
+        bounce(down, all_up);
+        release_times.push_back(t);
+        t += 50000u + random() % 500000u;
+        // a glitch, which shouldn't count
+        if (random() % 2u) {
+            edges.push_back({t, down});
+            t += 20u + random() % 300u;
+            edges.push_back({t, all_up});
+            t += 50000u;
+        }
+    }
+
+    static Buttons buttons(all_up);
+    buttons.setRepeatPeriod(static_cast<uint8_t>(timerTicks(TICKS_INCREMENT_REPEAT_RATE)));
+    INPUT_REGISTER = all_up;
+    size_t next_edge = 0;
+    uint32_t counts[4] = {};
+    double max_press_latency = 0;
+    double max_release_latency = 0;
+    size_t pressed = 0;
+    size_t released = 0;
+    uint32_t wrong = 0;
+    const uint64_t end = t + 10000u;
+    for (uint64_t tick = US_PER_TIMER_TICK; tick < end; tick += US_PER_TIMER_TICK) {
+        while (next_edge < edges.size() && edges[next_edge].time_us < tick) {
+            INPUT_REGISTER = edges[next_edge++].pins;
+            buttons.pinChange();
+        }
+        buttons.tick();
+        ButtonEvent e;
+        while (buttons.pop(e)) {
+            counts[e.type]++;
+            if (e.type == ButtonEvent::PRESS) {
+                if (pressed >= press_times.size() || pressed != released) {
+                    wrong++;
+                    continue;
+                }
+                double latency = (static_cast<double>(tick) - press_times[pressed++]) / 1000.0;
+                max_press_latency = latency > max_press_latency ? latency : max_press_latency;
+            } else if (e.type == ButtonEvent::RELEASE) {
+                if (released >= pressed) {
+                    wrong++;
+                    continue;
+                }
+                double latency = (static_cast<double>(tick) - release_times[released++]) / 1000.0;
+                max_release_latency = latency > max_release_latency ? latency : max_release_latency;
+            }
+        }
+    }
+    printf("buttons: %u presses, %u releases, %u repeats, %u long presses from %u presses, %u out of order; "
+           "latency up to %.1f ms (press), %.1f ms (release), %u ticks from the first bounce\n",
+            counts[ButtonEvent::PRESS], counts[ButtonEvent::RELEASE], counts[ButtonEvent::REPEAT],
+            counts[ButtonEvent::LONG_PRESS], presses, wrong, max_press_latency, max_release_latency,
+            buttons.maxLatency());
+    expectAtMost("presses missed or doubled", fabs(static_cast<double>(counts[ButtonEvent::PRESS]) - presses), 0);
+    expectAtMost("releases missed or doubled", fabs(static_cast<double>(counts[ButtonEvent::RELEASE]) - presses), 0);
+    expectAtMost("events out of order", wrong, 0);
+    expectAtMost("latency (ms)", max_press_latency > max_release_latency ? max_press_latency : max_release_latency,
+            DEBOUNCE_TICKS * US_PER_TIMER_TICK / 1000.0);
+}
+
+/*
+ * Synthesizes a drummer playing along at the given tempo, while the metronome
+ * is set to another: a loud hit on each beat, and quieter quavers and
+ * semiquavers in between some of the time, each up to jitter_us early or
+ * late, as decaying bursts of tone over a little background noise. Runs the
+ * samples through the onset detector, and reports how many hits it found
+ * (within 10 ms of where they were played), missed or made up, and the
+ * player's tempo it came up with at the end.
+ */
+static void checkOnsets(uint16_t set_tempo, uint16_t played_tempo, uint32_t jitter_us, uint32_t beats) {
+    uint32_t seed = 13579;
+    auto random = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return seed >> 8u;
+    };
+    struct Hit {
+        double time;
+        double level;
+    };
+    std::vector<Hit> hits;
+    const double beat = 60.0 * TEMPO_SCALE / played_tempo;
+    for (uint32_t n = 0; n < beats; ++n) {
+        uint8_t pattern = static_cast<uint8_t>(random() % 4u);
+        for (uint8_t sixteenth = 0; sixteenth < 4; ++sixteenth) {
+            bool play = sixteenth == 0 || (sixteenth == 2 && pattern >= 1) || (pattern == 3);
+            if (!play) {
+                continue;
+            }
+            double jitter = (static_cast<double>(random() % (2u * jitter_us + 1u)) - jitter_us) / 1e6;
+            double level = sixteenth == 0 ? 90 + random() % 30u : 30 + random() % 40u;
+            hits.push_back({0.5 + (n + sixteenth / 4.0) * beat + jitter, level});
+        }
+    }
+
+    static OnsetDetector detector;
+    static TempoFollower follower;
+    follower.reset();
+    std::vector<double> found;
+    const double end = hits.back().time + 1.0;
+    size_t next_hit = 0;
+    std::vector<Hit> sounding;
+    for (uint64_t n = 0; n < static_cast<uint64_t>(end * ONSET_SAMPLE_RATE); ++n) {
+        double t = static_cast<double>(n) / ONSET_SAMPLE_RATE;
+        while (next_hit < hits.size() && hits[next_hit].time <= t) {
+            sounding.push_back(hits[next_hit++]);
+        }
+        double signal = static_cast<double>(random() % 7u) - 3.0;
+        for (const Hit& h : sounding) {
+            double age = t - h.time;
+            signal += h.level * exp(-age / 0.03) * sin(2 * M_PI * 180 * age);
+        }
+        if (sounding.size() > 4) {
+            sounding.erase(sounding.begin());
+        }
+        double sample = 128 + signal;
+        sample = sample < 0 ? 0 : sample > 255 ? 255 : sample;
+        if (detector.addSample(static_cast<uint8_t>(sample))) {
+            found.push_back(t);
+            follower.onset(static_cast<uint32_t>(t * 1e6), set_tempo);
+        }
+    }
+
+    size_t matched = 0;
+    size_t h = 0;
+    for (double t : found) {
+        while (h < hits.size() && hits[h].time < t - 0.01) {
+            ++h;
+        }
+        if (h < hits.size() && hits[h].time <= t + 0.01) {
+            matched++;
+            ++h;
+        }
+    }
+    printf("onsets: played %6.2f BPM (+/- %2u ms) against %6.2f BPM: found %zu of %zu hits, %zu extra; "
+           "followed at %6.2f BPM\n",
+            static_cast<double>(played_tempo) / TEMPO_SCALE, jitter_us / 1000u,
+            static_cast<double>(set_tempo) / TEMPO_SCALE, matched, hits.size(), found.size() - matched,
+            static_cast<double>(follower.tempo()) / TEMPO_SCALE);
+    expectAtMost("hits missed (%)", 100.0 * (hits.size() - matched) / hits.size(), 2);
+    expectAtMost("extra onsets", static_cast<double>(found.size() - matched), 0);
+    expectAtMost("tempo error (BPM)", fabs(static_cast<double>(follower.tempo()) - played_tempo) / TEMPO_SCALE, 0.3);
+}
+
+int main() {
+    static Metronome m;
+    m.setup();
+    m.setBeatEventListener(countBeat);
+    m.setTickEventListener(countTick);
+    m.setBeatDivision(4);
+
+    bench("Metronome::tock()", 10000000, [](uint32_t i) {
+        sink += m.tock().flags;
+        // drain the queue every so often, like the main loop would
+        if ((i & 3u) == 3u) {
+            m.dispatchEvents();
+        }
+    });
+
+    // setBpm() looks up the timer periods for update_timer() in a table
+    bench("Metronome::setBpm()", 1000000, [](uint32_t i) {
+        m.setBpm(static_cast<uint8_t>(SOFT_MIN_BPM + i % (SOFT_MAX_BPM - SOFT_MIN_BPM + 1)));
+    });
+
+    // setTempo() has to calculate them
+    bench("Metronome::setTempo()", 1000000, [](uint32_t i) {
+        m.setTempo(static_cast<uint16_t>(SOFT_MIN_BPM * TEMPO_SCALE + i % ((SOFT_MAX_BPM - SOFT_MIN_BPM) * TEMPO_SCALE)));
+    });
+
+    checkMillis(100000000);
+    bench("millis()", 10000000, [](uint32_t i) {
+        if ((i & 7u) == 0) {
+            millis_timer0_callback();
+        }
+        sink += millis();
+    });
+
+    checkTimerWheel(10000000);
+    checkButtons(10000);
+    checkOnsets(12000, 11760, 5000, 200);
+    checkOnsets(9000, 9450, 10000, 200);
+    checkOnsets(15000, 15000, 15000, 200);
+    {
+        static OnsetDetector detector;
+        bench("OnsetDetector::addSample()", 10000000, [](uint32_t i) {
+            // (a burst every so often)
+            uint32_t age = i % 2000u;
+            auto level = static_cast<uint8_t>(age < 100u ? (i & 1u ? 220u : 36u) : 128u + (i & 3u));
+            sink += detector.addSample(level);
+        });
+    }
+    bench("TimerWheel::run()", 10000000, [](uint32_t i) {
+        wheel.tick();
+        wheel.run();
+        // keep some timers going round
+        TimerId id = static_cast<TimerId>(i % TIMER_POOL_SIZE);
+        if (!wheel.isScheduled(id)) {
+            wheel.schedule(id, static_cast<uint16_t>(1u + (i * 37u) % 1000u));
+        }
+    });
+
+    static SevenSeg sevenSeg;
+    bench("SevenSeg::showNumber()", 1000000, [](uint32_t i) {
+        sevenSeg.showNumber(static_cast<int>(i % 1000), false);
+    });
+
+    for (uint16_t tempo : {3000, 10500, 11750, 25400}) {
+        for (uint8_t divisor : {1, 4, 7, 16}) {
+            simulate(m, tempo, divisor, 10000);
+        }
+    }
+    // a few hours' worth of beats
+    simulate(m, 11751, 6, 1000000);
+
+    simulateLayers(m, 12000, {4, 3, 0}, 10000);
+    simulateLayers(m, 9000, {5, 7, 0}, 10000);
+    simulateLayers(m, 25400, {16, 15, 7}, 10000);
+    // several hours of 3 against 4 against 5
+    simulateLayers(m, 11751, {4, 3, 5}, 1000000);
+
+    simulateRamp(m, 8000, 14000, 32, 1);
+    simulateRamp(m, 8000, 14000, 32, 4);
+    simulateRamp(m, 25400, 3000, 100, 1);
+    simulateRamp(m, 6000, 6100, 64, 3);
+
+    simulateSwing(m, 12000, 2, SWING_TRIPLET, 10000);
+    simulateSwing(m, 12000, 4, 60 * SWING_SCALE, 10000);
+    simulateSwing(m, 25400, 16, MAX_SWING, 10000);
+    // (odd subdivisions aren't swung)
+    simulateSwing(m, 9000, 3, SWING_TRIPLET, 1000);
+
+    simulateClicks(m, 12000, 1, BEEP_LENGTH_US, 1, 0, 10000);
+    simulateClicks(m, 12000, 4, BEEP_LENGTH_GHOST_US, 1, 0, 10000);
+    // the clicks last for several timer periods
+    simulateClicks(m, 25400, 16, BEEP_LENGTH_US, 8, 0, 10000);
+    // and for several chunks of a long wait
+    simulateClicks(m, 3000, 1, 500000ul, 1, 0, 1000);
+    simulateClicks(m, 12000, 4, BEEP_LENGTH_US, 1, 150, 10000);
+    simulateClicks(m, 25400, 16, BEEP_LENGTH_US, 8, 50, 10000);
+
+    simulateTaps(m, 10000, 12000, 0, 8, 1);
+    simulateTaps(m, 10000, 12000, 20000, 16, 4);
+    simulateTaps(m, 25400, 6543, 30000, 16, 3);
+    simulateTaps(m, 6000, 24000, 10000, 12, 16);
+
+    simulateMidiClock(m, 12000, 1, 10000);
+    simulateMidiClock(m, 12000, 4, 10000);
+    simulateMidiClock(m, 9000, 7, 10000);
+    simulateMidiClock(m, 25400, 16, 10000);
+    simulateMidiClock(m, 3000, 5, 1000);
+
+    simulateMidiFollow(m, 10000, 12000, 0, 0, 64, 8);
+    simulateMidiFollow(m, 10000, 12000, 1000, 500, 64, 8);
+    simulateMidiFollow(m, 25400, 6543, 2000, 2000, 64, 8);
+    simulateMidiFollow(m, 6000, 24000, 500, 2000, 64, 8);
+    simulateMidiFollow(m, 12000, 3275, 1000, 2000, 64, 8);
+
+    simulateSyncChain(12000, 0, 10000, 4, 2000, 64, 4, 0);
+    simulateSyncChain(6543, 0, 25400, 4, 2000, 64, 4, 0);
+    simulateSyncChain(12000, 12600, 12000, 4, 2000, 64, 4, 8);
+    simulateSyncChain(24000, 20000, 9000, 4, 2000, 64, 4, 8);
+
+    simulateSong(m, 0);
+    simulateSong(m, 1);
+
+    for (uint16_t step_ms : {BPM_INCREMENT_REPEAT_RATE, 100, 1000}) {
+        for (uint8_t divisor : {1, 4}) {
+            simulateSweep(m, SOFT_MIN_BPM, SOFT_MAX_BPM, step_ms, divisor);
+            simulateSweep(m, SOFT_MAX_BPM, SOFT_MIN_BPM, step_ms, divisor);
+        }
+    }
+
+    if (failures != 0) {
+        printf("%u checks FAILED\n", failures);
+        return 1;
+    }
+    return 0;
+}
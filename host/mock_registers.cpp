@@ -0,0 +1,9 @@
+/*
+ * Register file backing the host build's <avr/io.h>.
+ * Aligned so that the 16 bit registers (TCNT1, OCR1A, ...) can be accessed
+ * as words, as they are little-endian on both the AVR and x86.
+ */
+
+#include <avr/io.h>
+
+alignas(2) volatile uint8_t host_sfr_file[0x100];
@@ -0,0 +1,67 @@
+/*
+ * Feeds recorded samples through the same onset detector and tempo follower
+ * as the firmware, and prints each onset found, with the player's tempo as
+ * estimated so far, and how far it is from the set tempo.
+ *
+ *   usage: onset_replay <samples.raw> <set bpm> [sample rate]
+ *
+ * The samples are unsigned 8 bit mono, like ADCH, by default at the rate the
+ * firmware samples at (ONSET_SAMPLE_RATE). For example, to convert a
+ * recording with sox:
+ *   sox take.wav -t raw -e unsigned -b 8 -c 1 -r 4807 take.raw
+ * The BPM may have up to two decimal places.
+ */
+
+#include "Metronome.h"
+#include "OnsetDetector.h"
+#include "TempoFollower.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char** argv) {
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "usage: %s <samples.raw> <set bpm> [sample rate]\n", argv[0]);
+        return 2;
+    }
+    FILE* in = fopen(argv[1], "rb");
+    if (in == nullptr) {
+        perror(argv[1]);
+        return 1;
+    }
+    double bpm = atof(argv[2]);
+    if (bpm < SOFT_MIN_BPM || bpm > SOFT_MAX_BPM) {
+        fprintf(stderr, "the BPM must be from %d to %d\n", SOFT_MIN_BPM, SOFT_MAX_BPM);
+        return 2;
+    }
+    auto tempo = static_cast<uint16_t>(lround(bpm * TEMPO_SCALE));
+    unsigned long rate = argc > 3 ? strtoul(argv[3], nullptr, 10) : ONSET_SAMPLE_RATE;
+    if (rate == 0) {
+        fprintf(stderr, "bad sample rate\n");
+        return 2;
+    }
+
+    static OnsetDetector detector;
+    static TempoFollower follower;
+    unsigned long long n = 0;
+    unsigned onsets = 0;
+    int c;
+    while ((c = getc(in)) != EOF) {
+        if (detector.addSample(static_cast<uint8_t>(c))) {
+            auto time = static_cast<uint32_t>(n * 1000000ull / rate);
+            follower.onset(time, tempo);
+            onsets++;
+            if (follower.tempo() != 0) {
+                printf("%10.3f s  %6.2f BPM (%+6.2f)\n", time / 1e6,
+                        follower.tempo() / 100.0, (follower.tempo() - tempo) / 100.0);
+            } else {
+                printf("%10.3f s\n", time / 1e6);
+            }
+        }
+        n++;
+    }
+    fclose(in);
+    printf("%u onsets in %.1f s\n", onsets, static_cast<double>(n) / rate);
+    return 0;
+}
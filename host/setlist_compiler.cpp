@@ -0,0 +1,225 @@
+/*
+ * Compiles a text setlist into the byte format described in TempoMap.h,
+ * either as a C header which defines it as a PROGMEM array called setlist,
+ * or (with -b) as raw bytes.
+ *
+ *   usage: setlist_compiler [-b] <setlist.txt> <output>
+ *
+ * Each line of the setlist is one of
+ *   song <name>
+ *   <bars> <bpm> <beats per measure> <ticks per beat> [levels]
+ * where the second kind adds a section to the song above it. The BPM may
+ * have up to two decimal places, and levels has one character per beat of
+ * the measure: 'x' for an accented beat, '.' for a normal one, 'g' for a
+ * ghost beat and '-' for a silent one (by default, just the first beat is
+ * accented). Everything after a '#' is a comment.
+ * For example:
+ *   song Intro to outro
+ *   8  96    4 1
+ *   16 120.5 7 2 x..x.x.
+ */
+
+#include "Metronome.h"
+#include "TempoMap.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+struct Song {
+    std::string name;
+    std::vector<SongSection> sections;
+};
+
+static const char* input_name;
+static unsigned line_num;
+
+static void fail(const char* message) {
+    fprintf(stderr, "%s:%u: %s\n", input_name, line_num, message);
+    exit(1);
+}
+
+static unsigned long parseNumber(const char*& p, unsigned long min, unsigned long max, const char* what) {
+    char* end;
+    unsigned long value = strtoul(p, &end, 10);
+    if (end == p || value < min || value > max) {
+        static char message[80];
+        snprintf(message, sizeof(message), "%s must be from %lu to %lu", what, min, max);
+        fail(message);
+    }
+    p = end;
+    return value;
+}
+
+static SongSection parseSection(const char* p) {
+    SongSection s;
+    s.bars = static_cast<uint8_t>(parseNumber(p, 1, 255, "bars"));
+
+    char* end;
+    double bpm = strtod(p, &end);
+    if (end == p || bpm < SOFT_MIN_BPM || bpm > SOFT_MAX_BPM) {
+        static char message[80];
+        snprintf(message, sizeof(message), "BPM must be from %d to %d", SOFT_MIN_BPM, SOFT_MAX_BPM);
+        fail(message);
+    }
+    p = end;
+    s.tempo = static_cast<uint16_t>(lround(bpm * TEMPO_SCALE));
+
+    s.beats_per_measure = static_cast<uint8_t>(parseNumber(p, MIN_BEATS_PER_MEASURE, MAX_BEATS_PER_MEASURE,
+            "beats per measure"));
+    s.beat_divisor = static_cast<uint8_t>(parseNumber(p, MIN_TICKS_PER_BEAT, MAX_TICKS_PER_BEAT, "ticks per beat"));
+    if (!tocks_per_subbeat.canPlay(s.beat_divisor)) {
+        fail("that number of ticks per beat can't be played");
+    }
+
+    while (isspace(*p)) {
+        p++;
+    }
+    s.levels = DEFAULT_BEAT_LEVELS;
+    uint8_t beat = 0;
+    for (; *p != '\0' && !isspace(*p); ++p, ++beat) {
+        if (beat >= s.beats_per_measure) {
+            fail("more levels than beats per measure");
+        }
+        AccentLevel level;
+        switch (*p) {
+            case 'x':
+            case 'X':
+                level = LEVEL_ACCENT;
+                break;
+            case '.':
+                level = LEVEL_NORMAL;
+                break;
+            case 'g':
+                level = LEVEL_GHOST;
+                break;
+            case '-':
+                level = LEVEL_MUTE;
+                break;
+            default:
+                fail("levels must be 'x', '.', 'g' or '-'");
+                return s;
+        }
+        s.levels = withLevel(s.levels, beat, level);
+    }
+    return s;
+}
+
+static std::vector<Song> parseSetlist(FILE* in) {
+    std::vector<Song> songs;
+    char line[256];
+    while (fgets(line, sizeof(line), in)) {
+        line_num++;
+        char* comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char* p = line;
+        while (isspace(*p)) {
+            p++;
+        }
+        // trim the end too, for the song names
+        char* end = p + strlen(p);
+        while (end > p && isspace(end[-1])) {
+            *--end = '\0';
+        }
+        if (*p == '\0') {
+            continue;
+        }
+        if (strncmp(p, "song", 4) == 0 && (p[4] == '\0' || isspace(p[4]))) {
+            p += 4;
+            while (isspace(*p)) {
+                p++;
+            }
+            songs.push_back(Song{p, {}});
+            continue;
+        }
+        if (songs.empty()) {
+            fail("section before the first song");
+        }
+        if (songs.back().sections.size() >= 255) {
+            fail("too many sections in one song");
+        }
+        songs.back().sections.push_back(parseSection(p));
+    }
+    if (songs.empty() || songs.size() > 255) {
+        fail("there must be from 1 to 255 songs");
+    }
+    for (const Song& song : songs) {
+        if (song.sections.empty()) {
+            fprintf(stderr, "%s: song '%s' has no sections\n", input_name, song.name.c_str());
+            exit(1);
+        }
+    }
+    return songs;
+}
+
+static std::vector<uint8_t> compile(const std::vector<Song>& songs) {
+    std::vector<uint8_t> bytes;
+    bytes.push_back(static_cast<uint8_t>(songs.size()));
+    for (const Song& song : songs) {
+        bytes.push_back(static_cast<uint8_t>(song.sections.size()));
+        for (const SongSection& s : song.sections) {
+            uint8_t section[SONG_SECTION_SIZE];
+            s.write(section);
+            bytes.insert(bytes.end(), section, section + SONG_SECTION_SIZE);
+        }
+    }
+    return bytes;
+}
+
+static void writeHeader(FILE* out, const std::vector<Song>& songs, const std::vector<uint8_t>& bytes) {
+    fprintf(out, "// Generated from %s by setlist_compiler; do not edit\n", input_name);
+    fprintf(out, "#include <avr/pgmspace.h>\n\n");
+    fprintf(out, "static const uint8_t setlist[] PROGMEM = {\n");
+    fprintf(out, "    %u, // songs\n", bytes[0]);
+    size_t pos = 1;
+    for (const Song& song : songs) {
+        fprintf(out, "    // %s\n", song.name.c_str());
+        fprintf(out, "    %u, // sections\n", bytes[pos++]);
+        for (size_t n = 0; n < song.sections.size(); ++n) {
+            fprintf(out, "   ");
+            for (int i = 0; i < SONG_SECTION_SIZE; ++i) {
+                fprintf(out, " %3u,", bytes[pos++]);
+            }
+            fprintf(out, "\n");
+        }
+    }
+    fprintf(out, "};\n");
+}
+
+int main(int argc, char** argv) {
+    bool binary = argc > 1 && strcmp(argv[1], "-b") == 0;
+    if (argc != (binary ? 4 : 3)) {
+        fprintf(stderr, "usage: %s [-b] <setlist.txt> <output>\n", argv[0]);
+        return 2;
+    }
+    input_name = argv[binary ? 2 : 1];
+    const char* output_name = argv[binary ? 3 : 2];
+
+    FILE* in = fopen(input_name, "r");
+    if (!in) {
+        perror(input_name);
+        return 1;
+    }
+    auto songs = parseSetlist(in);
+    fclose(in);
+    auto bytes = compile(songs);
+
+    FILE* out = fopen(output_name, binary ? "wb" : "w");
+    if (!out) {
+        perror(output_name);
+        return 1;
+    }
+    if (binary) {
+        fwrite(bytes.data(), 1, bytes.size(), out);
+    } else {
+        writeHeader(out, songs, bytes);
+    }
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for avr-libc's <util/delay.h>.
+ * Busy-wait delays are meaningless against the mock register file,
+ * so they return immediately.
+ */
+
+#ifndef HOST_UTIL_DELAY_H
+#define HOST_UTIL_DELAY_H
+
+static inline void _delay_ms(double) {}
+static inline void _delay_us(double) {}
+
+#endif // HOST_UTIL_DELAY_H
@@ -10,55 +10,127 @@
 #include "byte_ops.h"
 #include "pindefs.h"
 #include "millis.h"
-#include "SoftTimer.h"
+#include "TimerWheel.h"
+#include "Buttons.h"
+#include "TapTempo.h"
+#include "OnsetDetector.h"
+#include "TempoFollower.h"
+#include "Midi.h"
+#include "ClockPll.h"
+#include "Sync.h"
+#include "TempoMap.h"
+#include "setlist.h"
 
 #include <util/delay.h>
 #include <avr/io.h>
 // for the system clock prescale stuff
 #include <avr/power.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 
-static Metronome m;
-static SoftTimer tickSoundTimer;
+/*
+ * What the metronome does on each event. This is bound to the metronome at
+ * compile time, so that onClick() is inlined into the Timer1 ISR.
+ */
+struct MetronomeListener : NullListener {
+    static inline uint16_t onClick(BeatEvent e);
+    static inline void onClickEnd();
+    static inline void onClock();
+    static void onStart();
+    static void onStop();
+    static void onBeat(uint8_t beat_num, uint8_t beats_per_measure);
+    static void onBpmChanged(uint8_t bpm);
+    static void onBeatsChanged(uint8_t measureLength);
+    static void onTicksChanged(uint8_t subdivision);
+    static void onGroupingChanged(MeterGrouping grouping);
+};
+
+static BasicMetronome<MetronomeListener> m;
 static ToneGen t;
+static TimerWheel timers;
+static Buttons buttons(BUTTON_PINS);
 static SevenSeg sevenSeg;
+static TapTempo tapper;
+static OnsetDetector onsets;
+static TempoFollower follower;
+#if MIDI_ENABLED
+static MidiOut midiOut;
+static MidiIn midiIn;
+static ClockPll midiPll(MIDI_CLOCKS_PER_BEAT, MIDI_PLL_PHASE_SHIFT, MIDI_PLL_PERIOD_SHIFT);
+// set by MIDI start, so that the next clock pulse starts the metronome
+static bool midiStarting = false;
+// forgets the MIDI clock when it stops coming
+static TimerId midiTimer = TimerWheel::NO_TIMER;
+// while another device's messages are coming in, it starts and stops the
+// metronome, so MIDI start and stop aren't sent back to it
+static bool midiSlaved = false;
+#endif
+#if SYNC_ENABLED
+static SyncIn syncIn;
+static ClockPll syncPll(SYNC_PULSES_PER_BEAT, SYNC_PLL_PHASE_SHIFT, SYNC_PLL_PERIOD_SHIFT);
+// set from the first pulse of a run until they stop coming
+static bool syncFollowing = false;
+// set until the metronome has been started from the pulses
+static bool syncStarting = false;
+// lines the beat up with the pulses, half a beat after each one
+static TimerId syncAlignTimer = TimerWheel::NO_TIMER;
+// notices when the pulses stop coming
+static TimerId syncTimer = TimerWheel::NO_TIMER;
+#endif
+
+// for turning micros() into Timer1 counts
+static constexpr uint32_t US_PER_TIMER1_COUNT = 1000000ul / TIMER1_COUNTS_PER_SECOND;
 
 /* All screens/display modes */
 enum Screen {
     SCREEN_BLANK,
     SCREEN_BPM,
+    // the up and down buttons tap the tempo
+    SCREEN_TAP,
     SCREEN_MEASURE,
     SCREEN_SUBDIVIDE,
-    NUM_SCREENS
+    SCREEN_GROUPING,
+    // the up and down buttons pick a song from the setlist (see setlist.txt)
+    SCREEN_SONG,
+    // listens to the player (see OnsetDetector), and shows how far off they are
+    SCREEN_LISTEN,
+    NUM_SCREENS,
+    // (not in the cycle; hold the control button down to get to it)
+    SCREEN_LOOP_TIME = NUM_SCREENS
 };
 
 static Screen nextScreen = SCREEN_BLANK;
 static Screen currentScreen = SCREEN_BLANK;
+// set when what the current screen shows has changed
+static bool screenDirty = false;
+
+/*
+ * The user interface is a state machine, driven by button and timer events,
+ * which are all handled by the main loop, one at a time, and without waiting
+ * for anything.
+ */
+enum UiState : uint8_t {
+    UI_IDLE,
+    // the up or down button is being held, to repeat it
+    UI_ADJUSTING,
+};
 
-static uint8_t buttonsState = 0;
-static uint8_t lastButtonsState = 0;
+static UiState uiState = UI_IDLE;
+static uint8_t adjustButton;
+static uint8_t adjustRepeats;
+static uint8_t adjustPeriod;
+// goes back to the BPM after a while without any buttons being pressed
+static TimerId screenTimer = TimerWheel::NO_TIMER;
+// the song last picked on SCREEN_SONG, counting from 1, or 0 for none
+static uint8_t songNum = 0;
 
-// At 16MHz / 64x prescaler, each subBeat of the soft timer takes 256*8 us,
-// or 2.048 ms (see millis.cpp).
-inline static void setTickSoundTimer() {
-    tickSoundTimer.setCount(30);
-}
+// the longest a run of loop() has taken (not counting sleeping), in us
+static uint16_t maxLoopTime = 0;
 
 /*
  * Utility functions
  */
 
-// call from PCINT interrupt handler
-void onInputButtonsChange() {
-    lastButtonsState = buttonsState;
-    buttonsState = INPUT_REGISTER;
-}
-
-// negates value, since pins are configured as INPUT_PULLUP
-inline static bool pressed(uint8_t input_pin) {
-    return !bitRead(INPUT_REGISTER, input_pin);
-}
-
 inline static void led_on() {
     bitSet(LED_PORT, LED_PIN);
 }
@@ -100,10 +172,124 @@ inline static void display_bpm(uint8_t bpm) {
     sevenSeg.showNumber(intBpm, false);
 }
 
+// whether the tempo is coming from another device
+static bool isFollowing() {
+#if MIDI_ENABLED
+    return midiPll.isLocked();
+#elif SYNC_ENABLED
+    return syncPll.isLocked();
+#else
+    return false;
+#endif
+}
+
+/*
+ * The BPM, with a dot on the first digit while it's following a MIDI clock or
+ * sync pulses.
+ */
+static void displayBpm(uint8_t bpm) {
+    display_bpm(bpm);
+    if (isFollowing()) {
+        sevenSeg.setDigit(2, bpm >= 100 ? '0' + (char)(bpm / 100) : ' ', WITH_DOT);
+    }
+}
+
+/*
+ * Shows tAP until there have been enough taps for a tempo, and then the BPM,
+ * with a dot to tell it apart from SCREEN_BPM.
+ */
+static void displayTap(uint8_t bpm) {
+    if (tapper.tempo() == 0) {
+        sevenSeg.setDigit(2, 't', WITHOUT_DOT);
+        sevenSeg.setDigit(1, 'A', WITHOUT_DOT);
+        sevenSeg.setDigit(0, 'P', WITHOUT_DOT);
+    } else {
+        display_bpm(bpm);
+        sevenSeg.setDigit(0, '0' + (char)(bpm % 10), WITH_DOT);
+    }
+}
+
 static void displaySubdivisions(uint8_t subdivision) {
     sevenSeg.setDigit(2, 'd', WITH_DOT);
-    sevenSeg.setDigit(1, ' ', WITHOUT_DOT);
-    sevenSeg.setDigit(0, '0' + (char)(subdivision), WITHOUT_DOT);
+    sevenSeg.setDigit(1, subdivision >= 10 ? '0' + (char)(subdivision / 10) : ' ', WITHOUT_DOT);
+    sevenSeg.setDigit(0, '0' + (char)(subdivision % 10), WITHOUT_DOT);
+}
+
+/*
+ * Shows the size of each group of beats, e.g. 223 for 2+2+3, or --- for no
+ * grouping. Only the first three fit, so a dot on the last digit means that
+ * there are more.
+ */
+static void displayGrouping(MeterGrouping grouping) {
+    if (grouping == 0) {
+        for (uint8_t digit = 0; digit < 3; ++digit) {
+            sevenSeg.setDigit(digit, '-', WITHOUT_DOT);
+        }
+        return;
+    }
+    for (uint8_t digit = 3; digit-- > 0; ) {
+        uint8_t size = grouping & GROUPING_MASK;
+        grouping >>= GROUPING_BITS;
+        bool more = digit == 0 && grouping != 0;
+        sevenSeg.setDigit(digit, size != 0 ? '0' + (char) size : ' ', more);
+    }
+}
+
+/*
+ * Shows the loop time in ms, to two decimal places (so it tops out at 9.99).
+ */
+static void displayLoopTime(uint16_t us) {
+    uint16_t hundredths = (us + 5u) / 10u;
+    if (hundredths > 999) {
+        hundredths = 999;
+    }
+    sevenSeg.setDigit(2, '0' + (char)(hundredths / 100), WITH_DOT);
+    sevenSeg.setDigit(1, '0' + (char)(hundredths / 10 % 10), WITHOUT_DOT);
+    sevenSeg.setDigit(0, '0' + (char)(hundredths % 10), WITHOUT_DOT);
+}
+
+/*
+ * Shows how far the player's tempo is above or below the set one, with a minus
+ * sign if they're slower, in tenths of a BPM up to 9.9, and then in whole BPM.
+ * Until there's enough to go on, it shows ---.
+ */
+static void displayDrift(uint16_t player, uint16_t set) {
+    if (player == 0) {
+        for (uint8_t digit = 0; digit < 3; ++digit) {
+            sevenSeg.setDigit(digit, '-', WITHOUT_DOT);
+        }
+        return;
+    }
+    bool slower = player < set;
+    uint16_t hundredths = slower ? set - player : player - set;
+    uint16_t tenths = (hundredths + 5u) / 10u;
+    sevenSeg.setDigit(2, slower ? '-' : ' ', WITHOUT_DOT);
+    if (tenths < 100) {
+        sevenSeg.setDigit(1, '0' + (char)(tenths / 10), WITH_DOT);
+        sevenSeg.setDigit(0, '0' + (char)(tenths % 10), WITHOUT_DOT);
+    } else {
+        uint16_t whole = (hundredths + 50u) / 100u;
+        if (whole > 99) {
+            whole = 99;
+        }
+        sevenSeg.setDigit(1, '0' + (char)(whole / 10), WITHOUT_DOT);
+        sevenSeg.setDigit(0, '0' + (char)(whole % 10), WITHOUT_DOT);
+    }
+}
+
+/*
+ * The song picked from the setlist, as "S" and its number, with a dot while
+ * it's playing, or "S--" if there isn't one.
+ */
+static void displaySong(uint8_t song) {
+    sevenSeg.setDigit(2, 'S', WITHOUT_DOT);
+    if (song == 0) {
+        sevenSeg.setDigit(1, '-', WITHOUT_DOT);
+        sevenSeg.setDigit(0, '-', WITHOUT_DOT);
+    } else {
+        sevenSeg.setDigit(1, song >= 10 ? '0' + (char)(song / 10) : ' ', WITHOUT_DOT);
+        sevenSeg.setDigit(0, '0' + (char)(song % 10), m.isPlayingSong());
+    }
 }
 
 static void displayMeasureLength(uint8_t measureLength) {
@@ -116,68 +302,246 @@ static void displayMeasureLength(uint8_t measureLength) {
  * More meaty section
  */
 
+#if MIDI_ENABLED
+/*
+ * Follows another device's MIDI clock. The tempo, and where the beat is, are
+ * taken from the ClockPll's smoothed grid once a beat, so the clicks stay
+ * with the other device without picking up the jitter in its clock.
+ */
+static void onMidi(const MidiMessage& message) {
+    // (until the clock times out)
+    midiSlaved = true;
+    switch (message.status) {
+        case MIDI_START:
+            if (m.isRunning()) {
+                m.stop();
+            }
+            midiPll.restart();
+            midiStarting = true;
+            break;
+        case MIDI_STOP:
+            midiStarting = false;
+            if (m.isRunning()) {
+                m.stop();
+            }
+            break;
+        case MIDI_CLOCK: {
+            timers.schedule(midiTimer, timerTicks(MIDI_CLOCK_TIMEOUT));
+            // (the first beat is one tock later)
+            if (midiStarting) {
+                midiStarting = false;
+                m.start();
+            }
+            bool locked = midiPll.isLocked();
+            if (midiPll.pulse(message.time)) {
+                uint32_t since_beat = (micros() - midiPll.beatStart()) / US_PER_TIMER1_COUNT;
+                m.syncTempo(midiPll.tempo(), since_beat);
+            }
+            screenDirty |= currentScreen == SCREEN_BPM && midiPll.isLocked() != locked;
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// called by the timer wheel when the MIDI clock stops coming
+static void onMidiTimeout() {
+    midiPll.reset();
+    midiStarting = false;
+    midiSlaved = false;
+    screenDirty |= currentScreen == SCREEN_BPM;
+}
+#endif
+
+#if SYNC_ENABLED
+/*
+ * Follows the sync pulses from another metronome. The first pulse of a run
+ * starts this one again, on the first beat of the measure, at the tempo the
+ * pulses had last time, so a chain of them starts together. (The very first
+ * time, it takes two pulses to find the tempo, so it starts on the second,
+ * rather than passing on pulses at the wrong tempo.) After that, the tempo
+ * and beat follow the pulses, and when they stop, so does this.
+ */
+static void onSyncPulse(uint32_t time) {
+    if (!syncFollowing) {
+        syncFollowing = true;
+        syncStarting = true;
+        syncPll.restart();
+    }
+    bool locked = syncPll.isLocked();
+    bool align = syncPll.pulse(time);
+    if (syncStarting && syncPll.tempo() != 0) {
+        syncStarting = false;
+        m.setTempo(syncPll.tempo());
+        if (m.isRunning()) {
+            m.stop();
+        }
+        m.start();
+    }
+    // (there's one pulse a beat, so the beat is lined up half a beat later)
+    if (align) {
+        timers.schedule(syncAlignTimer, timerTicks(static_cast<uint16_t>(30000ul * TEMPO_SCALE / syncPll.tempo())));
+    }
+    uint16_t tempo = syncPll.tempo() != 0 ? syncPll.tempo() : HARD_MIN_BPM * TEMPO_SCALE;
+    timers.schedule(syncTimer, timerTicks(static_cast<uint16_t>(SYNC_TIMEOUT_BEATS * 60000ul * TEMPO_SCALE / tempo)));
+    screenDirty |= currentScreen == SCREEN_BPM && syncPll.isLocked() != locked;
+}
+
+// called by the timer wheel, half a beat after a pulse
+static void onSyncAlign() {
+    if (syncPll.isLocked()) {
+        uint32_t since_beat = (micros() - syncPll.beatStart()) / US_PER_TIMER1_COUNT;
+        m.syncTempo(syncPll.tempo(), since_beat);
+    }
+}
+
+// called by the timer wheel when the pulses stop coming
+static void onSyncTimeout() {
+    syncFollowing = false;
+    syncPll.reset();
+    timers.cancel(syncAlignTimer);
+    if (m.isRunning()) {
+        m.stop();
+    }
+    screenDirty |= currentScreen == SCREEN_BPM;
+}
+#endif
+
 /**
- * Calls a function when when a button press is detected
- * implements ability to hold down a button to automatically repeat the action
- * at the desired repeat rate (in ms)
+ * Does the main loop's share of the work for beats and ticks that have happened
+ * since the last call, and runs any software timers which have expired. Must be
+ * called regularly.
  */
-static void do_button_action_repeatable(uint8_t input_pin, void (*action)(), uint8_t repeat_rate) {
-    action();
-    // pause to allow single stepping
-    const long current_time = millis();
-    while (pressed(input_pin) && millis() - current_time < INCREMENT_REPEAT_DELAY) {
-        _delay_ms(10);
+static void service() {
+    m.dispatchEvents();
+    timers.run();
+    uint32_t onset;
+    while (onsets.pop(onset)) {
+        follower.onset(onset, m.getTempo());
+        screenDirty |= currentScreen == SCREEN_LISTEN;
+    }
+#if MIDI_ENABLED
+    MidiMessage message;
+    while (midiIn.pop(message)) {
+        onMidi(message);
     }
-    // then repeat action at repeat rate
-    while (pressed(input_pin)) {
-        action();
-        delay(repeat_rate);
+#endif
+#if SYNC_ENABLED
+    uint32_t pulse;
+    while (syncIn.pop(pulse)) {
+        onSyncPulse(pulse);
     }
+#endif
 }
 
-static void onBpmChange(uint8_t bpm) {
-    display_bpm(bpm);
+// (these can all be called at once when a song section starts, or many times
+// while a button is held, so the display is only redrawn once per loop())
+void MetronomeListener::onBpmChanged(uint8_t) {
+    screenDirty |= currentScreen == SCREEN_BPM || currentScreen == SCREEN_TAP || currentScreen == SCREEN_LISTEN;
 }
 
-static void onMeasureLengthChange(uint8_t measureLength) {
-    displayMeasureLength(measureLength);
+void MetronomeListener::onBeatsChanged(uint8_t) {
+    screenDirty |= currentScreen == SCREEN_MEASURE;
+}
 
+void MetronomeListener::onTicksChanged(uint8_t) {
+    screenDirty |= currentScreen == SCREEN_SUBDIVIDE;
 }
-static void onBeatSubdivisionChange(uint8_t subdivision) {
-    displaySubdivisions(subdivision);
+
+void MetronomeListener::onGroupingChanged(MeterGrouping) {
+    screenDirty |= currentScreen == SCREEN_GROUPING;
 }
 
-static void onBeat(uint8_t beat_num, uint8_t beats_per_measure) {
-    if (beat_num == 0 && beats_per_measure > 0) {
+/*
+ * Starts the sound for a beat or tick. This is called straight from the
+ * Timer1 ISR, so only the timing critical work is done here; everything else
+ * happens in the listeners, which are called from the main loop.
+ */
+static_assert(MAX_LAYERS <= 3, "onClick() only has tones for up to 3 layers");
+
+uint16_t MetronomeListener::onClick(BeatEvent e) {
+    // muted beats and ticks let the next layer down be heard instead
+    AccentLevel level;
+    ToneGen::Config tone;
+    if ((e.flags & BeatEvent::BEAT) && e.beat_level != LEVEL_MUTE) {
+        // accented beats are normally the first of each measure or group
         constexpr auto bar_tone = ToneGen::makeConfig(BEEP_FREQ_MEASURE);
-        t.start(bar_tone);
-        setTickSoundTimer();
-        led_on();
-    } else {
-        // next beat
+        constexpr auto group_tone = ToneGen::makeConfig(BEEP_FREQ_GROUP);
         constexpr auto beat_tone = ToneGen::makeConfig(BEEP_FREQ_BEAT);
-        t.start(beat_tone);
-        setTickSoundTimer();
-    }
-}
-
-static void onTick(uint8_t tick_num, uint8_t ticks_per_beat) {
-    // don't play a sound on the actual beat
-    // TODO I don't know why this works, rather than a != 0 check
-    if (tick_num != 0)
-    {
+        level = e.beat_level;
+        if (level != LEVEL_ACCENT) {
+            tone = beat_tone;
+        } else {
+            tone = e.flags & BeatEvent::MEASURE ? bar_tone : group_tone;
+        }
+    } else if ((e.flags & (BeatEvent::BEAT | BeatEvent::SUBBEAT)) == BeatEvent::SUBBEAT
+            && e.tickLevel(0) != LEVEL_MUTE) {
+        // accented ticks sound like beats
         constexpr auto tick_tone = ToneGen::makeConfig(BEEP_FREQ_SUB);
-        t.start(tick_tone);
-        setTickSoundTimer();
+        constexpr auto beat_tone = ToneGen::makeConfig(BEEP_FREQ_BEAT);
+        level = e.tickLevel(0);
+        tone = level == LEVEL_ACCENT ? beat_tone : tick_tone;
+    } else if ((e.layers & _BV(1)) && e.tickLevel(1) != LEVEL_MUTE) {
+        // the other layers only play if the main one doesn't
+        constexpr auto layer_tone = ToneGen::makeConfig(BEEP_FREQ_LAYER1);
+        constexpr auto accent_tone = ToneGen::makeConfig(BEEP_FREQ_LAYER1_ACCENT);
+        level = e.tickLevel(1);
+        tone = level == LEVEL_ACCENT ? accent_tone : layer_tone;
+    } else if ((e.layers & _BV(2)) && e.tickLevel(2) != LEVEL_MUTE) {
+        constexpr auto layer_tone = ToneGen::makeConfig(BEEP_FREQ_LAYER2);
+        constexpr auto accent_tone = ToneGen::makeConfig(BEEP_FREQ_LAYER2_ACCENT);
+        level = e.tickLevel(2);
+        tone = level == LEVEL_ACCENT ? accent_tone : layer_tone;
+    } else {
+        return 0;
     }
+    // the LED flashes with the first click of each measure, and goes off with
+    // it in onClickEnd(), so that it's lit for as long as the click whatever
+    // the main loop is doing
+    if (e.flags & BeatEvent::MEASURE) {
+        led_on();
+    }
+    t.start(tone);
+    // ghost notes are just shorter
+    return clickLength(level == LEVEL_GHOST ? BEEP_LENGTH_GHOST_US : BEEP_LENGTH_US);
 }
 
-// used to turn off LED and tone after a beat or subBeat
-static void postTickCallback() {
+// turns off the tone and LED after a beat or tick, from the Timer1 compare match B ISR
+void MetronomeListener::onClickEnd() {
     t.stop();
     led_off();
 }
 
+// MIDI clock, from the Timer1 compare match A ISR (only while MIDI is enabled)
+void MetronomeListener::onClock() {
+#if MIDI_ENABLED
+    midiOut.send(MIDI_CLOCK);
+#endif
+}
+
+// (so that the first clock pulse after the start message is the first beat)
+void MetronomeListener::onStart() {
+#if MIDI_ENABLED
+    if (!midiSlaved) {
+        midiOut.send(MIDI_START);
+    }
+#endif
+}
+
+void MetronomeListener::onStop() {
+#if MIDI_ENABLED
+    if (!midiSlaved) {
+        midiOut.send(MIDI_STOP);
+    }
+#endif
+}
+
+void MetronomeListener::onBeat(uint8_t beat_num, uint8_t) {
+    // songs start and end at the start of a bar
+    screenDirty |= beat_num == 0 && currentScreen == SCREEN_SONG;
+}
+
 static void incrementBpm() {
     m.incrementBpm(1);
 }
@@ -191,7 +555,7 @@ static void setNextScreen(Screen s) {
 }
 
 static void incrementNextScreen() {
-    int nextScreenIdx = currentScreen + 1;
+    int nextScreenIdx = nextScreen + 1;
     if (nextScreenIdx >= NUM_SCREENS) {
         nextScreenIdx = 0;
     }
@@ -199,6 +563,19 @@ static void incrementNextScreen() {
 
 }
 
+/*
+ * Sets the tempo from the taps so far, if there are enough, with the beat
+ * starting at the last tap. The tap's time is from the pin change interrupt,
+ * so it doesn't include the debouncing delay.
+ */
+static void tapTempo(uint32_t time) {
+    if (tapper.tap(time)) {
+        uint32_t since_tap = (micros() - tapper.lastTap()) / US_PER_TIMER1_COUNT;
+        m.syncTempo(tapper.tempo(), since_tap);
+    }
+    screenDirty = true;
+}
+
 static void incrementMeasureLength() {
     m.incrementBeats(1);
 }
@@ -206,6 +583,32 @@ static void decrementMeasureLength() {
     m.incrementBeats(static_cast<uint8_t>(-1));
 }
 
+static void incrementGrouping() {
+    m.incrementGrouping(1);
+}
+static void decrementGrouping() {
+    m.incrementGrouping(static_cast<uint8_t>(-1));
+}
+
+/*
+ * Picks the next or previous song of the setlist, going round through none,
+ * and plays it from the next bar. Picking none stops the song.
+ */
+static void changeSong(bool up) {
+    uint8_t songs = pgm_read_byte(setlist);
+    if (up) {
+        songNum = songNum < songs ? songNum + 1u : 0u;
+    } else {
+        songNum = songNum > 0 ? songNum - 1u : songs;
+    }
+    if (songNum != 0) {
+        m.playSong(setlist_song_P(setlist, songNum - 1u));
+    } else {
+        m.stopSong();
+    }
+    screenDirty = true;
+}
+
 static void incrementSubdivision() {
     m.incrementTicks(static_cast<uint8_t>(1));
 }
@@ -213,11 +616,17 @@ static void decrementSubdivision() {
     m.incrementTicks(static_cast<uint8_t>(-1));
 }
 
-ISR(TIMER0_COMPA_vect) {
+/*
+ * The display can wait, so these let Timer1 interrupt them, rather than
+ * holding up the start of a click. (The overflow ISR is short enough that
+ * it still blocks.) Anything they share with the Timer1 ISRs, like PORTB,
+ * has to be changed atomically (see SevenSeg.cpp).
+ */
+ISR(TIMER0_COMPA_vect, ISR_NOBLOCK) {
     sevenSeg.timerHighCallback();
 }
 
-ISR(TIMER0_COMPB_vect) {
+ISR(TIMER0_COMPB_vect, ISR_NOBLOCK) {
     sevenSeg.timerLowCallback();
 }
 
@@ -225,18 +634,55 @@ ISR(TIMER1_COMPA_vect) {
     m.tock();
 }
 
+// the end of a click
+ISR(TIMER1_COMPB_vect) {
+    m.endClick();
+}
+
 ISR(TIMER0_OVF_vect) {
     millis_timer0_callback();
-    tickSoundTimer.tick();
+    timers.tick();
+    buttons.tick();
+}
+
+ISR(PCINT1_vect) {
+    buttons.pinChange();
+}
+
+// (this lets Timer1 in itself, once it's made sure it can't come in again)
+ISR(ADC_vect) {
+    onsets.conversionComplete();
 }
 
+#if MIDI_ENABLED
+// (this one can't let other interrupts in, as it would go straight off again)
+ISR(USART_UDRE_vect) {
+    midiOut.dataRegisterEmpty();
+}
+
+// (nor this one, until it's read the byte, and it's short anyway)
+ISR(USART_RX_vect) {
+    midiIn.receive();
+}
+#endif
+
+#if SYNC_ENABLED
+ISR(TIMER1_CAPT_vect) {
+    syncIn.capture(m.lastPeriod());
+}
+#endif
+
 /*
  * Setup switches as input pullup
  */
 static void input_setup() {
-    // just make whole of INPUT register input pullups
-    INPUT_DDR = 0;
-    INPUT_PORT = 0b01111111;
+    /* the buttons are input pullups, and the other pins are left alone: PC4
+     * can drive the display, and PC5 is the onset input, which is biased to
+     * half the supply, so a pullup would pull it off
+     */
+    INPUT_DDR = static_cast<uint8_t>(INPUT_DDR & ~BUTTON_PINS);
+    INPUT_PORT = static_cast<uint8_t>(INPUT_PORT | BUTTON_PINS);
+    buttons.setup();
 }
 
 static void setup() {
@@ -256,28 +702,46 @@ static void setup() {
     timer0_setup(16, 128);
     // timer 2
     t.setup();
-    sevenSeg.setup();
 
     input_setup();
+    // (after the inputs, as one of the segments can be on the input port)
+    sevenSeg.setup();
     led_setup();
 
 
 
     // set up metronome
     m.setup();
-    m.setBeatEventListener(onBeat);
-    m.setTickEventListener(onTick);
-    m.setBpmChangeCallback(onBpmChange);
-    m.setBeatsChangeCallback(onMeasureLengthChange);
-    m.setTicksChangeCallback(onBeatSubdivisionChange);
-
-    tickSoundTimer.setAction(postTickCallback);
+#if MIDI_ENABLED
+    midiOut.setup();
+    midiIn.setup();
+    m.setClockOutput(true);
+#endif
+#if SYNC_ENABLED
+    bitSet(SYNC_OUT_DDR, SYNC_OUT_PIN);
+    m.setSyncOutput(true);
+    syncIn.setup();
+#endif
 }
 
 static void updateScreen() {
+    // the ADC is only powered while it's listening
+    if (nextScreen != currentScreen) {
+        if (currentScreen == SCREEN_LISTEN) {
+            onsets.stop();
+        } else if (nextScreen == SCREEN_LISTEN) {
+            follower.reset();
+            onsets.start();
+        }
+    }
+
     switch (nextScreen) {
         case SCREEN_BPM:
-            display_bpm(m.getBpm());
+            displayBpm(m.getBpm());
+            sevenSeg.displayOn();
+            break;
+        case SCREEN_TAP:
+            displayTap(m.getBpm());
             sevenSeg.displayOn();
             break;
         case SCREEN_MEASURE:
@@ -288,62 +752,197 @@ static void updateScreen() {
             displaySubdivisions(m.getBeatSubdivisions());
             sevenSeg.displayOn();
             break;
+        case SCREEN_GROUPING:
+            displayGrouping(m.getGrouping());
+            sevenSeg.displayOn();
+            break;
+        case SCREEN_SONG:
+            displaySong(songNum);
+            sevenSeg.displayOn();
+            break;
+        case SCREEN_LISTEN:
+            displayDrift(follower.tempo(), m.getTempo());
+            sevenSeg.displayOn();
+            break;
+        case SCREEN_LOOP_TIME:
+            displayLoopTime(maxLoopTime);
+            sevenSeg.displayOn();
+            break;
         case SCREEN_BLANK:
             sevenSeg.displayOff();
             break;
     }
     currentScreen = nextScreen;
+    screenDirty = false;
 }
 
-// poll inputs -> this should probably be done with interrupts
-static void loop() {
-    if (pressed(SWITCHC)) {
-        incrementNextScreen();
-        updateScreen();
-        while (pressed(SWITCHC));
-        _delay_ms(20);
-    } else if (pressed(SWITCHS)) {
-        m.toggle();
-        // wait until button unpressed
-        while (pressed(SWITCHS));
-        _delay_ms(20);
-    } else {
-        if (pressed(SWITCHU)) {
-            switch (currentScreen) {
-                case SCREEN_BPM:
-                    do_button_action_repeatable(SWITCHU, incrementBpm, BPM_INCREMENT_REPEAT_RATE);
-                    break;
-                case SCREEN_MEASURE:
-                    do_button_action_repeatable(SWITCHU, incrementMeasureLength, TICKS_INCREMENT_REPEAT_RATE);
-                    break;
-                case SCREEN_SUBDIVIDE:
-                    do_button_action_repeatable(SWITCHU, incrementSubdivision, TICKS_INCREMENT_REPEAT_RATE);
-                    break;
-                default:
-                    break;
+/*
+ * What the up and down buttons do depends on the screen.
+ */
+static void adjustSetting(bool up) {
+    switch (nextScreen) {
+        case SCREEN_BPM:
+            up ? incrementBpm() : decrementBpm();
+            break;
+        case SCREEN_MEASURE:
+            up ? incrementMeasureLength() : decrementMeasureLength();
+            break;
+        case SCREEN_SUBDIVIDE:
+            up ? incrementSubdivision() : decrementSubdivision();
+            break;
+        case SCREEN_GROUPING:
+            up ? incrementGrouping() : decrementGrouping();
+            break;
+        case SCREEN_SONG:
+            changeSong(up);
+            break;
+        case SCREEN_LISTEN:
+            // follow the player
+            if (follower.tempo() != 0) {
+                m.setTempo(follower.tempo());
             }
-        } else if (pressed(SWITCHD)) {
-            switch (currentScreen) {
-                case SCREEN_BPM:
-                    do_button_action_repeatable(SWITCHD, decrementBpm, BPM_INCREMENT_REPEAT_RATE);
-                    break;
-                case SCREEN_MEASURE:
-                    do_button_action_repeatable(SWITCHD, decrementMeasureLength, TICKS_INCREMENT_REPEAT_RATE);
-                    break;
-                case SCREEN_SUBDIVIDE:
-                    do_button_action_repeatable(SWITCHD, decrementSubdivision, TICKS_INCREMENT_REPEAT_RATE);
-                    break;
-                default:
-                    break;
+            break;
+        case SCREEN_LOOP_TIME:
+            // start measuring again
+            maxLoopTime = 0;
+            screenDirty = true;
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Holding up or down repeats it, and the BPM speeds up the longer it's held,
+ * halving the time between repeats every so often.
+ */
+static void startAdjusting(uint8_t button) {
+    uiState = UI_ADJUSTING;
+    adjustButton = button;
+    adjustRepeats = 0;
+    adjustPeriod = static_cast<uint8_t>(timerTicks(nextScreen == SCREEN_BPM
+            ? BPM_INCREMENT_REPEAT_START : TICKS_INCREMENT_REPEAT_RATE));
+    buttons.setRepeatPeriod(adjustPeriod);
+    adjustSetting(button == SWITCHU);
+}
+
+static void repeatAdjusting() {
+    adjustSetting(adjustButton == SWITCHU);
+    constexpr uint8_t fastest = timerTicks(BPM_INCREMENT_REPEAT_RATE);
+    if (nextScreen == SCREEN_BPM && ++adjustRepeats % REPEAT_ACCELERATE_EVERY == 0 && adjustPeriod > fastest) {
+        adjustPeriod = adjustPeriod / 2u > fastest ? adjustPeriod / 2u : fastest;
+        buttons.setRepeatPeriod(adjustPeriod);
+    }
+}
+
+// a button press when nothing else is going on
+static void onIdlePress(const ButtonEvent& e) {
+    switch (e.button) {
+        case SWITCHC:
+            incrementNextScreen();
+            if (nextScreen == SCREEN_TAP) {
+                tapper.reset();
             }
-        }
+            break;
+        case SWITCHS:
+            m.toggle();
+            break;
+        case SWITCHU:
+        case SWITCHD:
+            if (nextScreen == SCREEN_TAP) {
+                tapTempo(e.time);
+            } else {
+                startAdjusting(e.button);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void onButton(ButtonEvent e) {
+    switch (uiState) {
+        case UI_IDLE:
+            if (e.type == ButtonEvent::PRESS) {
+                onIdlePress(e);
+            } else if (e.type == ButtonEvent::LONG_PRESS && e.button == SWITCHC) {
+                // (the press has already moved on a screen, but never mind)
+                setNextScreen(SCREEN_LOOP_TIME);
+            }
+            break;
+        case UI_ADJUSTING:
+            if (e.button == adjustButton) {
+                if (e.type == ButtonEvent::REPEAT) {
+                    repeatAdjusting();
+                } else if (e.type == ButtonEvent::RELEASE) {
+                    uiState = UI_IDLE;
+                }
+            } else if (e.type == ButtonEvent::PRESS) {
+                // another button takes over
+                uiState = UI_IDLE;
+                onIdlePress(e);
+            }
+            break;
+    }
+
+    // the settings screens time out, but not while a button is held
+    if (uiState == UI_IDLE && nextScreen != SCREEN_BPM && nextScreen != SCREEN_BLANK && nextScreen != SCREEN_LISTEN) {
+        timers.schedule(screenTimer, timerTicks(SCREEN_TIMEOUT));
+    } else {
+        timers.cancel(screenTimer);
+    }
+}
+
+// called by the timer wheel, from the main loop
+static void onScreenTimeout() {
+    if (uiState == UI_IDLE) {
+        setNextScreen(SCREEN_BPM);
     }
 }
 
+/*
+ * Runs once through everything that's happened since last time, and then
+ * sleeps until the next interrupt. Nothing here waits, so how long it takes is
+ * bounded by how many events can be queued up in the meantime: 7 beat events,
+ * 7 button events, 3 onsets, 7 MIDI messages or 3 sync pulses (when they're
+ * enabled), and the software timers for the ticks since last time (usually
+ * one or two). The worst time so far is shown on SCREEN_LOOP_TIME.
+ */
+static void loop() {
+    uint32_t start = micros();
+
+    service();
+    ButtonEvent e;
+    while (buttons.pop(e)) {
+        onButton(e);
+    }
+    if (nextScreen != currentScreen || screenDirty) {
+        updateScreen();
+    }
+
+    uint32_t elapsed = micros() - start;
+    if (elapsed > maxLoopTime) {
+        maxLoopTime = static_cast<uint16_t>(elapsed < UINT16_MAX ? elapsed : UINT16_MAX);
+        screenDirty |= currentScreen == SCREEN_LOOP_TIME;
+    }
+
+    // (an interrupt which queues something just before this only delays it
+    // until the next interrupt, which is at most a Timer0 compare away)
+    sleep_mode();
+}
+
 
 
 int main() {
     setup();
+    screenTimer = timers.create(onScreenTimeout);
+#if MIDI_ENABLED
+    midiTimer = timers.create(onMidiTimeout);
+#endif
+#if SYNC_ENABLED
+    syncAlignTimer = timers.create(onSyncAlign);
+    syncTimer = timers.create(onSyncTimeout);
+#endif
     timer0_1_start();
     m.start();
     sevenSeg.displayOn();
@@ -352,7 +951,7 @@ int main() {
     sei();
 
     // startup procedure
-    nextScreen = SCREEN_BPM;
+    setNextScreen(SCREEN_BPM);
     updateScreen();
 
     for (;;) {
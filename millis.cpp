@@ -6,84 +6,114 @@
 #include "millis.h"
 #include "byte_ops.h"
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 
-static constexpr uint8_t clockCyclesPerMicrosecond = F_CPU / 1000000L; // i.e F_CPU in MHz (16)
+static constexpr uint8_t clockCyclesPerMicrosecond = F_CPU / 1000000L; // i.e F_CPU in MHz (8)
 #define clockCyclesToMicroseconds(a) ( (a) / clockCyclesPerMicrosecond )
 #define microsecondsToClockCycles(a) ( (a) * clockCyclesPerMicrosecond )
 
 // the prescaler is set so that timer0 ticks every 64 clock cycles, and the
 // the overflow handler is called every 256 ticks.
 #define TIMER0_PRESCALER 64
-static constexpr uint8_t US_PER_TIMER0_TICK = clockCyclesToMicroseconds(TIMER0_PRESCALER); // 8us at 16Mhz and /64 prescaler
-static constexpr uint16_t US_PER_TIMER0_OVF = US_PER_TIMER0_TICK*256u;
-
-// the whole number of milliseconds per timer0 overflow
-static constexpr uint8_t MILLIS_INC = US_PER_TIMER0_OVF / 1000;
-
-// used to count fractional number of milliseconds per timer0 overflow
-// in TIMER0_OVF_VECT. Shift right by three to fit calculations into a byte.
-// Note for F_CPU of 8 and 16 MHz, this doesn't lose precision.
-static constexpr uint8_t FRACT_INC = (US_PER_TIMER0_OVF % 1000u) >> 3u;
-static constexpr uint8_t FRACT_MAX = 1000u >> 3u;
+static constexpr uint8_t US_PER_TIMER0_TICK = clockCyclesToMicroseconds(TIMER0_PRESCALER); // 8us at 8MHz and /64 prescaler
+static_assert(US_PER_TIMER0_TICK * clockCyclesPerMicrosecond == TIMER0_PRESCALER,
+        "timer0 ticks have to be a whole number of microseconds");
 
+/*
+ * Milliseconds are worked out exactly from timer0 ticks, using the fraction
+ * 1000/US_PER_TIMER0_TICK = TICKS_PER_MILLI_DEN/TICKS_PER_MILLI_NUM in lowest
+ * terms (125/1 at 8MHz). OVERFLOWS_PER_BLOCK overflows take exactly
+ * MILLIS_PER_BLOCK ms, which lets long gaps be skipped without dividing.
+ */
+static constexpr uint16_t gcd(uint16_t a, uint16_t b) {
+    return b == 0 ? a : gcd(b, a % b);
+}
+static constexpr uint8_t TICKS_PER_MILLI_NUM = US_PER_TIMER0_TICK / gcd(1000u, US_PER_TIMER0_TICK);
+static constexpr uint16_t TICKS_PER_MILLI_DEN = 1000u / gcd(1000u, US_PER_TIMER0_TICK);
+// (so a tick is TICKS_PER_MILLI_NUM units, and a millisecond is TICKS_PER_MILLI_DEN)
+static constexpr uint16_t UNITS_PER_OVF = 256u * TICKS_PER_MILLI_NUM;
+// the whole number of milliseconds per timer0 overflow, and what's left over
+static constexpr uint8_t MILLIS_INC = UNITS_PER_OVF / TICKS_PER_MILLI_DEN;
+static constexpr uint16_t FRACT_INC = UNITS_PER_OVF % TICKS_PER_MILLI_DEN;
+static constexpr uint16_t OVERFLOWS_PER_BLOCK = TICKS_PER_MILLI_DEN / gcd(TICKS_PER_MILLI_DEN, UNITS_PER_OVF);
+static constexpr uint16_t MILLIS_PER_BLOCK = static_cast<uint32_t>(OVERFLOWS_PER_BLOCK) * UNITS_PER_OVF / TICKS_PER_MILLI_DEN;
+static_assert(TICKS_PER_MILLI_DEN * (OVERFLOWS_PER_BLOCK + 1u) < 65536u, "the clock's fraction has to fit in 16 bits");
+
+// the only thing the ISR updates
 static volatile uint32_t timer0_overflow_count = 0;
-static volatile uint32_t timer0_millis = 0;
-
-void millis_timer0_callback() {
-    // keep track of fractional timer values
-    static uint8_t timer0_fract = 0;
-
-    // copy to local variable to avoid double memory read of volatile var
-    auto m = timer0_millis;
-
-    m += MILLIS_INC;
-    timer0_fract += FRACT_INC;
 
-    if (timer0_fract >= FRACT_MAX) {
-        timer0_fract -= FRACT_MAX;
-        m += 1;
-    }
+/*
+ * The millisecond clock, as of the last time millis() was called: the time
+ * at timer0_overflow_count = clock_overflows is clock_millis ms, plus
+ * clock_fract/TICKS_PER_MILLI_DEN.
+ */
+static uint32_t clock_overflows = 0;
+static uint32_t clock_millis = 0;
+static uint16_t clock_fract = 0;
 
-    timer0_millis = m;
+void millis_timer0_callback() {
     timer0_overflow_count++;
 }
 
-uint32_t millis() {
-    // disable interrupts while we read timer0_millis or we might get an
-    // inconsistent value (e.g. in the middle of a write to timer0_millis)
+/*
+ * Reads the overflow count and timer0 together, counting an overflow which
+ * hasn't been handled yet, since interrupts are disabled.
+ */
+static inline uint32_t read_overflows(uint8_t& t) {
     uint8_t oldSREG = SREG;
     cli();
-    auto m = timer0_millis;
+    t = TCNT0;
+    auto m = timer0_overflow_count;
+    // add 1 if there's a pending overflow interrupt for timer 0
+    if (bitRead(TIFR0, TOV0) && (t != 255)) {
+        m++;
+    }
     SREG = oldSREG;
     return m;
 }
 
-uint32_t micros() {
-    uint8_t oldSREG = SREG;
-
-    cli();
-    auto t = TCNT0;
-    // add 1 if there's a pending overflow interrupt for timer 0
-    auto m = timer0_overflow_count;
-    if (bitRead(TIFR0, TOV0) && (t != 255)) {
-        m++;
+uint32_t millis() {
+    uint8_t t;
+    auto m = read_overflows(t);
+
+    // bring the clock up to date
+    uint32_t elapsed = m - clock_overflows;
+    clock_overflows = m;
+    if (elapsed >= OVERFLOWS_PER_BLOCK) {
+        // (only if it hasn't been called for a while)
+        uint32_t blocks = elapsed / OVERFLOWS_PER_BLOCK;
+        clock_millis += blocks * MILLIS_PER_BLOCK;
+        elapsed -= blocks * OVERFLOWS_PER_BLOCK;
+    }
+    uint16_t fract = clock_fract + static_cast<uint16_t>(elapsed) * FRACT_INC;
+    clock_millis += static_cast<uint16_t>(elapsed) * MILLIS_INC;
+    while (fract >= TICKS_PER_MILLI_DEN) {
+        fract -= TICKS_PER_MILLI_DEN;
+        clock_millis++;
     }
+    clock_fract = fract;
 
-    SREG = oldSREG;
+    // and add on the part of an overflow since then
+    return clock_millis + (fract + t * TICKS_PER_MILLI_NUM) / TICKS_PER_MILLI_DEN;
+}
+
+uint32_t micros() {
+    uint8_t t;
+    auto m = read_overflows(t);
 
     // m*US_PER_TIMER0_OVF + t*clockCyclesToMicroSeconds(64);
     // = (m*256 + t)*clockCyclesToMicroSeconds(64);
+    // (a shift, since it's a power of two at 8MHz)
 
     return ((m << 8u) + t) * US_PER_TIMER0_TICK;
 }
 
 void delay(uint32_t ms) {
-    auto start = micros();
-    while (ms > 0) {
-        while (ms > 0 && (micros() - start) >= 1000) {
-            ms--;
-            start += 1000;
-        }
+    // Timer0 wakes the CPU up at least every overflow, which is less than a ms
+    auto start = millis();
+    while (millis() - start < ms) {
+        // (idle mode, since SMCR is never changed)
+        sleep_mode();
     }
 }
 
@@ -10,10 +10,12 @@
 
 void millis_timer0_callback();
 // measures milliseconds since timer0 started
+// (this updates a clock kept outside the ISR, so only call it from the main loop)
 uint32_t millis();
-// counts microseconds, but periodically overflows
+// counts microseconds, but periodically overflows; can be called from ISRs
 uint32_t micros();
 
+// sleeps until the given number of milliseconds have passed (needs interrupts on)
 void delay(uint32_t ms);
 
 // need this to actually make it all work
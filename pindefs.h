@@ -36,6 +36,54 @@ static constexpr unsigned char digit_pin[] {DIGIT_0, DIGIT_1, DIGIT_2};
 #define SWITCHU PORTC2
 // stop/start switch
 #define SWITCHS PORTC3
+// the rest of the port is other things' (see ONSET_PIN, MIDI_RX_SEGMENT_PIN)
+#define BUTTON_PINS (_BV(SWITCHC) | _BV(SWITCHD) | _BV(SWITCHU) | _BV(SWITCHS))
+
+/* A piezo pickup or mic preamp, biased to half the supply, for following the
+ * player (see OnsetDetector). PC4 and PC5 are the only ADC pins left over.
+ */
+#define ONSET_PORT PORTC
+#define ONSET_PIN PORTC5
+#define ONSET_ADC_CHANNEL 5
+#define ONSET_DIGITAL_DISABLE ADC5D
+
+/* MIDI (see Midi.h) needs the USART's TXD and RXD pins, PD1 and PD0, which
+ * otherwise drive the middle and top left segments. Boards with MIDI sockets
+ * have those segments wired to PB4 and PC4 instead, and are built with
+ * MIDI_ENABLED set to 1.
+ */
+#ifndef MIDI_ENABLED
+#define MIDI_ENABLED 0
+#endif
+#define MIDI_TX_SEGMENT_BIT PORTD1
+#define MIDI_TX_SEGMENT_PORT PORTB
+#define MIDI_TX_SEGMENT_DDR DDRB
+#define MIDI_TX_SEGMENT_PIN PORTB4
+#define MIDI_RX_SEGMENT_BIT PORTD0
+#define MIDI_RX_SEGMENT_PORT PORTC
+#define MIDI_RX_SEGMENT_DDR DDRC
+#define MIDI_RX_SEGMENT_PIN PORTC4
+
+/* Sync pulses (see Sync.h) need Timer1's input capture pin, ICP1 (PB0), and
+ * compare output, OC1A (PB1), which otherwise drive digits 0 and 1. Boards
+ * with sync sockets have those digits wired to PB4 and PC4 instead, and are
+ * built with SYNC_ENABLED set to 1. Those are the same spare pins that MIDI
+ * uses, so only one of them can be enabled.
+ */
+#ifndef SYNC_ENABLED
+#define SYNC_ENABLED 0
+#endif
+#if SYNC_ENABLED && MIDI_ENABLED
+#error "MIDI and sync pulses both need PB4 and PC4"
+#endif
+#define SYNC_IN_DDR DDRB
+#define SYNC_IN_PIN PORTB0
+#define SYNC_OUT_DDR DDRB
+#define SYNC_OUT_PIN PORTB1
+#define SYNC_DIGIT_0_PIN PORTB4
+#define SYNC_DIGIT_1_PORT PORTC
+#define SYNC_DIGIT_1_DDR DDRC
+#define SYNC_DIGIT_1_PIN PORTC4
 
 #define LED_PORT PORTB
 #define LED_PIN PORTB5
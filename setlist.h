@@ -0,0 +1,16 @@
+// Generated from setlist.txt by setlist_compiler; do not edit
+#include <avr/pgmspace.h>
+
+static const uint8_t setlist[] PROGMEM = {
+    2, // songs
+    // Count in and groove
+    4, // sections
+      2,  16,  39,   4,   1, 171, 170, 170, 170,
+     16,  16,  39,   4,   2, 171, 170, 170, 170,
+      8, 194,  51,   7,   2, 235, 174, 170, 170,
+      4, 112,  23,   3,   3, 171, 170, 170, 170,
+    // Ballad
+    2, // sections
+      4,  32,  28,   4,   1, 171, 170, 170, 170,
+     32,  32,  28,   6,   1, 219, 162, 170, 170,
+};